@@ -37,9 +37,10 @@ LEAN_EXPORT lean_obj_res xeus_kernel_init(lean_obj_arg connection_file) {
     return lean_io_result_mk_ok(lean_box(0));  // Option.none
 }
 
-// IO String → return empty string
-LEAN_EXPORT lean_obj_res xeus_kernel_poll(lean_obj_arg handle, uint32_t timeout_ms) {
-    return lean_io_result_mk_ok(lean_mk_string(""));
+// IO (Array KernelEvent) → return #[]
+LEAN_EXPORT lean_obj_res xeus_kernel_poll_batch(lean_obj_arg handle, uint32_t timeout_ms,
+                                                 uint32_t max) {
+    return lean_io_result_mk_ok(lean_mk_empty_array());
 }
 
 // IO Unit → no-op
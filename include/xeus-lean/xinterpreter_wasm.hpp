@@ -57,6 +57,7 @@ namespace xeus_lean
 
         bool initialize_lean_runtime();
         std::string call_lean_repl(const std::string& code, int env);
+        std::string call_lean_reset();
     };
 }
 
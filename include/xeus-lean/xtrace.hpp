@@ -0,0 +1,159 @@
+/***************************************************************************
+* Copyright (c) 2025, xeus-lean contributors
+*
+* Distributed under the terms of the Apache Software License 2.0.
+*
+* The full license is in the file LICENSE, distributed with this software.
+****************************************************************************/
+
+#ifndef XEUS_LEAN_XTRACE_HPP
+#define XEUS_LEAN_XTRACE_HPP
+
+// Leveled, per-subsystem tracing for the C++ side of the kernel. Same
+// environment variables and record format as the Lean side
+// (src/REPL/Util/Trace.lean):
+//
+//   XLEAN_DEBUG=1|true          default threshold becomes `debug`
+//   XLEAN_TRACE=warn,ffi=trace  `level` sets the default, `sub=level`
+//                               overrides one subsystem
+//
+//   [xlean debug ffi] execute request code_len=42
+//
+// XLEAN_LOG only evaluates its message (a stream expression) when the
+// record is enabled; the disabled path is one integer compare.
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace xeus_lean
+{
+namespace trace
+{
+    enum class level : int { error = 0, warn, info, debug, trace };
+
+    inline const char* level_name(level l)
+    {
+        static const char* const names[] = {"error", "warn", "info", "debug", "trace"};
+        return names[static_cast<int>(l)];
+    }
+
+    inline bool parse_level(const std::string& s, level& out)
+    {
+        static const char* const names[] = {"error", "warn", "info", "debug", "trace"};
+        for (int i = 0; i < 5; ++i)
+        {
+            if (s == names[i])
+            {
+                out = static_cast<level>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    struct config
+    {
+        level default_level = level::warn;
+        std::vector<std::pair<std::string, level>> rules;
+        level max_level = level::warn;
+
+        static config from_env()
+        {
+            config c;
+            if (const char* d = std::getenv("XLEAN_DEBUG"))
+            {
+                if (std::strcmp(d, "1") == 0 || std::strcmp(d, "true") == 0)
+                {
+                    c.default_level = level::debug;
+                }
+            }
+            if (const char* spec = std::getenv("XLEAN_TRACE"))
+            {
+                std::string s(spec);
+                std::size_t start = 0;
+                while (start <= s.size())
+                {
+                    std::size_t comma = s.find(',', start);
+                    std::string item = s.substr(start, comma == std::string::npos ? std::string::npos
+                                                                                  : comma - start);
+                    std::size_t eq = item.find('=');
+                    level l;
+                    if (eq == std::string::npos)
+                    {
+                        if (parse_level(item, l)) c.default_level = l;
+                    }
+                    else if (parse_level(item.substr(eq + 1), l))
+                    {
+                        std::string sub = item.substr(0, eq);
+                        if (sub == "*") c.default_level = l;
+                        else c.rules.emplace_back(std::move(sub), l);
+                    }
+                    if (comma == std::string::npos) break;
+                    start = comma + 1;
+                }
+            }
+            c.max_level = c.default_level;
+            for (auto& r : c.rules) c.max_level = std::max(c.max_level, r.second);
+            return c;
+        }
+
+        level threshold(const char* sub) const
+        {
+            for (auto& r : rules)
+            {
+                if (r.first == sub) return r.second;
+            }
+            return default_level;
+        }
+    };
+
+    inline const config& current()
+    {
+        static const config c = config::from_env();
+        return c;
+    }
+
+    inline bool enabled(const char* sub, level l)
+    {
+        const config& c = current();
+        return l <= c.max_level && l <= c.threshold(sub);
+    }
+
+    // ` key=value` field for a record: XLEAN_LOG("ffi", debug, "msg" << kv("n", 3)).
+    template <class T>
+    struct field
+    {
+        const char* key;
+        const T& value;
+    };
+
+    template <class T>
+    field<T> kv(const char* key, const T& value)
+    {
+        return {key, value};
+    }
+
+    template <class T>
+    std::ostream& operator<<(std::ostream& os, const field<T>& f)
+    {
+        return os << ' ' << f.key << '=' << f.value;
+    }
+}
+}
+
+#define XLEAN_LOG(sub, lvl, msg)                                                              \
+    do                                                                                        \
+    {                                                                                         \
+        if (::xeus_lean::trace::enabled(sub, ::xeus_lean::trace::level::lvl))                 \
+        {                                                                                     \
+            std::cerr << "[xlean " << ::xeus_lean::trace::level_name(::xeus_lean::trace::level::lvl) \
+                      << ' ' << sub << "] " << msg << std::endl;                              \
+        }                                                                                     \
+    } while (0)
+
+#endif
@@ -0,0 +1,110 @@
+/***************************************************************************
+* Copyright (c) 2025, xeus-lean contributors
+*
+* Distributed under the terms of the Apache Software License 2.0.
+*
+* The full license is in the file LICENSE, distributed with this software.
+****************************************************************************/
+
+#ifndef XEUS_LEAN_XUTF8_HPP
+#define XEUS_LEAN_XUTF8_HPP
+
+// Cursor positions and identifiers in cell source, shared by the native
+// and the WASM kernel. Jupyter counts cursor positions in codepoints;
+// the source is UTF-8, and Lean identifiers may contain non-ASCII
+// letters (`α`, `ℝ`, `x₁`).
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace xeus_lean
+{
+    // Decode the UTF-8 codepoint starting at s[i]; sets `len` to its byte
+    // length. Malformed bytes decode as themselves with length 1.
+    inline uint32_t utf8_decode_at(const std::string& s, std::size_t i, std::size_t& len)
+    {
+        unsigned char c = static_cast<unsigned char>(s[i]);
+        len = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        if (len == 1 || i + len > s.size()) { len = 1; return c; }
+        uint32_t cp = c & (0xFF >> (len + 1));
+        for (std::size_t k = 1; k < len; ++k) {
+            cp = (cp << 6) | (static_cast<unsigned char>(s[i + k]) & 0x3F);
+        }
+        return cp;
+    }
+
+    // Byte offset of the `cp_offset`-th codepoint of `s`. Jupyter (protocol
+    // >= 5.2) counts cursor positions in unicode codepoints.
+    inline std::size_t utf8_byte_offset(const std::string& s, std::size_t cp_offset)
+    {
+        std::size_t i = 0;
+        for (std::size_t n = 0; n < cp_offset && i < s.size(); ++n) {
+            std::size_t len;
+            utf8_decode_at(s, i, len);
+            i += len;
+        }
+        return i;
+    }
+
+    inline std::size_t utf8_codepoint_count(const std::string& s, std::size_t bytes)
+    {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < bytes && i < s.size(); ++n) {
+            std::size_t len;
+            utf8_decode_at(s, i, len);
+            i += len;
+        }
+        return n;
+    }
+
+    // Mirrors Lean's `isLetterLike` / `isSubScriptAlnum` plus the ASCII
+    // identifier characters, so the completion prefix is cut where Lean's
+    // own tokenizer would cut it. `.` is included to keep dotted names
+    // (`Nat.su`) together.
+    inline bool is_lean_ident_char(uint32_t c)
+    {
+        if (c < 0x80) {
+            return std::isalnum(static_cast<int>(c)) || c == '_' || c == '\'' ||
+                   c == '!' || c == '?' || c == '.';
+        }
+        return (0x3B1 <= c && c <= 0x3C9 && c != 0x3BB) ||            // lower greek, but lambda
+               (0x391 <= c && c <= 0x3A9 && c != 0x3A0 && c != 0x3A3) || // upper greek, but Pi and Sigma
+               (0x3CA <= c && c <= 0x3FB) ||                           // Coptic letters
+               (0x1F00 <= c && c <= 0x1FFE) ||                         // Polytonic Greek
+               (0x2100 <= c && c <= 0x214F) ||                         // Letter-like block
+               (0x1D49C <= c && c <= 0x1D59F) ||                       // Math alnum symbols
+               (0x2080 <= c && c <= 0x2089) ||                         // subscript digits
+               (0x2090 <= c && c <= 0x209C) ||                         // subscript letters
+               (0x1D62 <= c && c <= 0x1D6A);
+    }
+
+    // Byte offset where the Lean identifier ending at byte `end` starts.
+    inline std::size_t lean_ident_start(const std::string& code, std::size_t end)
+    {
+        std::size_t start = end;
+        while (start > 0) {
+            std::size_t prev = start - 1;
+            while (prev > 0 && (static_cast<unsigned char>(code[prev]) & 0xC0) == 0x80) --prev;
+            std::size_t len;
+            if (!is_lean_ident_char(utf8_decode_at(code, prev, len))) break;
+            start = prev;
+        }
+        return start;
+    }
+
+    // Byte offset just past the Lean identifier starting at byte `begin`.
+    inline std::size_t lean_ident_end(const std::string& code, std::size_t begin)
+    {
+        std::size_t end = begin;
+        while (end < code.size()) {
+            std::size_t len;
+            if (!is_lean_ident_char(utf8_decode_at(code, end, len))) break;
+            end += len;
+        }
+        return end;
+    }
+}  // namespace xeus_lean
+
+#endif
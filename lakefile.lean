@@ -52,6 +52,12 @@ lean_exe «convert-test» where
   srcDir := "src"
   supportInterpreter := true
 
+-- Incremental re-execution of edited cells (`REPL.Frontend`).
+lean_exe «incremental-test» where
+  root := `IncrementalTest
+  srcDir := "src"
+  supportInterpreter := true
+
 -- MCP server: lets a local Claude Code instance drive notebook
 -- editing, Lean evaluation, and project ops against a running xlean
 -- session (or, in v0, against a freshly-spawned `lean --stdin`).
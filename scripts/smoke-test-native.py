@@ -2,9 +2,11 @@
 """Smoke-test the native xlean kernel via jupyter_client.
 
 Starts the kernel through the registered kernelspec, evaluates a
-small Lean program, and asserts the output. Exits non-zero if the
-kernel doesn't start, the eval doesn't produce a stream message, or
-the produced text doesn't match.
+small Lean program, and asserts the output. Then starts the same binary
+as a zygote (`xlean --zygote`) and runs a few cells in a kernel forked
+from it (`xlean --attach`). Exits non-zero if the kernel doesn't start,
+the eval doesn't produce a stream message, or the produced text doesn't
+match.
 
 Used by CI and by the docs/tutorials/docker-native.md happy-path
 check. Keep this self-contained — no test-framework dependency.
@@ -20,11 +22,17 @@ Exit codes:
 """
 
 import argparse
+import json
+import os
+import shutil
+import subprocess
 import sys
+import tempfile
 import textwrap
 import time
 
 try:
+    from jupyter_client.kernelspec import KernelSpecManager
     from jupyter_client.manager import KernelManager
 except ImportError:
     sys.stderr.write(
@@ -34,7 +42,12 @@ except ImportError:
     sys.exit(1)
 
 
-# Each case is (description, lean code, substring expected in stdout/stream).
+# Where the %save-session / %restore-session cases keep the session.
+SESSION_DIR = tempfile.mkdtemp(prefix="xlean-smoke-session-")
+
+# Each case is (description, lean code, substring expected in
+# stdout/stream[, substring that must not appear]). Cases run in order on
+# one kernel, so later ones see what earlier ones defined.
 CASES = [
     ("arithmetic", "#eval (1 + 2 + 3)", "6"),
     ("definition + use",
@@ -46,19 +59,108 @@ CASES = [
     ("IO println",
         '#eval IO.println "hello from native xlean"',
         "hello from native xlean"),
+    ("%timeit", "%timeit -n 3\n#eval square 3", "3 runs: min"),
+    # Re-running a cell that redeclares `square` forks the chain at the
+    # cell that owns it; the IO println cell ran on the old one.
+    ("re-run a redeclaring cell",
+        textwrap.dedent("""\
+            def square (x : Nat) : Nat := x * x * 1
+            #eval square 5
+        """),
+        "are now stale", "already been declared"),
+    ("%save-session", f"%save-session {SESSION_DIR}", "Saved"),
+    ("%reset", "%reset", "Session reset"),
+    ("redefine after %reset",
+        textwrap.dedent("""\
+            def square (x : Nat) : Nat := x + x
+            #eval square 4
+        """),
+        "8", "already been declared"),
+    # Back to the square saved above, from its .olean files.
+    ("%restore-session", f"%restore-session {SESSION_DIR}", "Restored"),
+    ("use a restored definition", "#eval square 5", "25"),
+    # A new cell that shares one name with an earlier cell is not a new
+    # version of it: no fork, and the earlier cells stay.
+    ("define two names in one cell",
+        "def aux : Nat := 10\ndef total : Nat := aux + 1\n#eval total", "11"),
+    ("an unrelated cell reusing one name",
+        "def aux : Nat := 20\n#eval square 2", "already been declared", "are now stale"),
+    ("earlier cells survive it", "#eval total + square 2", "15"),
 ]
 
 
-def run_one(km, code: str, timeout: float = 60.0) -> str:
-    """Execute `code` in the kernel, return concatenated text outputs."""
+# Shell-channel requests answered from state the cases above leave
+# behind: (description, request, code, cursor, substring expected in
+# the reply). Cursors are codepoint offsets, as in the protocol.
+SHELL_CASES = [
+    ("complete a cell-defined name", "complete", "#eval squ", 9, "square"),
+    ("inspect an executed cell",
+        "inspect", CASES[1][1], CASES[1][1].index("square 7") + 2, "Nat"),
+    ("inspect unexecuted source", "inspect", "#check Nat.succ", 12, "Nat"),
+]
+
+
+# A cell interrupted after a few seconds (Jupyter's interrupt, SIGINT):
+# (description, lean code, seconds, substring expected in the output).
+# `decide` evaluates the proposition in the elaborator, which checks the
+# cancel token as it goes; `maxHeartbeats 0` keeps a timeout from ending
+# it first.
+INTERRUPT_CASE = (
+    "interrupt a long decide",
+    textwrap.dedent("""\
+        set_option maxHeartbeats 0 in
+        example : (List.range 1000000).all (fun n => n + 1 != 0) = true := by decide
+    """),
+    3.0, "Interrupted")
+
+# Run after INTERRUPT_CASE: the interrupted cell left nothing behind.
+AFTER_INTERRUPT_CASES = [
+    ("definitions survive an interrupt", "#eval total + square 2", "15"),
+]
+
+# Cells run in a kernel forked from a zygote: (description, lean code,
+# substring expected in stdout/stream).
+ZYGOTE_CASES = [
+    ("eval in a forked kernel",
+        "def cube (x : Nat) : Nat := x * x * x\n#eval cube 3", "27"),
+    ("a forked kernel keeps its definitions", "#eval cube 2 + 1", "9"),
+]
+
+
+def shell_request(km, kind: str, code: str, cursor: int, timeout: float) -> str:
+    """Send a complete/inspect request, return its reply content as text."""
+    kc = km.client()
+    kc.start_channels()
+    try:
+        kc.wait_for_ready(timeout=timeout)
+        if kind == "complete":
+            kc.complete(code, cursor)
+        else:
+            kc.inspect(code, cursor)
+        reply = kc.get_shell_msg(timeout=timeout)
+        content = reply.get("content", {})
+        if kind == "complete":
+            return " ".join(content.get("matches", []))
+        return str(content.get("data", {}).get("text/plain", ""))
+    finally:
+        kc.stop_channels()
+
+
+def run_one(km, code: str, timeout: float = 60.0, interrupt_after: float = None) -> str:
+    """Execute `code` in the kernel, return concatenated text outputs.
+    With `interrupt_after`, interrupt the kernel that many seconds in."""
     kc = km.client()
     kc.start_channels()
     try:
         kc.wait_for_ready(timeout=timeout)
         msg_id = kc.execute(code)
         outputs = []
-        deadline = time.monotonic() + timeout
+        start = time.monotonic()
+        deadline = start + timeout
         while time.monotonic() < deadline:
+            if interrupt_after is not None and time.monotonic() - start >= interrupt_after:
+                km.interrupt_kernel()
+                interrupt_after = None
             try:
                 msg = kc.get_iopub_msg(timeout=1.0)
             except Exception:
@@ -82,6 +184,75 @@ def run_one(km, code: str, timeout: float = 60.0) -> str:
         kc.stop_channels()
 
 
+def run_cases(km, cases, timeout: float) -> int:
+    """Run `cases` (see CASES) in order on `km`; return how many failed."""
+    failed = 0
+    for desc, code, expected, *absent in cases:
+        print(f"[smoke] case: {desc}", flush=True)
+        try:
+            got = run_one(km, code, timeout=timeout)
+        except Exception as e:
+            sys.stderr.write(f"  EXECUTE FAILED: {e}\n")
+            failed += 1
+            continue
+        unwanted = [a for a in absent if a in got]
+        if expected in got and not unwanted:
+            print(f"  OK (output contains {expected!r})", flush=True)
+        else:
+            sys.stderr.write(
+                f"  MISMATCH: expected substring {expected!r}"
+                + (f", unexpected {unwanted!r}" if unwanted else "") + "\n"
+                f"  got: {got!r}\n"
+            )
+            failed += 1
+    return failed
+
+
+def run_zygote(kernel: str, timeout: float) -> int:
+    """Start `xlean --zygote`, run ZYGOTE_CASES in a kernel attached to
+    it, return how many failed."""
+    spec = KernelSpecManager().get_kernel_spec(kernel)
+    tmp = tempfile.mkdtemp(prefix="xlean-smoke-zygote-")
+    sock = os.path.join(tmp, "zygote.sock")
+    env = {**os.environ, **spec.env}
+    print(f"[smoke] starting zygote: {sock}", flush=True)
+    zygote = subprocess.Popen([spec.argv[0], "--zygote", sock], env=env)
+    km = None
+    try:
+        deadline = time.monotonic() + timeout
+        while not os.path.exists(sock):
+            if zygote.poll() is not None or time.monotonic() > deadline:
+                sys.stderr.write("[smoke] zygote did not start listening\n")
+                return 1
+            time.sleep(0.2)
+        # A kernelspec that attaches to the zygote, as in DEPLOYMENT.md.
+        spec_dir = os.path.join(tmp, "kernels", "xlean-attach")
+        os.makedirs(spec_dir)
+        with open(os.path.join(spec_dir, "kernel.json"), "w") as f:
+            json.dump({"display_name": "Lean 4 (zygote)", "language": "lean4",
+                       "argv": [spec.argv[0], "--attach", sock, "{connection_file}"],
+                       "interrupt_mode": "signal", "env": spec.env}, f)
+        km = KernelManager(
+            kernel_name="xlean-attach",
+            kernel_spec_manager=KernelSpecManager(kernel_dirs=[os.path.dirname(spec_dir)]))
+        try:
+            km.start_kernel()
+        except Exception as e:
+            sys.stderr.write(f"[smoke] attach failed: {e}\n")
+            km = None
+            return 1
+        return run_cases(km, ZYGOTE_CASES, timeout)
+    finally:
+        if km is not None:
+            km.shutdown_kernel(now=True)
+        zygote.terminate()
+        try:
+            zygote.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            zygote.kill()
+        shutil.rmtree(tmp, ignore_errors=True)
+
+
 def main():
     ap = argparse.ArgumentParser()
     ap.add_argument("--kernel", default="xlean",
@@ -100,16 +271,31 @@ def main():
 
     failed = 0
     try:
-        for desc, code, expected in CASES:
+        failed += run_cases(km, CASES, args.timeout)
+        desc, code, after, expected = INTERRUPT_CASE
+        print(f"[smoke] case: {desc}", flush=True)
+        try:
+            got = run_one(km, code, timeout=args.timeout, interrupt_after=after)
+            if expected in got:
+                print(f"  OK (output contains {expected!r})", flush=True)
+            else:
+                sys.stderr.write(
+                    f"  MISMATCH: expected substring {expected!r}\n  got: {got!r}\n")
+                failed += 1
+        except Exception as e:
+            sys.stderr.write(f"  EXECUTE FAILED: {e}\n")
+            failed += 1
+        failed += run_cases(km, AFTER_INTERRUPT_CASES, args.timeout)
+        for desc, kind, code, cursor, expected in SHELL_CASES:
             print(f"[smoke] case: {desc}", flush=True)
             try:
-                got = run_one(km, code, timeout=args.timeout)
+                got = shell_request(km, kind, code, cursor, timeout=args.timeout)
             except Exception as e:
-                sys.stderr.write(f"  EXECUTE FAILED: {e}\n")
+                sys.stderr.write(f"  REQUEST FAILED: {e}\n")
                 failed += 1
                 continue
             if expected in got:
-                print(f"  OK (output contains {expected!r})", flush=True)
+                print(f"  OK (reply contains {expected!r})", flush=True)
             else:
                 sys.stderr.write(
                     f"  MISMATCH: expected substring {expected!r}\n"
@@ -118,6 +304,9 @@ def main():
                 failed += 1
     finally:
         km.shutdown_kernel(now=True)
+        shutil.rmtree(SESSION_DIR, ignore_errors=True)
+
+    failed += run_zygote(args.kernel, args.timeout)
 
     if failed:
         sys.stderr.write(f"[smoke] {failed} case(s) failed\n")
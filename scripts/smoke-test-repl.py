@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+"""Smoke-test `repl --batch`, the REPL's NDJSON mode.
+
+Starts the repl binary with --batch, sends it requests one JSON object
+per line, and checks the responses: ids, requests answered concurrently,
+bad input, deferred and skipped proof checks (`verify`), and paging
+through InfoTrees (`infotreeOf`). Exits non-zero if the binary doesn't
+start, a response doesn't come, or one doesn't match.
+
+Used by CI after `lake build repl`. Keep this self-contained — no
+test-framework dependency.
+
+Usage:
+    python3 scripts/smoke-test-repl.py [--repl .lake/build/bin/repl]
+
+Exit codes:
+    0   all checks passed
+    1   repl start failed
+    2   a response timed out
+    3   response mismatch
+"""
+
+import argparse
+import json
+import os
+import queue
+import subprocess
+import sys
+import tempfile
+import threading
+
+
+class Repl:
+    """A `repl --batch` process, answered line by line."""
+
+    def __init__(self, path: str, timeout: float):
+        self.proc = subprocess.Popen(
+            [path, "--batch"], stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+            text=True, bufsize=1)
+        self.timeout = timeout
+        self.lines = 0  # requests sent so far: the next one's default id
+        self.responses = queue.Queue()
+        threading.Thread(target=self._read, daemon=True).start()
+
+    def _read(self):
+        for line in self.proc.stdout:
+            self.responses.put(json.loads(line))
+
+    def send(self, *requests) -> dict:
+        """Send `requests` together (dicts, or raw lines as strings), wait
+        for one response per request, return them by id."""
+        for r in requests:
+            self.proc.stdin.write((r if isinstance(r, str) else json.dumps(r)) + "\n")
+            self.lines += 1
+        self.proc.stdin.flush()
+        out = {}
+        for _ in requests:
+            r = self.responses.get(timeout=self.timeout)
+            out[r.get("id")] = r
+        return out
+
+    def close(self):
+        self.proc.stdin.close()
+        try:
+            self.proc.wait(timeout=self.timeout)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
+
+
+failed = 0
+
+
+def check(desc: str, ok: bool, got) -> None:
+    global failed
+    if ok:
+        print(f"[repl] OK: {desc}", flush=True)
+    else:
+        sys.stderr.write(f"[repl] MISMATCH: {desc}\n  got: {got!r}\n")
+        failed += 1
+
+
+def messages(r: dict) -> str:
+    return "\n".join(m.get("data", "") for m in r.get("messages", []))
+
+
+def batch_cases(repl: Repl) -> None:
+    r = repl.send({"id": "def", "cmd": "def f (x : Nat) := x + 1"})["def"]
+    check("command answers with an env", "env" in r, r)
+    env = r["env"]
+
+    # Both read `env`, so they run in input order; both must be answered.
+    rs = repl.send({"id": "a", "cmd": "#eval f 1", "env": env},
+                   {"id": "b", "cmd": "#eval f 2", "env": env})
+    check("two requests on one env are both answered", set(rs) == {"a", "b"}, rs)
+    check("each response carries its request's id",
+          "2" in messages(rs.get("a", {})) and "3" in messages(rs.get("b", {})), rs)
+
+    n = repl.lines
+    rs = repl.send({"cmd": "#eval f 0", "env": env})
+    check("a request without an id gets its line number", n in rs, rs)
+
+    n = repl.lines
+    rs = repl.send("not json")
+    check("an unparseable line gets an error",
+          "Could not parse JSON" in rs.get(n, {}).get("message", ""), rs)
+
+
+def verify_cases(repl: Repl) -> None:
+    r = repl.send({"id": "thm", "cmd": "theorem t : 1 + 1 = 2 := by sorry"})["thm"]
+    sorries = r.get("sorries", [])
+    check("a sorry records a proof state", len(sorries) == 1, r)
+    if not sorries:
+        return
+    start = sorries[0]["proofState"]
+
+    r = repl.send({"id": "defer", "tactic": "rfl", "proofState": start,
+                   "checkProof": "defer"})["defer"]
+    check("checkProof defer answers before the check",
+          "deferred" in r.get("proofStatus", ""), r)
+    r = repl.send({"id": "v1", "verify": r.get("proofState")})["v1"]
+    check("verify waits for the deferred check",
+          r.get("proofStatus") == "Completed", r)
+
+    r = repl.send({"id": "skip", "tactic": "rfl", "proofState": start,
+                   "checkProof": "skip"})["skip"]
+    check("checkProof skip answers without a check",
+          r.get("proofStatus") == "Not verified: skipped", r)
+    r = repl.send({"id": "v2", "verify": r.get("proofState")})["v2"]
+    check("verify checks a skipped proof on demand",
+          r.get("proofStatus") == "Completed", r)
+
+    r = repl.send({"id": "v3", "verify": 1000000})["v3"]
+    check("verify of an unknown proof state is an error", "message" in r, r)
+
+
+def infotree_cases(repl: Repl) -> None:
+    r = repl.send({"id": "two", "cmd": "theorem two : 1 + 1 = 2 := by decide",
+                   "infotree": "full"})["two"]
+    env = r["env"]
+
+    page = repl.send({"id": "p1", "infotreeOf": env, "limit": 2})["p1"]
+    first = [n.get("path") for n in page.get("nodes", [])]
+    check("infotreeOf returns a page of nodes",
+          len(first) == 2 and page.get("count") == 2 and page.get("next") == 2, page)
+    page = repl.send({"id": "p2", "infotreeOf": env, "offset": page.get("next", 2),
+                      "limit": 2})["p2"]
+    second = [n.get("path") for n in page.get("nodes", [])]
+    check("the next page starts after the last one",
+          len(second) > 0 and not any(p in first for p in second), page)
+
+    r = repl.send({"id": "sub", "infotreeOf": env, "path": [0], "limit": 1})["sub"]
+    check("path selects a subtree",
+          [n.get("path") for n in r.get("nodes", [])] == [[0]], r)
+
+    fd, path = tempfile.mkstemp(suffix=".ndjson")
+    os.close(fd)
+    try:
+        r = repl.send({"id": "to", "infotreeOf": env, "infotreeTo": path})["to"]
+        with open(path) as f:
+            lines = [json.loads(l) for l in f if l.strip()]
+        check("infotreeTo writes one node per line",
+              "nodes" not in r and r.get("count") == len(lines) > 4
+              and all("path" in n for n in lines), (r, len(lines)))
+    finally:
+        os.unlink(path)
+
+    r = repl.send({"id": "gone", "infotreeOf": 1000000})["gone"]
+    check("infotreeOf of an env without trees is an error",
+          "No InfoTrees kept" in r.get("message", ""), r)
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--repl", default=".lake/build/bin/repl",
+                    help="repl binary (default: .lake/build/bin/repl)")
+    ap.add_argument("--timeout", type=float, default=120.0,
+                    help="per-response timeout, seconds (default 120)")
+    args = ap.parse_args()
+
+    print(f"[repl] starting: {args.repl} --batch", flush=True)
+    try:
+        repl = Repl(args.repl, args.timeout)
+    except OSError as e:
+        sys.stderr.write(f"[repl] start failed: {e}\n")
+        sys.exit(1)
+
+    try:
+        batch_cases(repl)
+        verify_cases(repl)
+        infotree_cases(repl)
+    except queue.Empty:
+        sys.stderr.write(f"[repl] no response after {args.timeout}s\n")
+        sys.exit(2)
+    finally:
+        repl.close()
+
+    if failed:
+        sys.stderr.write(f"[repl] {failed} check(s) failed\n")
+        sys.exit(3)
+    print("[repl] all checks passed")
+
+
+if __name__ == "__main__":
+    main()
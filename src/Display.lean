@@ -58,9 +58,9 @@ def mkMarker (mime : String) (content : String) : String :=
   let rs  := Char.ofNat 0x1E
   s!"{esc}MIME:{mime}{rs}{content}{esc}/MIME{rs}"
 
-/-- Global buffer for display payloads. WasmRepl.execute drains this
-    after each cell execution. -/
-initialize displayBuffer : IO.Ref String ← IO.mkRef ""
+/-- Global buffer for display payloads as (mime type, content) pairs.
+    The kernels drain this after each cell execution. -/
+initialize displayBuffer : IO.Ref (Array (String × String)) ← IO.mkRef #[]
 
 /-- Most recent payload per MIME type, surviving across cells. The
     drain loop empties `displayBuffer` after each cell to ship its
@@ -70,8 +70,7 @@ initialize lastEmits : IO.Ref (Std.HashMap String String) ← IO.mkRef {}
 
 /-- Append a MIME payload to the global buffer and remember it. -/
 def emit (mime : String) (content : String) : IO Unit := do
-  let marker := mkMarker mime content
-  displayBuffer.modify (· ++ marker ++ "\n")
+  displayBuffer.modify (·.push (mime, content))
   lastEmits.modify (·.insert mime content)
 
 /-- Look up the most recent payload of a given MIME type, if any.
@@ -80,11 +79,17 @@ def lastEmit? (mime : String) : IO (Option String) := do
   let m ← lastEmits.get
   pure m[mime]?
 
-/-- Drain the buffer and return accumulated content (or ""). -/
+/-- Drain the buffer, returning the payloads in emission order. The
+    native kernel hands these to C++ as-is, one MIME bundle entry each. -/
+def drainPayloads : IO (Array (String × String)) :=
+  displayBuffer.modifyGet fun ps => (ps, #[])
+
+/-- Drain the buffer and return accumulated content in the wire format
+    (one marker per line, or ""), for consumers that pass a single
+    string on (the WASM kernel, converted scripts). -/
 def drain : IO String := do
-  let s ← displayBuffer.get
-  displayBuffer.set ""
-  return s
+  let ps ← drainPayloads
+  return ps.foldl (fun acc (mime, content) => acc ++ mkMarker mime content ++ "\n") ""
 
 /-- Save the most recent figure to a file. The MIME type to save is
     inferred from the file extension: `.svg → image/svg+xml`,
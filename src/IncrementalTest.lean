@@ -0,0 +1,60 @@
+/-
+IncrementalTest — tests for incremental re-execution of an edited cell
+(`Lean.Elab.IO.IncrementalRun`).
+
+Runnable as `lake exe incremental-test`.  Elaborates one small input and
+two successive edits of it, each on the same environment, and checks
+which leading commands every run could skip.
+-/
+
+import REPL.Frontend
+
+open Lean Elab IO
+
+private def assertEq {α : Type} [BEq α] [Repr α] (label : String) (a b : α) : IO Bool := do
+  if a == b then
+    IO.println s!"  PASS: {label}"
+    return true
+  else
+    IO.eprintln s!"  FAIL: {label}"
+    IO.eprintln s!"    expected: {repr b}"
+    IO.eprintln s!"    actual:   {repr a}"
+    return false
+
+/-- Four commands; `b` and `d` get edited below. -/
+private def cell (b d : String) : String :=
+  s!"def a := 1\n\ndef b := \"{b}\"\n\ndef c := 3\n\ndef d := \"{d}\"\n"
+
+unsafe def main : IO UInt32 := do
+  IO.println "=== Incremental re-execution tests ==="
+  let (_, base, _, _, _) ← processInput "" none
+  let run (input : String) (previous? : Option IncrementalRun) :
+      IO (Command.State × List Message × IncrementalRun) := do
+    let (_, after, msgs, _, run?) ←
+      processInput input (some base) (incremental := true) (previous? := previous?)
+    let some r := run? | throw (IO.userError "incremental run not recorded")
+    return (after, msgs, r)
+  let mut ok := true
+
+  let (_, _, run0) ← run (cell "two" "four") none
+  ok := ok && (← assertEq "first run records a checkpoint per command" run0.checkpoints.size 4)
+
+  -- Edit the last command: everything before it is reused.
+  let edit1 := cell "two" "five"
+  ok := ok && (← assertEq "editing the last command reuses the three before it"
+    (run0.reusable edit1).size 3)
+  let (_, _, run1) ← run edit1 (some run0)
+  ok := ok && (← assertEq "the resumed run keeps the reused checkpoints"
+    run1.checkpoints.size 4)
+
+  -- Then edit an earlier command: the prefix before it is still reused.
+  let edit2 := cell "seven" "five"
+  ok := ok && (← assertEq "a second, earlier edit still reuses the command before it"
+    (run1.reusable edit2).size 1)
+  let (after, msgs, _) ← run edit2 (some run1)
+  ok := ok && (← assertEq "no messages" msgs.length 0)
+  ok := ok && (← assertEq "the edited definition is the one in the environment"
+    ((after.env.find? `b).bind (·.value?)) (some (mkStrLit "seven")))
+
+  IO.println "=== Done ==="
+  return if ok then 0 else 1
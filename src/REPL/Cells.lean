@@ -0,0 +1,159 @@
+/-
+Copyright (c) 2025, xeus-lean contributors
+Released under Apache 2.0 license as described in the file LICENSE.
+-/
+import Lean.Elab.Frontend
+
+/-!
+# Notebook cell lineage
+
+Which environment each executed cell ran on, so that re-running an
+edited cell replaces it instead of stacking on top of its own earlier
+definitions ("'f' has already been declared").
+
+xeus hands the kernel the code of an execute request but not its
+metadata, so there is no Jupyter cell id to key on. A cell's identity
+is what it declares instead: a cell that declares exactly the names a
+cell on the chain declared is taken to be a new version of that cell.
+It forks from that cell's parent environment, and the cells after it,
+which ran on the old definitions, drop off the chain as stale. Sharing
+only some names is not enough: a new cell that reuses a helper name
+(`aux`, `test`) from an early cell would otherwise cut off every cell
+after that one. It runs on the head instead and gets Lean's "already
+declared" error.
+
+The chain starts at the environment right after the imports, which the
+kernel elaborates on its own for the first cell (`splitHeader`), so a
+fork never re-imports anything.
+-/
+
+open Lean Elab
+
+namespace REPL.Cells
+
+/-- One cell execution on the chain. -/
+structure Node where
+  execCount : UInt32
+  /-- Environment the cell ran on. -/
+  parent    : Nat
+  /-- Environment it produced. -/
+  env       : Nat
+  /-- Constants it added. -/
+  decls     : Array Name
+  /-- Names its source declares (`declaredNames`), which identify it
+  when it is re-run. -/
+  declared  : Array Name := #[]
+
+structure Graph where
+  /-- The post-import environment. -/
+  root?  : Option Nat := none
+  chain  : Array Node := #[]
+
+namespace Graph
+
+/-- The environment the next cell builds on. -/
+def head? (g : Graph) : Option Nat :=
+  match g.chain.back? with
+  | some n => some n.env
+  | none => g.root?
+
+/-- Chain position of the cell a new cell declaring `names` replaces:
+the one that declared the same names. -/
+def forkPoint? (g : Graph) (names : Array Name) : Option Nat :=
+  if names.isEmpty then none else
+  g.chain.findIdx? fun n => n.declared.size == names.size && names.all n.declared.contains
+
+/-- Cut the chain before position `k`, returning the cells that were
+dropped (stale), oldest first. -/
+def truncate (g : Graph) (k : Nat) : Graph × Array Node :=
+  ({ g with chain := g.chain.extract 0 k }, g.chain.extract k g.chain.size)
+
+/-- Append an execution. -/
+def push (g : Graph) (node : Node) : Graph :=
+  { g with chain := g.chain.push node }
+
+/-- Environments a later cell may still build on or fork from. -/
+def pinned (g : Graph) : Array Nat :=
+  g.chain.foldl (·.push ·.env) g.root?.toArray
+
+end Graph
+
+/-- Names a declaration command introduces, relative to its namespace. -/
+private partial def declIds (stx : Syntax) : Array Name :=
+  if stx.isOfKind ``Parser.Command.declaration then
+    -- `private` names are mangled per module; they never clash.
+    if (stx[0].find? (·.isOfKind ``Parser.Command.«private»)).isSome then #[] else
+    match stx[1].find? (·.isOfKind ``Parser.Command.declId) with
+    | some id => #[id[0].getId]
+    | none => #[]
+  else if stx.isOfKind ``Parser.Command.«mutual» then
+    stx[1].getArgs.flatMap declIds
+  else if stx.isOfKind ``Parser.Command.«in» then
+    declIds stx[2]
+  else
+    #[]
+
+private def dropParts (ns : Name) : Nat → Name
+  | 0 => ns
+  | k + 1 => dropParts ns.getPrefix k
+
+/-- `opened` holds, per scope opened in this cell, how many namespace
+components it added (`none` for a section). -/
+private partial def declaredNamesAux (cmdState : Command.State) (inputCtx : Parser.InputContext)
+    (ps : Parser.ModuleParserState) (msgs : MessageLog) (ns : Name)
+    (opened : List (Option Nat)) (acc : Array Name) : Array Name :=
+  let scope := cmdState.scopes.head!
+  let pmctx : Parser.ParserModuleContext :=
+    { env := cmdState.env, options := scope.opts, currNamespace := ns,
+      openDecls := scope.openDecls }
+  let (stx, ps, msgs) := Parser.parseCommand inputCtx pmctx ps msgs
+  let go := declaredNamesAux cmdState inputCtx ps msgs
+  if Parser.isTerminalCommand stx then acc
+  else if stx.isOfKind ``Parser.Command.«namespace» then
+    let id := stx[1].getId
+    go (ns ++ id) (some id.getNumParts :: opened) acc
+  else if stx.isOfKind ``Parser.Command.«section» ||
+      stx.isOfKind ``Parser.Command.noncomputableSection then
+    go ns (none :: opened) acc
+  else if stx.isOfKind ``Parser.Command.«end» then
+    match opened with
+    | some k :: rest => go (dropParts ns k) rest acc
+    | none :: rest => go ns rest acc
+    | [] => go (dropParts ns (stx[1].getOptionalIdent?.map (·.getNumParts) |>.getD 0)) [] acc
+  else
+    let names := (declIds stx).map fun n =>
+      if n.getRoot == `_root_ then n.replacePrefix `_root_ .anonymous else ns ++ n
+    go ns opened (acc ++ names)
+
+/-- Full names of the declarations in `code`, resolved against the
+current namespace of `cmdState` and the `namespace`/`end` commands in
+the cell. Only parses, never elaborates, so it is cheap enough to run
+before every cell. -/
+def declaredNames (cmdState : Command.State) (code : String) : Array Name :=
+  declaredNamesAux cmdState (Parser.mkInputContext code "<cell>") {} {}
+    cmdState.scopes.head!.currNamespace [] #[]
+
+/-- Split a first cell into its header (the `import`s) and the rest. The
+rest keeps the header's bytes as blanks, newlines included, so line
+numbers and byte offsets in it are the same as in `code`. -/
+def splitHeader (code : String) : IO (String × String) := do
+  let (_, ps, _) ← Parser.parseHeader (Parser.mkInputContext code "<cell>")
+  let bytes := code.toUTF8
+  let stop := ps.pos.byteIdx
+  let header := String.fromUTF8! (bytes.extract 0 stop)
+  let blank := header.foldl (init := "") fun acc c =>
+    if c == '\n' then acc.push c else acc.pushn ' ' c.utf8Size
+  return (header, blank ++ String.fromUTF8! (bytes.extract stop bytes.size))
+
+/-- The modules a header (see `splitHeader`) imports, `Init` included. -/
+def headerModules (header : String) : IO (Array Name) := do
+  let (stx, _, _) ← Parser.parseHeader (Parser.mkInputContext header "<cell>")
+  return (Elab.headerToImports stx).map (·.module)
+
+/-- Constants `env` has that `parent` did not, from the non-imported
+part of the constant map. -/
+def addedConstants (parent? : Option Environment) (env : Environment) : Array Name :=
+  env.constants.map₂.foldl (init := #[]) fun acc n _ =>
+    if parent?.any (·.constants.map₂.contains n) then acc else acc.push n
+
+end REPL.Cells
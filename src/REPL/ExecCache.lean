@@ -0,0 +1,97 @@
+/-
+Copyright (c) 2025, xeus-lean contributors
+Released under Apache 2.0 license as described in the file LICENSE.
+-/
+import REPL.JSON
+import REPL.Util.FifoCache
+
+/-!
+# Execution cache
+
+Running the same source on the same environment with the same options
+produces the same environment and the same messages, unless the source
+does something at elaboration time that is observable outside Lean
+(`#eval` of an `IO` action, `#html` writing into the Display buffer,
+`run_cmd`, `initialize`). Notebooks that get "Run All" repeatedly and
+MCP agents that resubmit a snippet hit exactly that case. `runCommand`
+answers those from here: the recorded environment id and the messages,
+with no elaboration.
+
+A cell is cacheable when every `#` command in it is on `pureHashCommands`
+and it uses none of `effectfulKeywords`. `XLEAN_EXEC_CACHE_EVAL=1` caches
+every cell anyway, for users who know their `#eval`s are pure.
+`XLEAN_EXEC_CACHE_SIZE` bounds the entry count (default 256, `0` turns
+the cache off); the oldest entries go first.
+
+An entry keeps the InfoTrees of its run only when the command asked for
+them (`infotree`, which is part of the key). Trees reach into the
+environments they were elaborated in, so an entry that has them goes as
+soon as its environment leaves memory, and any entry goes once its
+environments can no longer be handed out (`State.pruneCaches`).
+-/
+
+open Lean Elab
+
+namespace REPL
+
+/-- What a result depends on: the parent environment, the source (kept
+whole, so a hash collision cannot return the wrong cell) and the
+options that shape the response. -/
+structure ExecKey where
+  env        : Option Nat
+  cmd        : String
+  allTactics : Option Bool
+  rootGoals  : Option Bool
+  infotree   : Option String
+  deriving BEq, Hashable
+
+def ExecKey.ofCommand (s : Command) : ExecKey :=
+  { env := s.env, cmd := s.cmd, allTactics := s.allTactics, rootGoals := s.rootGoals,
+    infotree := s.infotree }
+
+abbrev ExecCache := FifoCache ExecKey (CommandResponse × List InfoTree)
+
+/-- `#` commands with no effect beyond the messages they log. -/
+def pureHashCommands : List String :=
+  ["check", "check_failure", "print", "reduce", "synth", "guard", "guard_msgs", "where"]
+
+/-- Commands that run arbitrary code at elaboration time. -/
+def effectfulKeywords : List String :=
+  ["run_cmd", "run_elab", "run_meta", "initialize", "builtin_initialize"]
+
+/-- Could `code` have effects outside the environment it produces? Errs
+on the side of "yes": a `#eval` inside a string literal counts. -/
+def hasSideEffects (code : String) : Bool := Id.run do
+  if effectfulKeywords.any fun kw => (code.splitOn kw).length > 1 then
+    return true
+  let mut word : Option String := none
+  for c in code.toList ++ [' '] do
+    match word with
+    | some w =>
+      if c.isAlphanum || c == '_' then
+        word := some (w.push c)
+      else
+        if !w.isEmpty && !pureHashCommands.contains w then return true
+        word := if c == '#' then some "" else none
+    | none =>
+      if c == '#' then word := some ""
+  return false
+
+/-- Cache size and whether effectful cells are cached too. -/
+structure ExecCacheConfig where
+  maxEntries : Nat
+  cacheEffects : Bool
+
+def ExecCacheConfig.fromEnv : IO ExecCacheConfig := do
+  let maxEntries := (← IO.getEnv "XLEAN_EXEC_CACHE_SIZE").bind (·.toNat?) |>.getD 256
+  let cacheEffects := (← IO.getEnv "XLEAN_EXEC_CACHE_EVAL").any fun v => v == "1" || v == "true"
+  return { maxEntries, cacheEffects }
+
+initialize execCacheConfig : ExecCacheConfig ← ExecCacheConfig.fromEnv
+
+/-- May `s` be answered from, and recorded into, the cache? Not when it
+writes its InfoTrees to a file. -/
+def ExecCacheConfig.admits (c : ExecCacheConfig) (s : Command) : Bool :=
+  c.maxEntries > 0 && (c.cacheEffects || !hasSideEffects s.cmd) && s.infotreeTo.isNone
+
+end REPL
@@ -4,11 +4,104 @@ Released under Apache 2.0 license as described in the file LICENSE.
 Authors: Scott Morrison
 -/
 import Lean.Elab.Frontend
+import REPL.Util.Spans
+import REPL.Util.Runtime
+import REPL.Util.Trace
+import REPL.ExecCache
 
 open Lean Elab
 
 namespace Lean.Elab.IO
 
+/--
+Parse and elaborate the next command, like `Frontend.processCommand`, but
+with `cancelTk?` in the `Command.Context`. `Frontend.processCommand`
+hardcodes `cancelTk? := none`, which leaves the elaborator (and the
+kernel via `addDecl`) no way to notice a kernel interrupt; with a token
+installed, `Core.checkInterrupted` aborts the running command as soon
+as the token is set.
+-/
+private def processCommandCancellable (cancelTk? : Option IO.CancelToken) :
+    Frontend.FrontendM Bool := do
+  let s ← get
+  let inputCtx := (← read).inputCtx
+  let cmdState := s.commandState
+  let scope := cmdState.scopes.head!
+  let pmctx : Parser.ParserModuleContext := {
+    env := cmdState.env
+    options := scope.opts
+    currNamespace := scope.currNamespace
+    openDecls := scope.openDecls
+  }
+  let cmdPos := s.parserState.pos
+  let (cmd, ps, messages) := Parser.parseCommand inputCtx pmctx s.parserState cmdState.messages
+  let cmdCtx : Command.Context := {
+    cmdPos
+    fileName := inputCtx.fileName
+    fileMap := inputCtx.fileMap
+    snap? := none
+    cancelTk?
+  }
+  match ← ((Command.elabCommandTopLevel cmd) cmdCtx |>.run { cmdState with messages }).toIO' with
+  | .error e =>
+    throw <| IO.userError s!"unexpected internal error: {← e.toMessageData.toString}"
+  | .ok ((), cmdState) =>
+    set { s with commandState := cmdState, parserState := ps, cmdPos, commands := s.commands.push cmd }
+  return Parser.isTerminalCommand cmd
+
+/--
+The frontend state after one command of an input, kept so that the next
+run of the same input on the same environment can skip its unchanged
+prefix (see `IncrementalRun.reusable`).
+-/
+structure CommandCheckpoint where
+  /-- Byte offset where the command's text ends, trailing whitespace
+  and comments included. -/
+  stop         : Nat
+  commandState : Command.State
+  parserState  : Parser.ModuleParserState
+  /-- Messages and info trees of the input up to here. -/
+  messages     : MessageLog
+  trees        : PersistentArray InfoTree
+  /-- No command up to here has effects outside the environment (see
+  `REPL.hasSideEffects`); replaying a prefix that printed or displayed
+  something would silently drop that output. -/
+  pure         : Bool
+
+/-- An input as last run on some environment, with a checkpoint after
+each of its commands. -/
+structure IncrementalRun where
+  input       : String
+  checkpoints : Array CommandCheckpoint
+
+private def isWhitespaceByte (b : UInt8) : Bool :=
+  b == 32 || b == 10 || b == 9 || b == 13
+
+/--
+The checkpoints of `run` that are still valid for `input`, oldest first;
+a new run resumes after the last of them. A command can be skipped when
+its text and the first token after it are unchanged (the parser decided
+where the command ends by looking at that token), and no command up to
+it had side effects. The last command of the old input, which ended at
+end of input, is never reused.
+-/
+def IncrementalRun.reusable (run : IncrementalRun) (input : String) :
+    Array CommandCheckpoint := Id.run do
+  let old := run.input.toUTF8
+  let new := input.toUTF8
+  let mut common := 0
+  while common < old.size && common < new.size && old[common]! == new[common]! do
+    common := common + 1
+  let mut found := #[]
+  for cp in run.checkpoints do
+    let mut tokEnd := cp.stop
+    while tokEnd < old.size && !isWhitespaceByte old[tokEnd]! do
+      tokEnd := tokEnd + 1
+    unless cp.pure && tokEnd > cp.stop && common ≥ tokEnd do
+      break
+    found := found.push cp
+  return found
+
 /--
 Process commands using the synchronous FrontendM loop, accumulating
 messages and info trees across commands.
@@ -20,25 +113,105 @@ from the LAST command (usually the EOF/terminal command, which has none).
 
 This version collects messages and trees after each command and accumulates
 them, so output from `#check`, `#eval`, etc. is preserved.
+
+The loop also stops early once `cancelTk?` is set: an interrupted command
+is swallowed by the elaborator's own exception handling, so without this
+check the rest of the cell would keep running. The returned flag is
+`true` when the loop was cut short this way.
+
+With `record?` (the input's bytes and the checkpoints so far), a
+`CommandCheckpoint` is appended after every command.
 -/
 private partial def processCommandsAccumAt
-    (n : Nat) (accMsgs : MessageLog) (accTrees : PersistentArray InfoTree) :
-    Frontend.FrontendM (MessageLog × PersistentArray InfoTree) := do
-  IO.eprintln s!"[processCommandsAccum] #{n} ENTER"
-  let done ← Frontend.processCommand
-  IO.eprintln s!"[processCommandsAccum] #{n} processCommand DONE, done={done}"
+    (n : Nat) (cancelTk? : Option IO.CancelToken)
+    (accMsgs : MessageLog) (accTrees : PersistentArray InfoTree)
+    (record? : Option (ByteArray × Array CommandCheckpoint)) :
+    Frontend.FrontendM (MessageLog × PersistentArray InfoTree × Bool × Array CommandCheckpoint) := do
+  REPL.Trace.trace "frontend" "command start" [("n", toString n)]
+  let done ← processCommandCancellable cancelTk?
+  REPL.Trace.trace "frontend" "command done" [("n", toString n), ("eoi", toString done)]
   let cmdState ← Frontend.getCommandState
   let newMsgs := accMsgs ++ cmdState.messages
   let newTrees := accTrees ++ cmdState.infoState.trees
-  if done then
-    return (newMsgs, newTrees)
-  else
-    processCommandsAccumAt (n + 1) newMsgs newTrees
+  let interrupted ← match cancelTk? with
+    | some tk => tk.isSet
+    | none => pure false
+  if done || interrupted then
+    return (newMsgs, newTrees, interrupted, (record?.map (·.2)).getD #[])
+  let record? ← match record? with
+    | none => pure none
+    | some (bytes, cps) => do
+      let s ← get
+      let stop := s.parserState.pos.byteIdx
+      let src? := String.fromUTF8? (bytes.extract s.cmdPos.byteIdx stop)
+      let isPure := cps.all (·.pure) && src?.all (!REPL.hasSideEffects ·)
+      pure (some (bytes, cps.push {
+        stop, commandState := s.commandState, parserState := s.parserState,
+        messages := newMsgs, trees := newTrees, pure := isPure }))
+  processCommandsAccumAt (n + 1) cancelTk? newMsgs newTrees record?
+
+/-- Error raised by `processCommandsWithInfoTrees` when `cancelTk?` fired. -/
+def interruptedMessage : String := "Interrupted"
 
-private def processCommandsAccum
-    (accMsgs : MessageLog) (accTrees : PersistentArray InfoTree) :
-    Frontend.FrontendM (MessageLog × PersistentArray InfoTree) :=
-  processCommandsAccumAt 0 accMsgs accTrees
+/--
+A command elaborated in parallel mode: its own messages and info trees,
+and the tasks still elaborating its proof bodies (`Elab.async`).
+-/
+private structure PendingCommand where
+  messages : MessageLog
+  trees    : PersistentArray InfoTree
+  tasks    : Array (Language.SnapshotTask Language.SnapshotTree)
+
+private def PendingCommand.running (p : PendingCommand) : BaseIO Bool :=
+  p.tasks.anyM fun t => return !(← IO.hasFinished t.task)
+
+/-- Wait for `p`'s proofs; their messages and info trees go after the
+command's own. -/
+private def PendingCommand.finish (p : PendingCommand) :
+    BaseIO (MessageLog × PersistentArray InfoTree) := do
+  let mut msgs := p.messages
+  let mut trees := p.trees
+  for t in p.tasks do
+    for snap in (← IO.wait t.task).getAll do
+      msgs := msgs ++ snap.diagnostics.msgLog
+      if let some tree := snap.infoTree? then
+        trees := trees.push tree
+  return (msgs, trees)
+
+/--
+The parallel counterpart of `processCommandsAccumAt`: each command's
+proof bodies are left running as tasks while the loop moves on to the
+next command, with at most `workers` commands' proofs in flight. A later
+command that needs an earlier proof blocks on it inside the elaborator.
+-/
+private partial def processCommandsParallelAt
+    (n : Nat) (workers : Nat) (cancelTk? : Option IO.CancelToken)
+    (pending : Array PendingCommand) :
+    Frontend.FrontendM (Array PendingCommand × Bool) := do
+  let mut inFlight ← pending.filterM (·.running)
+  while inFlight.size ≥ max workers 1 do
+    for t in inFlight[0]!.tasks do
+      discard <| IO.wait t.task
+    inFlight ← inFlight.filterM (·.running)
+  REPL.Trace.trace "frontend" "command start" [("n", toString n), ("inFlight", toString inFlight.size)]
+  let done ← processCommandCancellable cancelTk?
+  let cmdState ← Frontend.getCommandState
+  modify fun s => { s with commandState.snapshotTasks := #[] }
+  let pending := pending.push {
+    messages := cmdState.messages, trees := cmdState.infoState.trees,
+    tasks := cmdState.snapshotTasks }
+  let interrupted ← match cancelTk? with
+    | some tk => tk.isSet
+    | none => pure false
+  if done || interrupted then
+    return (pending, interrupted)
+  processCommandsParallelAt (n + 1) workers cancelTk? pending
+
+/-- `cmdState` with `Elab.async` set to `async` in its innermost scope. -/
+private def setElabAsync (cmdState : Command.State) (async : Bool) : Command.State :=
+  match cmdState.scopes with
+  | sc :: scs => { cmdState with scopes := { sc with opts := sc.opts.setBool `Elab.async async } :: scs }
+  | [] => cmdState
 
 /--
 Wrapper for command processing that enables info states, and returns
@@ -48,21 +221,69 @@ Wrapper for command processing that enables info states, and returns
 
 Uses the synchronous FrontendM loop instead of the incremental snapshot
 system (IO.processCommands) to avoid task/promise issues in WASM.
+
+If `cancelTk?` is set while the input is being processed, the partial
+result is discarded and an `interruptedMessage` error is thrown, so
+callers never record a half-elaborated state.
+
+With `record?` (the input's bytes), also returns a checkpoint after each
+command. `resume` (an earlier run's `IncrementalRun.reusable`) starts
+after its last checkpoint instead of at `parserState`, taking its
+messages and info trees as already produced; the returned checkpoints
+begin with all of `resume`, so a later edit further up can still reuse
+what comes before it.
+
+`Elab.async` is switched off here: this loop never looks at the tasks
+that asynchronous proofs report through, so their messages would be
+lost. See `processCommandsParallel` for the mode that uses it.
 -/
 def processCommandsWithInfoTrees
     (inputCtx : Parser.InputContext) (parserState : Parser.ModuleParserState)
-    (commandState : Command.State) : IO (Command.State × List Message × List InfoTree) := do
-  let commandState := { commandState with infoState.enabled := true }
+    (commandState : Command.State) (cancelTk? : Option IO.CancelToken := none)
+    (record? : Option ByteArray := none) (resume : Array CommandCheckpoint := #[]) :
+    IO (Command.State × List Message × List InfoTree × Array CommandCheckpoint) := do
   let ctx : Frontend.Context := { inputCtx }
-  let initState : Frontend.State := {
-    commandState := commandState
-    parserState := parserState
-    cmdPos := parserState.pos
-    commands := #[]
-  }
-  let ((allMsgs, allTrees), finalState) ←
-    (processCommandsAccum {} {} ctx).run initState
-  pure (finalState.commandState, allMsgs.toList, allTrees.toList)
+  let (initState, msgs, trees, cps) := match resume.back? with
+    | some cp =>
+      ({ commandState := cp.commandState, parserState := cp.parserState,
+         cmdPos := cp.parserState.pos, commands := #[] : Frontend.State },
+       cp.messages, cp.trees, resume)
+    | none =>
+      ({ commandState := setElabAsync { commandState with infoState.enabled := true } false,
+         parserState, cmdPos := parserState.pos, commands := #[] : Frontend.State },
+       {}, {}, #[])
+  let record? := record?.map (·, cps)
+  let ((allMsgs, allTrees, interrupted, cps), finalState) ←
+    (processCommandsAccumAt 0 cancelTk? msgs trees record? ctx).run initState
+  if interrupted then
+    throw <| IO.userError interruptedMessage
+  pure (finalState.commandState, allMsgs.toList, allTrees.toList, cps)
+
+/--
+`processCommandsWithInfoTrees` with proof bodies elaborated in parallel
+(`Elab.async`, see `processCommandsParallelAt`). Returns once every
+proof is done; each command's messages, then those of its proofs, come
+back in source order.
+-/
+def processCommandsParallel
+    (inputCtx : Parser.InputContext) (parserState : Parser.ModuleParserState)
+    (commandState : Command.State) (cancelTk? : Option IO.CancelToken) (workers : Nat) :
+    IO (Command.State × List Message × List InfoTree) := do
+  let ctx : Frontend.Context := { inputCtx }
+  let commandState := setElabAsync { commandState with infoState.enabled := true } true
+  let initState : Frontend.State :=
+    { commandState, parserState, cmdPos := parserState.pos, commands := #[] }
+  let ((pending, interrupted), finalState) ←
+    (processCommandsParallelAt 0 workers cancelTk? #[] ctx).run initState
+  if interrupted then
+    throw <| IO.userError interruptedMessage
+  let mut msgs : MessageLog := {}
+  let mut trees : PersistentArray InfoTree := {}
+  for p in pending do
+    let (m, t) ← p.finish
+    msgs := msgs ++ m
+    trees := trees ++ t
+  pure (setElabAsync finalState.commandState false, msgs.toList, trees.toList)
 
 /--
 Process some text input, with or without an existing command state.
@@ -70,26 +291,36 @@ If there is no existing environment, we parse the input for headers (e.g. import
 and create a new environment.
 Otherwise, we add to the existing environment.
 
+`cancelTk?` is threaded into every command's `Command.Context`; see
+`processCommandsWithInfoTrees` for what happens when it fires.
+
+With `incremental` (and an existing command state), the run is recorded
+as an `IncrementalRun`, and `previous?`, the last run on the same command
+state, lets the unchanged leading commands of `input` be skipped: their
+state, messages and info trees are taken from `previous?`. When nothing
+is reusable this is the plain loop.
+
+With `parallel? := some workers`, proofs are elaborated in parallel
+instead (`processCommandsParallel`), and nothing is recorded or reused.
+
 Returns:
 1. The header-only command state (only useful when cmdState? is none)
 2. The resulting command state after processing the entire input
 3. List of messages
 4. List of info trees
+5. The recorded run, with `incremental`
 -/
 def processInput (input : String) (cmdState? : Option Command.State)
-    (opts : Options := {}) (fileName : Option String := none) :
-    IO (Command.State × Command.State × List Message × List InfoTree) := unsafe do
-  IO.eprintln "[processInput] ENTER"
-  -- In WASM the .olean files are embedded at /lib/lean/ so sysroot is "/".
-  -- Lean.findSysroot would spawn `lean --print-prefix`, which is impossible
-  -- in WASM but is the right thing on a native build. Detect by probing
-  -- for the embedded VFS file; fall back to findSysroot otherwise.
-  let wasmInit := System.FilePath.mk "/lib/lean/Init.olean"
-  let isWasm   ← wasmInit.pathExists
-  let sysroot ← if isWasm then pure (System.FilePath.mk "/") else Lean.findSysroot
-  IO.eprintln s!"[processInput] sysroot={sysroot} (wasm={isWasm})"
-  Lean.initSearchPath sysroot
-  IO.eprintln "[processInput] initSearchPath done"
+    (opts : Options := {}) (fileName : Option String := none)
+    (cancelTk? : Option IO.CancelToken := none)
+    (incremental := false) (previous? : Option IncrementalRun := none)
+    (parallel? : Option Nat := none) :
+    IO (Command.State × Command.State × List Message × List InfoTree × Option IncrementalRun) :=
+    unsafe do
+  REPL.Trace.trace "frontend" "processInput" [("first", toString cmdState?.isNone)]
+  -- Sysroot, search path and auto-import registry are resolved once per
+  -- session (see `REPL.Runtime`), not per cell.
+  let runtime ← REPL.Spans.withSpan "runtime" REPL.Runtime.get
   enableInitializersExecution
   let fileName   := fileName.getD "<input>"
   -- Auto-import Display + any extras the deployment declared on the
@@ -102,109 +333,48 @@ def processInput (input : String) (cmdState? : Option Command.State)
   --
   -- The auto-import only runs when `cmdState?` is `none` (i.e. the
   -- very first cell).  User code in that cell still runs after the
-  -- imports.
-  --
-  -- Extension: a downstream lib (anything shipped via EXTRA_WASM_DIRS)
-  -- registers its own auto-imports by writing one module name per
-  -- line into a file under one of these names somewhere on the
-  -- search path:
-  --
-  --     /lib/lean/.xeus-auto-imports          (WASM VFS)
-  --     <root>/.xeus-auto-imports             (each native search root)
-  --
-  -- Lines starting with `#` and blank lines are ignored.  Each
-  -- listed module is imported only if its olean is actually
-  -- present (so an outdated registry doesn't fail elaboration).
-  -- xeus-lean itself names no third-party module — they appear
-  -- only inside the .xeus-auto-imports file the third-party build
-  -- script writes.
-  let input ←
-    if cmdState?.isNone then do
-      -- 1. Compute the list of search roots to probe.  WASM uses the
-      --    fixed /lib/lean prefix because LEAN_PATH isn't populated
-      --    from the kernelspec there; native uses the search path.
-      let roots ← if isWasm then
-        pure [System.FilePath.mk "/lib/lean"]
-      else
-        Lean.searchPathRef.get
-      let oleanExists (mod : String) : IO Bool := do
-        let rel : System.FilePath := System.FilePath.mk (mod.replace "." "/" ++ ".olean")
-        for root in roots do
-          if (← (root / rel).pathExists) then return true
-        return false
-      -- 2. Always-on auto-import is just Display.  Anything else is
-      --    sourced from .xeus-auto-imports registries.
-      let coreImports := if (← oleanExists "Display") then "import Display\n" else ""
-      -- 3. Read each .xeus-auto-imports file under the search roots
-      --    and collect distinct module names.
-      let mut extras : List String := []
-      let mut seen : Std.HashSet String := {}
-      for root in roots do
-        let registry := root / ".xeus-auto-imports"
-        if ← registry.pathExists then
-          let body ← IO.FS.readFile registry
-          for line in body.splitOn "\n" do
-            let line := line.trim
-            if line.isEmpty || line.startsWith "#" then continue
-            if seen.contains line then continue
-            seen := seen.insert line
-            extras := extras ++ [line]
-      -- 4. Drop registry entries whose olean is missing — keeps a
-      --    stale list from breaking the first cell.
-      let mut extraImports := ""
-      for mod in extras do
-        if ← oleanExists mod then
-          extraImports := extraImports ++ s!"import {mod}\n"
-        else
-          IO.eprintln s!"[processInput] .xeus-auto-imports: skipping `{mod}` (olean not found)"
-      pure (coreImports ++ extraImports ++ input)
-    else
-      pure input
+  -- imports.  Downstream libs add their own imports through
+  -- `.xeus-auto-imports` registries (`REPL.Runtime.resolveAutoImports`).
+  let input := if cmdState?.isNone then runtime.autoImports ++ input else input
   let inputCtx   := Parser.mkInputContext input fileName
 
+  -- Logs every message at `trace`; `m.data.toString` formats, so only
+  -- when someone asked for it.
+  let traceMessages (what : String) (msgs : List Message) : IO Unit := do
+    if REPL.Trace.enabled "frontend" .trace then
+      for m in msgs do
+        let data ← m.data.toString
+        REPL.Trace.emit "frontend" .trace what
+          [("severity", toString m.severity), ("data", s!"{data.take 200}")]
+
   match cmdState? with
   | none => do
-    IO.eprintln "[processInput] no cmdState, parsing header..."
-    let (header, parserState, messages) ← Parser.parseHeader inputCtx
-    IO.eprintln "[processInput] header parsed, calling processHeader..."
-    -- Check if .olean files exist in the VFS
-    let initOlean := System.FilePath.mk "/lib/lean/Init.olean"
-    let initDir := System.FilePath.mk "/lib/lean/Init"
-    let initOleanExists ← initOlean.pathExists
-    -- Check core modules (Std/Lean/Display).  Anything else lives
-    -- under a third-party search root and isn't worth a diagnostic
-    -- here — the auto-import block above already logged misses.
-    let stdOlean ← (System.FilePath.mk "/lib/lean/Std.olean").pathExists
-    let leanOlean ← (System.FilePath.mk "/lib/lean/Lean.olean").pathExists
-    let displayOlean ← (System.FilePath.mk "/lib/lean/Display.olean").pathExists
-    IO.eprintln s!"[processInput] Std.olean={stdOlean} Lean.olean={leanOlean} Display.olean={displayOlean}"
-    let initDirExists ← initDir.isDir
-    IO.eprintln s!"[processInput] /lib/lean/Init.olean exists={initOleanExists}, /lib/lean/Init isDir={initDirExists}"
-    let sp ← Lean.searchPathRef.get
-    IO.eprintln s!"[processInput] searchPath={sp}"
-    let (env, messages) ← processHeader header opts messages inputCtx
-    IO.eprintln s!"[processInput] processHeader done, env has {env.constants.fold (init := 0) fun n _ _ => n + 1} constants"
-    -- Log header messages
-    for m in messages.toList do
-      let dataStr ← m.data.toString
-      IO.eprintln s!"[processInput]   headerMsg: severity={m.severity}, data='{dataStr.take 200}'"
+    let (header, parserState, messages) ← REPL.Spans.withSpan "parse_header" <| Parser.parseHeader inputCtx
+    REPL.Trace.debug "frontend" "header parsed, importing"
+    let (env, messages) ← REPL.Spans.withSpan "import" <| processHeader header opts messages inputCtx
+    traceMessages "header message" messages.toList
     let headerOnlyState := Command.mkState env messages opts
-    IO.eprintln s!"[processInput] processing commands... (headerMsgs={messages.toList.length})"
-    let (cmdState, messages, trees) ← processCommandsWithInfoTrees inputCtx parserState headerOnlyState
-    IO.eprintln s!"[processInput] commands processed, {messages.length} messages"
-    for m in messages do
-      let dataStr ← m.data.toString
-      IO.eprintln s!"[processInput]   msg: severity={m.severity}, data='{dataStr.take 100}'"
-    return (headerOnlyState, cmdState, messages, trees)
+    let (cmdState, messages, trees, _) ← REPL.Spans.withSpan "elab" <|
+      processCommandsWithInfoTrees inputCtx parserState headerOnlyState cancelTk?
+    REPL.Trace.debug "frontend" "commands processed" [("messages", toString messages.length)]
+    traceMessages "message" messages
+    return (headerOnlyState, cmdState, messages, trees, none)
 
   | some cmdStateBefore => do
-    let envConsts := cmdStateBefore.env.constants.fold (init := 0) fun n _ _ => n + 1
-    IO.eprintln s!"[processInput] existing cmdState, env has {envConsts} constants, {cmdStateBefore.messages.toList.length} existing msgs"
-    IO.eprintln s!"[processInput] input='{input.take 80}'"
+    REPL.Trace.trace "frontend" "input" [("code", s!"{input.take 80}")]
     let parserState : Parser.ModuleParserState := {}
-    let (cmdStateAfter, messages, trees) ← processCommandsWithInfoTrees inputCtx parserState cmdStateBefore
-    IO.eprintln s!"[processInput] commands processed, {messages.length} messages returned"
-    for m in messages do
-      let dataStr ← m.data.toString
-      IO.eprintln s!"[processInput]   msg: severity={m.severity}, data='{dataStr.take 100}'"
-    return (cmdStateBefore, cmdStateAfter, messages, trees)
+    if let some workers := parallel? then
+      let (cmdStateAfter, messages, trees) ← REPL.Spans.withSpan "elab" <|
+        processCommandsParallel inputCtx parserState cmdStateBefore cancelTk? workers
+      traceMessages "message" messages
+      return (cmdStateBefore, cmdStateAfter, messages, trees, none)
+    let resume := if incremental then (previous?.map (·.reusable input)).getD #[] else #[]
+    if let some cp := resume.back? then
+      REPL.Trace.debug "frontend" "reusing unchanged prefix" [("bytes", toString cp.stop)]
+    let record? := if incremental then some input.toUTF8 else none
+    let (cmdStateAfter, messages, trees, checkpoints) ← REPL.Spans.withSpan "elab" <|
+      processCommandsWithInfoTrees inputCtx parserState cmdStateBefore cancelTk? record? resume
+    REPL.Trace.debug "frontend" "commands processed" [("messages", toString messages.length)]
+    traceMessages "message" messages
+    let run? := if incremental then some { input, checkpoints } else none
+    return (cmdStateBefore, cmdStateAfter, messages, trees, run?)
@@ -0,0 +1,188 @@
+/-
+Copyright (c) 2025, xeus-lean contributors
+Released under Apache 2.0 license as described in the file LICENSE.
+-/
+import REPL.JSON
+import REPL.Lean.InfoTree
+import REPL.Lean.InfoTree.ToJson
+import REPL.Util.FifoCache
+
+/-!
+# InfoTree pages
+
+`"infotree": "full"` on a real file used to come back as one `Json`
+array, built and compressed in one go. Instead, a command can write its
+trees to a file node by node as they are rendered
+(`CommandOptions.infotreeTo`), and an `InfoTreeQuery` can fetch a later
+page, one subtree, or the nodes within a source range.
+
+The raw trees of the last `maxRetainedTrees` commands that asked for
+their trees (`Command.keepsTrees`) are kept for queries, by the
+environment they produced. A query walks them (`InfoTree.forNodes`) and
+renders only the nodes it returns, stopping once it has a page, so a
+later page costs a walk over the nodes before it but not their
+rendering. A query that renders a tree whole keeps the rendering, and
+later queries on that tree read it instead. `XLEAN_INFOTREE_CACHE_NODES`
+bounds the number of rendered nodes kept (default 200000, `0` turns the
+cache off); the oldest trees go first.
+-/
+
+open Lean Elab
+
+namespace REPL
+
+/-- How many commands keep their raw InfoTrees for `InfoTreeQuery`. -/
+def maxRetainedTrees : Nat := 8
+
+initialize infoTreeCacheNodes : Nat ← do
+  return (← IO.getEnv "XLEAN_INFOTREE_CACHE_NODES").bind (·.toNat?) |>.getD 200000
+
+/-- Does `s` ask for its InfoTrees? Only then are they kept for
+`InfoTreeQuery`. -/
+def Command.keepsTrees (s : Command) : Bool :=
+  s.infotree.isSome || s.infotreeTo.isSome
+
+/-- The trees a `CommandOptions.infotree` value selects. -/
+def selectTrees (infotree : Option String) (trees : List InfoTree) : List InfoTree :=
+  match infotree with
+  | some "full" => trees
+  | some "tactics" => trees.flatMap InfoTree.retainTacticInfo
+  | some "original" => trees.flatMap InfoTree.retainTacticInfo |>.flatMap InfoTree.retainOriginal
+  | some "substantive" => trees.flatMap InfoTree.retainTacticInfo |>.flatMap InfoTree.retainSubstantive
+  | _ => []
+
+/-- A rendered tree: the environment its command produced, the
+`infotree` selection, and its index among the selected trees. -/
+abbrev TreeKey := Nat × String × Nat
+
+structure InfoTreeCache where
+  /-- Raw trees by the environment their command produced; newest last. -/
+  trees    : Array (Nat × List InfoTree) := #[]
+  /-- Rendered trees; each costs its node count. -/
+  rendered : FifoCache TreeKey (Array InfoTree.NodeLine) := {}
+
+namespace InfoTreeCache
+
+/-- Keep the raw trees of the command that produced `env`. -/
+def retain (c : InfoTreeCache) (env : Nat) (trees : List InfoTree) : InfoTreeCache :=
+  let kept := c.trees.filter (·.1 != env) |>.push (env, trees)
+  { c with trees := kept.extract (kept.size - maxRetainedTrees) kept.size }
+
+def find? (c : InfoTreeCache) (env : Nat) : Option (List InfoTree) :=
+  c.trees.findRev? (·.1 == env) |>.map (·.2)
+
+def insert (c : InfoTreeCache) (maxNodes : Nat) (k : TreeKey) (lines : Array InfoTree.NodeLine) :
+    InfoTreeCache :=
+  { c with rendered := c.rendered.insert maxNodes k lines (cost := lines.size) }
+
+def stats (c : InfoTreeCache) : Json :=
+  Json.mkObj [("commands", toJson c.trees.size), ("nodes", toJson c.rendered.cost),
+    ("hits", toJson c.rendered.hits), ("misses", toJson c.rendered.misses)]
+
+end InfoTreeCache
+
+/-- Is `a` at or before `b`? -/
+private def atOrBefore (a : Position) (b : Pos) : Bool :=
+  a.line < b.line || (a.line == b.line && a.column ≤ b.column)
+
+/-- Is `a` at or after `b`? -/
+private def atOrAfter (a : Position) (b : Pos) : Bool :=
+  a.line > b.line || (a.line == b.line && a.column ≥ b.column)
+
+/-- Does `q` select the node at `path`, with source range `range?`? It
+must be under `q.path`, and either lie within `q.pos`..`q.endPos` or be
+under `root?`, the last selected node that does. Returns the new
+`root?` if so. Feed it the nodes in preorder. -/
+def InfoTreeQuery.selects? (q : InfoTreeQuery) (root? : Option (Array Nat)) (path : Array Nat)
+    (range? : Option (Position × Position)) : Option (Option (Array Nat)) :=
+  if !q.path.all (·.isPrefixOf path) then none
+  else if q.pos.isNone && q.endPos.isNone then some root?
+  else if root?.any (·.isPrefixOf path) then some root?
+  else match range? with
+    | some (s, e) =>
+      if q.pos.all (atOrAfter s ·) && q.endPos.all (atOrBefore e ·) then some (some path) else none
+    | none => none
+
+/-- Does `q` take every node of every tree, so that walking a tree for
+it renders the tree whole? -/
+def InfoTreeQuery.takesAll (q : InfoTreeQuery) : Bool :=
+  q.path.isNone && q.pos.isNone && q.endPos.isNone && q.offset.all (· == 0)
+
+/-- Write `trees` to `path` as NDJSON, one node per line, as each node is
+rendered. -/
+def writeNodeLines (path : System.FilePath) (trees : List InfoTree) : IO Unit := do
+  let h ← IO.FS.Handle.mk path .write
+  for t in trees, i in [0:trees.length] do
+    discard <| t.forNodes none (path := #[i]) fun _ _ render => do
+      h.putStrLn (← render).compress
+      return true
+  h.flush
+
+/-- The trees an `InfoTreeQuery` walks (those `q.path` reaches into):
+each with its key and, if it was rendered before, its rendering. -/
+structure InfoTreePlan where
+  trees : Array (TreeKey × InfoTree × Option (Array InfoTree.NodeLine))
+
+/-- Where an `InfoTreePlan.run` walk is. -/
+private structure QueryWalk where
+  root? : Option (Array Nat) := none
+  seen  : Nat := 0
+  nodes : Array Json := #[]
+  next  : Option Nat := none
+
+/-- Answer `q`: walk the trees of `p` in order, rendering only the nodes
+from `q.offset` on, and stop after `q.limit` of them. Touches no REPL
+state. Also returns the trees it rendered whole that were not cached,
+for `InfoTreeCache.insert`. -/
+def InfoTreePlan.run (p : InfoTreePlan) (q : InfoTreeQuery) :
+    IO (InfoTreeResponse × Array (TreeKey × Array InfoTree.NodeLine)) := do
+  let offset := q.offset.getD 0
+  let handle? ← q.infotreeTo.mapM (IO.FS.Handle.mk · .write)
+  let walk ← IO.mkRef ({} : QueryWalk)
+  -- Take the node at `path` if `q` selects it; `false` once the page is full.
+  let visit (path : Array Nat) (range? : Option (Position × Position)) (render : IO Json) :
+      IO Bool := do
+    let w ← walk.get
+    let some root? := q.selects? w.root? path range? | return true
+    if w.seen < offset then
+      walk.set { w with root?, seen := w.seen + 1 }
+      return true
+    if q.limit.any (w.seen - offset ≥ ·) then
+      walk.set { w with next := some w.seen }
+      return false
+    let json ← render
+    let mut nodes := w.nodes
+    match handle? with
+    | some h => h.putStrLn json.compress
+    | none => nodes := nodes.push json
+    walk.set { w with root?, seen := w.seen + 1, nodes }
+    return true
+  let mut rendered := #[]
+  for (key, t, lines?) in p.trees do
+    let i := key.2.2
+    match lines? with
+    | some lines =>
+      for n in lines do
+        if !(← visit n.path n.range? (pure n.json)) then break
+    | none =>
+      -- Keep the rendering when the walk renders the tree whole.
+      let lines ← IO.mkRef (if q.takesAll then some #[] else none)
+      let enter (c : Array Nat) := q.path.all fun p => p.isPrefixOf c || c.isPrefixOf p
+      let whole ← t.forNodes none (path := #[i]) (enter := enter) fun path range? render =>
+        visit path range? do
+          let json ← render
+          lines.modify (·.bind fun ls =>
+            if ls.size < infoTreeCacheNodes then some (ls.push { path, range?, json }) else none)
+          return json
+      if whole then
+        if let some ls ← lines.get then rendered := rendered.push (key, ls)
+    if (← walk.get).next.isSome then break
+  if let some h := handle? then h.flush
+  let w ← walk.get
+  return ({
+    env := q.infotreeOf
+    nodes := if handle?.isSome then none else some w.nodes
+    count := w.seen - offset
+    next := w.next }, rendered)
+
+end REPL
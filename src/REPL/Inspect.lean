@@ -0,0 +1,185 @@
+/-
+Copyright (c) 2025, xeus-lean contributors
+Released under Apache 2.0 license as described in the file LICENSE.
+-/
+import REPL.Lean.InfoTree
+
+/-!
+Hover support (Jupyter `inspect_request`, Shift+Tab).
+
+After each cell the kernel keeps a compact interval index over the
+cell's InfoTrees: one entry per term or tactic node that has an
+original source range. A lookup finds the innermost nodes around the
+cursor and pretty-prints only those, so nothing is re-elaborated and
+nothing is rendered for positions nobody hovers.
+
+Entries hold the node's `ContextInfo` (environment, metavariable
+context), which is what makes them expensive to keep; the store is
+capped by total entry count and evicts the oldest cells first.
+-/
+
+open Lean Elab Meta
+
+namespace REPL.Inspect
+
+/-- One indexed node: its byte range in the cell source, plus the info
+and context needed to pretty-print it. -/
+structure Entry where
+  start : Nat
+  stop  : Nat
+  info  : Info
+  ctx   : ContextInfo
+
+/-- Interval index for one cell. `entries` is sorted by `start`, and
+`maxStop[i]` is the largest `stop` among `entries[0..i]`, so a lookup
+scanning backwards can stop as soon as no earlier node reaches the
+cursor. -/
+structure CellIndex where
+  code    : String
+  entries : Array Entry
+  maxStop : Array Nat
+
+/-- Indices of the retained cells, oldest first. -/
+structure Store where
+  cells   : Array CellIndex := #[]
+  entries : Nat := 0
+
+/-- Default cap on indexed nodes across all retained cells. Override
+with `XLEAN_INSPECT_MAX_NODES`. -/
+def defaultMaxEntries : Nat := 200000
+
+initialize storeRef : IO.Ref Store ← IO.mkRef {}
+
+/-- Build the index for a cell from the InfoTrees its elaboration produced. -/
+def CellIndex.ofTrees (code : String) (trees : List InfoTree) : CellIndex := Id.run do
+  let mut entries : Array Entry := #[]
+  for t in trees do
+    entries := t.foldInfo (init := entries) fun ctx info acc =>
+      match info with
+      | .ofTermInfo _ | .ofTacticInfo _ =>
+        match info.stx.getPos? (canonicalOnly := true),
+              info.stx.getTailPos? (canonicalOnly := true) with
+        | some s, some e => acc.push { start := s.byteIdx, stop := e.byteIdx, info, ctx }
+        | _, _ => acc
+      | _ => acc
+  let entries := entries.qsort (·.start < ·.start)
+  let mut maxStop : Array Nat := #[]
+  let mut m := 0
+  for e in entries do
+    m := max m e.stop
+    maxStop := maxStop.push m
+  return { code, entries, maxStop }
+
+/-- Innermost term node and innermost tactic node whose range contains
+byte offset `pos` (an end position counts, so the cursor may sit just
+after an identifier). -/
+def CellIndex.nodesAt (c : CellIndex) (pos : Nat) : Option Entry × Option Entry := Id.run do
+  -- First entry starting after `pos`; everything containing `pos` is before it.
+  let mut lo := 0
+  let mut hi := c.entries.size
+  while lo < hi do
+    let mid := (lo + hi) / 2
+    if c.entries[mid]!.start ≤ pos then lo := mid + 1 else hi := mid
+  let narrower (e : Entry) (best? : Option Entry) : Bool :=
+    best?.all fun b => e.stop - e.start < b.stop - b.start
+  let mut term? : Option Entry := none
+  let mut tactic? : Option Entry := none
+  let mut i := lo
+  while i > 0 do
+    i := i - 1
+    if c.maxStop[i]! < pos then break
+    let e := c.entries[i]!
+    if pos ≤ e.stop then
+      match e.info with
+      | .ofTermInfo _ => if narrower e term? then term? := some e
+      | .ofTacticInfo _ => if narrower e tactic? then tactic? := some e
+      | _ => pure ()
+  return (term?, tactic?)
+
+/-- Record a cell's index, replacing any older index for the same
+source, then evict the oldest cells until the entry cap is met. The
+newest cell is always kept. -/
+def Store.push (s : Store) (c : CellIndex) (maxEntries : Nat) : Store := Id.run do
+  let mut cells := s.cells.filter (·.code != c.code) |>.push c
+  let mut total := cells.foldl (· + ·.entries.size) 0
+  while total > maxEntries && cells.size > 1 do
+    total := total - cells[0]!.entries.size
+    cells := cells.extract 1 cells.size
+  return { cells, entries := total }
+
+/-- Index a cell's InfoTrees and add them to the global store. -/
+def record (code : String) (trees : List InfoTree) : IO Unit := do
+  let maxEntries := (← IO.getEnv "XLEAN_INSPECT_MAX_NODES").bind (·.toNat?)
+    |>.getD defaultMaxEntries
+  let c := CellIndex.ofTrees code trees
+  storeRef.modify (·.push c maxEntries)
+
+/-- Forget every retained index (the environments they point into are gone). -/
+def clear : IO Unit :=
+  storeRef.set {}
+
+private def fence (s : String) : String :=
+  s!"```lean\n{s}\n```"
+
+/-- Signature and docstring of a constant, as markdown. -/
+def renderConst (n : Name) : MetaM String := do
+  let sig ← PrettyPrinter.ppSignature n
+  let doc? ← findDocString? (← getEnv) n
+  return fence (toString sig.fmt) ++ (doc?.map ("\n\n" ++ ·) |>.getD "")
+
+/-- Markdown for a term node: a constant's signature and docstring, or
+`e : type` for anything else (local variables, literals, applications). -/
+def renderTerm (ti : TermInfo) (ctx : ContextInfo) : IO String :=
+  ctx.runMetaM ti.lctx do
+    let e ← instantiateMVars ti.expr
+    match e.consumeMData with
+    | .const n _ => renderConst n
+    | _ =>
+      let ty ← try instantiateMVars (← inferType e) catch _ => pure (mkSort levelZero)
+      return fence s!"{← ppExpr e} : {← ppExpr ty}"
+
+/-- Markdown for a tactic node: the goals in front of the tactic. -/
+def renderGoals (ti : TacticInfo) (ctx : ContextInfo) : IO String := do
+  let goals ← ti.goalState ctx
+  if goals.isEmpty then
+    return "no goals"
+  return fence ("\n\n".intercalate (goals.map toString))
+
+/-- Hover text for byte offset `pos` in a cell whose source is `code`.
+`none` when that source was never run (or its index was evicted), or
+nothing is indexed under the cursor. -/
+def inspectCell (code : String) (pos : Nat) : IO (Option String) := do
+  let store ← storeRef.get
+  let some c := store.cells.findRev? (·.code == code) | return none
+  let (term?, tactic?) := c.nodesAt pos
+  let mut parts : Array String := #[]
+  if let some e := term? then
+    if let .ofTermInfo ti := e.info then
+      try parts := parts.push (← renderTerm ti e.ctx) catch _ => pure ()
+  if let some e := tactic? then
+    if let .ofTacticInfo ti := e.info then
+      try parts := parts.push (← renderGoals ti e.ctx) catch _ => pure ()
+  return if parts.isEmpty then none else some ("\n\n---\n\n".intercalate parts.toList)
+
+/-- Hover text for an identifier resolved in the scope left by the last
+cell. Used for source that has not been run (e.g. a cell being edited),
+where there are no InfoTrees to consult. -/
+def inspectName (cmdState : Command.State) (ident : String) : IO (Option String) := do
+  if ident.isEmpty then return none
+  let scope := cmdState.scopes.head!
+  let ctx : ContextInfo := {
+    env := cmdState.env
+    fileMap := default
+    options := scope.opts
+    currNamespace := scope.currNamespace
+    openDecls := scope.openDecls
+  }
+  try
+    ctx.runMetaM {} do
+      match (← resolveGlobalName ident.toName).find? (·.2.isEmpty) with
+      | some (n, _) => return some (← renderConst n)
+      | none => return none
+  catch _ =>
+    return none
+
+end REPL.Inspect
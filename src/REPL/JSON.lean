@@ -19,6 +19,12 @@ structure CommandOptions where
   Anything else is ignored.
   -/
   infotree : Option String
+  /--
+  Write the trees `infotree` selects ("full" when it is not set) to this
+  file, as NDJSON with one node per line (see `InfoTreeQuery`), instead of
+  returning them in the response.
+  -/
+  infotreeTo : Option System.FilePath := none
 
 /-- Run Lean commands.
 If `env = none`, starts a new session (in which you can use `import`).
@@ -41,6 +47,12 @@ Run a tactic in a proof state.
 structure ProofStep where
   proofState : Nat
   tactic : String
+  /--
+  When the tactic closes every goal: "skip" leaves the proof unchecked,
+  "defer" checks it in the background for a later `Verify`.
+  Anything else checks it before answering.
+  -/
+  checkProof : Option String := none
 deriving ToJson, FromJson
 
 /-- Line and column information for error messages and sorries. -/
@@ -168,6 +180,48 @@ instance : ToJson ProofStepResponse where
     [("proofStatus", r.proofStatus)]
   ]
 
+/-- Check the proof in a proof state, or wait for its deferred check. -/
+structure Verify where
+  verify : Nat
+deriving ToJson, FromJson
+
+structure ProofStatusResponse where
+  proofState : Nat
+  proofStatus : String
+deriving ToJson, FromJson
+
+/--
+Page through the InfoTrees of the command that produced environment
+`infotreeOf`: one JSON object per node, in preorder, each with its `path`
+of child indices (the first is the index of the top-level tree).
+-/
+structure InfoTreeQuery where
+  infotreeOf : Nat
+  /-- Which trees, as in `CommandOptions.infotree`; "full" when omitted. -/
+  infotree : Option String := none
+  /-- Only the subtree at this path. -/
+  path : Option (Array Nat) := none
+  /-- Only the outermost nodes whose source lies within `pos`..`endPos`,
+  with their subtrees. -/
+  pos : Option Pos := none
+  endPos : Option Pos := none
+  /-- Skip this many of the selected nodes. -/
+  offset : Option Nat := none
+  /-- Send at most this many nodes. -/
+  limit : Option Nat := none
+  /-- Write the nodes to this file, as NDJSON, instead of returning them. -/
+  infotreeTo : Option System.FilePath := none
+deriving ToJson, FromJson
+
+structure InfoTreeResponse where
+  env : Nat
+  /-- The nodes, unless they were written to `infotreeTo`. -/
+  nodes : Option (Array Json) := none
+  count : Nat
+  /-- The `offset` of the next page, if there are more nodes. -/
+  next : Option Nat := none
+deriving ToJson, FromJson
+
 /-- Json wrapper for an error. -/
 structure Error where
   message : String
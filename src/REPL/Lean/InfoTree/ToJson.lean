@@ -9,6 +9,11 @@ import REPL.Lean.ContextInfo
 /-!
 # Exporting an `InfoTree` as Json
 
+`InfoTree.toJson` builds one nested `Json` value per tree.
+`InfoTree.forNodes` instead walks the tree and renders each node on its
+own, as one line of NDJSON carrying its child-index path, only when the
+caller asks for it. A caller can write a large tree out as it goes, page
+through it, or send one subtree, without building the whole document.
 -/
 
 namespace Lean.Elab
@@ -108,16 +113,20 @@ structure InfoTree.HoleJson where
   goalState : String
 deriving ToJson
 
+/-- The `node` field of an info node, for the kinds that have one. -/
+def Info.nodeJson? (info : Info) (ctx : ContextInfo) : IO (Option Json) :=
+  match info with
+  | .ofTermInfo    info => some <$> (do pure <| Lean.toJson (← info.toJson ctx))
+  | .ofCommandInfo info => some <$> (do pure <| Lean.toJson (← info.toJson ctx))
+  | .ofTacticInfo  info => some <$> (do pure <| Lean.toJson (← info.toJson ctx))
+  | _                   => pure none
+
 partial def InfoTree.toJson (t : InfoTree) (ctx? : Option ContextInfo) : IO Json := do
   match t with
   | .context ctx t => t.toJson (ctx.mergeIntoOuter? ctx?)
   | .node info children =>
     if let some ctx := ctx? then
-      let node : Option Json ← match info with
-      | .ofTermInfo    info => some <$> (do pure <| Lean.toJson (← info.toJson ctx))
-      | .ofCommandInfo info => some <$> (do pure <| Lean.toJson (← info.toJson ctx))
-      | .ofTacticInfo  info => some <$> (do pure <| Lean.toJson (← info.toJson ctx))
-      | _                   => pure none
+      let node ← info.nodeJson? ctx
       return Lean.toJson (InfoTreeNode.mk info.kind node (← children.toList.mapM fun t' => t'.toJson ctx))
     else throw <| IO.userError "No `ContextInfo` available."
   | .hole mvarId =>
@@ -125,4 +134,44 @@ partial def InfoTree.toJson (t : InfoTree) (ctx? : Option ContextInfo) : IO Json
      return Lean.toJson (InfoTree.HoleJson.mk (← ctx.runMetaM {} (do Meta.ppGoal mvarId)).pretty)
     else throw <| IO.userError "No `ContextInfo` available."
 
+/-- One rendered node of a tree (see `InfoTree.forNodes`). -/
+structure InfoTree.NodeLine where
+  /-- Child indices from the root; context nodes do not count, as in `InfoTree.toJson`. -/
+  path   : Array Nat
+  /-- Source range of the node's syntax, if it has one. -/
+  range? : Option (Position × Position)
+  /-- `{"path", "kind", "node", "children"}` (`"goalState"` for a hole). -/
+  json   : Json
+
+/-- Walk `t` in preorder, with paths below `path`. `f` gets each node's
+path, its source range, and the action that renders it (see
+`NodeLine.json`), and returns whether to go on; the walk returns `false`
+once `f` has stopped it. Only nodes whose path `enter` accepts are
+visited, and only their children are entered. -/
+partial def InfoTree.forNodes (t : InfoTree) (ctx? : Option ContextInfo)
+    (f : Array Nat → Option (Position × Position) → IO Json → IO Bool)
+    (path : Array Nat := #[]) (enter : Array Nat → Bool := fun _ => true) : IO Bool := do
+  if !enter path then return true
+  match t with
+  | .context ctx t => t.forNodes (ctx.mergeIntoOuter? ctx?) f path enter
+  | .node info children =>
+    let some ctx := ctx? | throw <| IO.userError "No `ContextInfo` available."
+    let range? := info.stx.getPos?.map fun pos =>
+      (ctx.fileMap.toPosition pos, ctx.fileMap.toPosition (info.stx.getTailPos?.getD pos))
+    let render : IO Json := do
+      return Json.mkObj [("path", Lean.toJson path), ("kind", info.kind),
+        ("node", Lean.toJson (← info.nodeJson? ctx)), ("children", children.size)]
+    if !(← f path range? render) then return false
+    let mut i := 0
+    for c in children do
+      if !(← c.forNodes ctx f (path.push i) enter) then return false
+      i := i + 1
+    return true
+  | .hole mvarId =>
+    let some ctx := ctx? | throw <| IO.userError "No `ContextInfo` available."
+    let render : IO Json := do
+      let goal := (← ctx.runMetaM {} (do Meta.ppGoal mvarId)).pretty
+      return Json.mkObj [("path", Lean.toJson path), ("kind", "hole"), ("goalState", goal)]
+    f path none render
+
 end Lean.Elab
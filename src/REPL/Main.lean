@@ -11,6 +11,11 @@ import REPL.Lean.Environment
 import REPL.Lean.InfoTree
 import REPL.Lean.InfoTree.ToJson
 import REPL.Snapshots
+import REPL.SnapshotStore
+import REPL.ExecCache
+import REPL.StatusCache
+import REPL.InfoTreeCache
+import Std.Sync.Mutex
 
 /-!
 # A REPL for Lean.
@@ -58,20 +63,58 @@ open Lean Elab
 
 namespace REPL
 
+/-- A proof status; `fresh?` is set when the kernel ran to get it, and
+`cached` when the kernel's verdict came from the `StatusCache`. -/
+structure StatusCheck where
+  status : String
+  fresh? : Option ProofKey := none
+  cached : Bool := false
+
 /-- The monadic state for the Lean REPL. -/
 structure State where
   /--
   Environment snapshots after complete declarations.
   The user can run a declaration in a given environment using `{"cmd": "def f := 37", "env": 17}`.
+  At most `XLEAN_MAX_ENV_SNAPSHOTS` of them stay in memory (see `SnapshotStore`).
   -/
-  cmdStates : Array CommandSnapshot := #[]
+  cmdStates : SnapshotStore CommandSnapshot := {}
   /--
   Proof states after individual tactics.
   The user can run a tactic in a given proof state using `{"tactic": "exact 42", "proofState": 5}`.
   Declarations with containing `sorry` record a proof state at each sorry,
   and report the numerical index for the recorded state at each sorry.
+  At most `XLEAN_MAX_PROOF_SNAPSHOTS` of them stay in memory.
+  -/
+  proofStates : SnapshotStore ProofSnapshot := {}
+  /--
+  Results of side-effect free commands, by parent environment, source and options.
+  See `REPL.ExecCache`.
+  -/
+  execCache : ExecCache := {}
+  /--
+  The last input run on each recent parent environment, with a checkpoint
+  after every command, for `incremental` runs (see `IO.processInput`).
+  Newest last, at most `maxIncrementalRuns` of them.
   -/
-  proofStates : Array ProofSnapshot := #[]
+  lastRuns : Array (Nat × IO.IncrementalRun) := #[]
+  /-- Kernel verdicts on closed proof terms. See `REPL.StatusCache`. -/
+  statusCache : StatusCache := {}
+  /-- Proof checks started by `"checkProof": "defer"`, by proof state id;
+  the newest `maxPendingChecks` of them. -/
+  pendingChecks : FifoCache Nat (Task (Except IO.Error StatusCheck)) := {}
+  /-- InfoTrees of recent commands, for `InfoTreeQuery`. See `REPL.InfoTreeCache`. -/
+  infoTrees : InfoTreeCache := {}
+
+/-- How many deferred proof checks are kept for `Verify`. Older ones are
+dropped; verifying one of those checks it again. -/
+def maxPendingChecks : Nat := 1024
+
+/-- How many parent environments keep their last run for prefix reuse. -/
+def maxIncrementalRuns : Nat := 8
+
+/-- `XLEAN_INCREMENTAL=0` turns prefix reuse off for `incremental` runs. -/
+initialize incrementalEnabled : Bool ← do
+  return (← IO.getEnv "XLEAN_INCREMENTAL").all fun v => v != "0" && v != "false"
 
 /--
 The Lean REPL monad.
@@ -82,38 +125,150 @@ abbrev M (m : Type → Type) := StateT State m
 
 variable [Monad m] [MonadLiftT IO m]
 
-/-- Record an `CommandSnapshot` into the REPL state, returning its index for future use. -/
+/-- Memory budget for command snapshots. -/
+def cmdBudget : IO SnapshotBudget :=
+  SnapshotBudget.fromEnv "XLEAN_MAX_ENV_SNAPSHOTS" 64
+
+/-- Memory budget for proof snapshots. -/
+def proofBudget : IO SnapshotBudget :=
+  SnapshotBudget.fromEnv "XLEAN_MAX_PROOF_SNAPSHOTS" 1024
+
+/-- A reloaded snapshot left memory: give back its imports (see
+`acquireImports`). -/
+def releaseCmd (s : CommandSnapshot) : IO Unit :=
+  releaseImports s.cmdState.env.header.imports
+
+def releaseProof (s : ProofSnapshot) : IO Unit :=
+  releaseImports s.coreState.env.header.imports
+
+/-- Drop what the caches hold on to of environments that left memory:
+`ExecCache` entries whose environments were evicted, or whose InfoTrees
+reach into one that was spilled, and the incremental checkpoints of
+parents that were spilled or evicted. -/
+def State.pruneCaches (s : State) : State :=
+  let inMemory (i : Nat) := (s.cmdStates.get? i).isSome
+  { s with
+    execCache := s.execCache.filter fun k (response, trees) =>
+      k.env.all s.cmdStates.contains && s.cmdStates.contains response.env &&
+        (trees.isEmpty || inMemory response.env)
+    lastRuns := s.lastRuns.filter (inMemory ·.1) }
+
+/-- Install `cmdStates`, the store after an `enforce`; `before` is its
+live count before. -/
+def setCmdStates (cmdStates : SnapshotStore CommandSnapshot) (before : Nat) : M m Unit :=
+  modify fun s =>
+    let s := { s with cmdStates }
+    if cmdStates.live < before then s.pruneCaches else s
+
+/-- Record an `CommandSnapshot` into the REPL state, returning its index for future use.
+Older snapshots beyond the budget are spilled or evicted. -/
 def recordCommandSnapshot (state : CommandSnapshot) : M m Nat := do
-  let id := (← get).cmdStates.size
-  modify fun s => { s with cmdStates := s.cmdStates.push state }
+  let (cmdStates, id) := (← get).cmdStates.push state
+  let before := cmdStates.live
+  let cmdStates ← cmdStates.enforce (← cmdBudget) "env" CommandSnapshot.pickle
+    (release := releaseCmd)
+  setCmdStates cmdStates before
   return id
 
-/-- Record a `ProofSnapshot` into the REPL state, returning its index for future use. -/
+/-- Record a `ProofSnapshot` into the REPL state, returning its index for future use.
+Older snapshots beyond the budget are spilled or evicted. -/
 def recordProofSnapshot (proofState : ProofSnapshot) : M m Nat := do
-  let id := (← get).proofStates.size
-  modify fun s => { s with proofStates := s.proofStates.push proofState }
+  let (proofStates, id) := (← get).proofStates.push proofState
+  let proofStates ← proofStates.enforce (← proofBudget) "proof" ProofSnapshot.pickle
+    (release := releaseProof)
+  modify fun s => { s with proofStates }
   return id
 
-def sorries (trees : List InfoTree) (env? : Option Environment) (rootGoals? : Option (List MVarId))
-: M m (List Sorry) :=
+/-- Record a `ProofSnapshot` that `make` builds the first time its id is
+used (see `SnapshotStore.defer`). -/
+def deferProofSnapshot (make : IO ProofSnapshot) : M m Nat := do
+  let (proofStates, id) := (← get).proofStates.defer make
+  let proofStates ← proofStates.enforce (← proofBudget) "proof" ProofSnapshot.pickle
+    (release := releaseProof)
+  modify fun s => { s with proofStates }
+  return id
+
+/-- The command snapshot with id `i`, reloaded from disk if it was spilled. -/
+def commandSnapshot (i : Nat) : M m (Except String CommandSnapshot) := do
+  let loaded ← (← get).cmdStates.load i "environment" fun path =>
+    Prod.fst <$> CommandSnapshot.unpickle path
+  match loaded with
+  | .error e => return .error e
+  | .ok (snap, cmdStates) =>
+    let before := cmdStates.live
+    let cmdStates ← cmdStates.enforce (← cmdBudget) "env" CommandSnapshot.pickle (keep := some i)
+      (release := releaseCmd)
+    setCmdStates cmdStates before
+    return .ok snap
+
+/-- The proof snapshot with id `i`, reloaded from disk if it was spilled,
+or built if it was deferred. -/
+def proofSnapshot (i : Nat) : M m (Except String ProofSnapshot) := do
+  let loaded ← (← get).proofStates.load i "proof state" fun path =>
+    Prod.fst <$> ProofSnapshot.unpickle path none
+  match loaded with
+  | .error e => return .error e
+  | .ok (snap, proofStates) =>
+    let proofStates ← proofStates.enforce (← proofBudget) "proof" ProofSnapshot.pickle
+      (keep := some i) (release := releaseProof)
+    modify fun s => { s with proofStates }
+    return .ok snap
+
+/-- Snapshot store counts, for metrics. -/
+def snapshotStats : M m Json := do
+  let s ← get
+  return Json.mkObj [("env", s.cmdStates.stats), ("proofState", s.proofStates.stats),
+    ("execCache", s.execCache.stats), ("statusCache", s.statusCache.stats),
+    ("infotreeCache", s.infoTrees.stats)]
+
+/-- Rewind to environment `env`: every later environment and every proof
+state is dropped (and their ids are handed out again), as are cached
+results. What the kernels' `%reset` does to the post-import environment. -/
+def resetTo (env : Nat) : M IO Unit := do
+  let s ← get
+  let cmdStates ← s.cmdStates.truncate (env + 1) releaseCmd
+  let proofStates ← s.proofStates.truncate 0 releaseProof
+  set { s with cmdStates, proofStates, execCache := {}, lastRuns := #[], pendingChecks := {},
+    infoTrees := {} }
+
+/-- A sorry found in the info trees, before its proof state is recorded. -/
+structure SorryDraft where
+  goal   : String
+  make   : IO ProofSnapshot
+  pos    : Position
+  endPos : Position
+
+/-- The sorries in `trees`, with their goals printed; touches no REPL
+state. -/
+def sorryDrafts (trees : List InfoTree) (env? : Option Environment)
+    (rootGoals? : Option (List MVarId)) : IO (List SorryDraft) :=
   trees.flatMap InfoTree.sorries |>.filter (fun t => match t.2.1 with
     | .term _ none => false
     | _ => true ) |>.mapM
       fun ⟨ctx, g, pos, endPos⟩ => do
-        let (goal, proofState) ← match g with
+        -- The goal is printed straight from the info tree; the snapshot
+        -- is only built if its id is used.
+        let (goal, make) ← match g with
         | .tactic g => do
           let lctx ← ctx.runMetaM {} do
               match ctx.mctx.findDecl? g with
               | some decl => return decl.lctx
               | none => throwError "unknown metavariable '{g}'"
-          let s ← ProofSnapshot.create ctx lctx env? [g] rootGoals?
-          pure ("\n".intercalate <| (← s.ppGoals).map fun s => s!"{s}", some s)
+          let goal ← ctx.runMetaM lctx (Meta.ppGoal g)
+          pure (s!"{goal}", ProofSnapshot.create ctx lctx env? [g] rootGoals?)
         | .term lctx (some t) => do
-          let s ← ProofSnapshot.create ctx lctx env? [] rootGoals? [t]
-          pure ("\n".intercalate <| (← s.ppGoals).map fun s => s!"{s}", some s)
+          let goal ← ctx.runMetaM lctx do Meta.ppGoal (← Meta.mkFreshExprMVar (some t)).mvarId!
+          pure (s!"{goal}", ProofSnapshot.create ctx lctx env? [] rootGoals? [t])
         | .term _ none => unreachable!
-        let proofStateId ← proofState.mapM recordProofSnapshot
-        return Sorry.of goal pos endPos proofStateId
+        return { goal, make, pos, endPos }
+
+/-- Record the proof state of a sorry (deferred, see `deferProofSnapshot`). -/
+def SorryDraft.record (d : SorryDraft) : M m Sorry := do
+  return Sorry.of d.goal d.pos d.endPos (some (← deferProofSnapshot d.make))
+
+def sorries (trees : List InfoTree) (env? : Option Environment) (rootGoals? : Option (List MVarId))
+    : M m (List Sorry) := do
+  (← sorryDrafts trees env? rootGoals?).mapM (·.record)
 
 def ppTactic (ctx : ContextInfo) (stx : Syntax) : IO Format :=
   ctx.runMetaM {} try
@@ -124,19 +279,17 @@ def ppTactic (ctx : ContextInfo) (stx : Syntax) : IO Format :=
 def tactics (trees : List InfoTree) (env? : Option Environment) : M m (List Tactic) :=
   trees.flatMap InfoTree.tactics |>.mapM
     fun ⟨ctx, stx, rootGoals, goals, pos, endPos, ns⟩ => do
-      let proofState := some (← ProofSnapshot.create ctx none env? goals rootGoals)
+      let proofStateId ← deferProofSnapshot (ProofSnapshot.create ctx none env? goals rootGoals)
       let goals := s!"{(← ctx.ppGoals goals)}".trimAscii.toString
       let tactic := Format.pretty (← ppTactic ctx stx)
-      let proofStateId ← proofState.mapM recordProofSnapshot
-      return Tactic.of goals tactic pos endPos proofStateId ns
+      return Tactic.of goals tactic pos endPos (some proofStateId) ns
 
 def collectRootGoalsAsSorries (trees : List InfoTree) (env? : Option Environment) : M m (List Sorry) := do
   trees.flatMap InfoTree.rootGoals |>.mapM
     fun ⟨ctx, goals, pos⟩ => do
-      let proofState := some (← ProofSnapshot.create ctx none env? goals goals)
+      let proofStateId ← deferProofSnapshot (ProofSnapshot.create ctx none env? goals goals)
       let goals := s!"{(← ctx.ppGoals goals)}".trimAscii.toString
-      let proofStateId ← proofState.mapM recordProofSnapshot
-      return Sorry.of goals pos pos proofStateId
+      return Sorry.of goals pos pos (some proofStateId)
 
 
 private def collectFVarsAux : Expr → NameSet
@@ -170,6 +323,62 @@ private def abstractAllLambdaFVars (e : Expr) : MetaM Expr := do
     e' ← Meta.mkLambdaFVars fvars e'
   return e'
 
+/--
+Everything `getProofStatus` checks before the kernel: either a status, or
+the closed proof term and the declaration the kernel is to check.
+-/
+def closeProof (proofState : ProofSnapshot) : IO (Except String (ProofKey × Declaration)) := do
+  let res ← proofState.runMetaM do
+    match proofState.rootGoals with
+    | [goalId] =>
+      goalId.withContext do
+      match proofState.metaState.mctx.getExprAssignmentCore? goalId with
+      | none => return .error "Error: Goal not assigned"
+      | some pf => do
+        let pf ← instantiateMVars pf
+
+        -- First check that the proof has the expected type
+        let pft ← Meta.inferType pf >>= instantiateMVars
+        let expectedType ← Meta.inferType (mkMVar goalId) >>= instantiateMVars
+        unless (← Meta.isDefEq pft expectedType) do
+          return .error s!"Error: proof has type {pft} but root goal has type {expectedType}"
+
+        let pf ← abstractAllLambdaFVars pf
+        let pft ← Meta.inferType pf >>= instantiateMVars
+
+        if pf.hasExprMVar then
+          return .error "Incomplete: contains metavariable(s)"
+
+        -- Find all level parameters
+        let usedLevels := collectLevelParams {} pft
+        let usedLevels := collectLevelParams usedLevels pf
+
+        let decl := Declaration.defnDecl {
+          name := Name.anonymous,
+          type := pft,
+          value := pf,
+          levelParams := usedLevels.params.toList,
+          hints := ReducibilityHints.opaque,
+          safety := DefinitionSafety.safe
+        }
+        let deps := ProofKey.depsHash (← getEnv) #[pf, pft]
+        return .ok ({ value := pf, type := pft, deps }, decl)
+
+    | _ => return .error "Not verified: more than one initial goal"
+  return res.fst
+
+/-- Run the kernel on a declaration from `closeProof`. -/
+def kernelStatus (proofState : ProofSnapshot) (key : ProofKey) (decl : Declaration) : IO String := do
+  let (status, _) ← proofState.runCoreM do
+    try
+      let _ ← addDecl decl
+    catch ex =>
+      return s!"Error: kernel type check failed: {← ex.toMessageData.toString}"
+    if key.value.hasSorry then
+      return "Incomplete: contains sorry"
+    return "Completed"
+  return status
+
 /--
 Evaluates the current status of a proof, returning a string description.
 Main states include:
@@ -178,61 +387,60 @@ Main states include:
 - "Error": When kernel type checking errors occur
 
 Inspired by LeanDojo REPL's status tracking.
+
+The kernel's verdict is looked up in `cache` first. Touches no REPL
+state, so deferred checks run it as a task; see `recordStatusCheck`.
 -/
-def getProofStatus (proofState : ProofSnapshot) : M m String := do
+def checkProof (proofState : ProofSnapshot) (cache : StatusCache) : IO StatusCheck := do
   match proofState.tacticState.goals with
-    | [] =>
-      let res := proofState.runMetaM do
-        match proofState.rootGoals with
-        | [goalId] =>
-          goalId.withContext do
-          match proofState.metaState.mctx.getExprAssignmentCore? goalId with
-          | none => return "Error: Goal not assigned"
-          | some pf => do
-            let pf ← instantiateMVars pf
-
-            -- First check that the proof has the expected type
-            let pft ← Meta.inferType pf >>= instantiateMVars
-            let expectedType ← Meta.inferType (mkMVar goalId) >>= instantiateMVars
-            unless (← Meta.isDefEq pft expectedType) do
-              return s!"Error: proof has type {pft} but root goal has type {expectedType}"
-
-            let pf ← abstractAllLambdaFVars pf
-            let pft ← Meta.inferType pf >>= instantiateMVars
-
-            if pf.hasExprMVar then
-              return "Incomplete: contains metavariable(s)"
-
-            -- Find all level parameters
-            let usedLevels := collectLevelParams {} pft
-            let usedLevels := collectLevelParams usedLevels pf
-
-            let decl := Declaration.defnDecl {
-              name := Name.anonymous,
-              type := pft,
-              value := pf,
-              levelParams := usedLevels.params.toList,
-              hints := ReducibilityHints.opaque,
-              safety := DefinitionSafety.safe
-            }
-
-            try
-              let _ ← addDecl decl
-            catch ex =>
-              return s!"Error: kernel type check failed: {← ex.toMessageData.toString}"
-
-            if pf.hasSorry then
-              return "Incomplete: contains sorry"
-            return "Completed"
-
-        | _ => return "Not verified: more than one initial goal"
-      return (← res).fst
-
-    | _ => return "Incomplete: open goals remain"
-
-/-- Record a `ProofSnapshot` and generate a JSON response for it. -/
-def createProofStepReponse (proofState : ProofSnapshot) (old? : Option ProofSnapshot := none) :
-    M m ProofStepResponse := do
+  | _ :: _ => return { status := "Incomplete: open goals remain" }
+  | [] =>
+    match ← closeProof proofState with
+    | .error status => return { status }
+    | .ok (key, decl) =>
+      if let some status := cache.find? key then
+        return { status, cached := true }
+      return { status := ← kernelStatus proofState key decl, fresh? := some key }
+
+/-- Count a `StatusCheck` into the status cache, returning its status. -/
+def recordStatusCheck (c : StatusCheck) : M m String := do
+  modify fun s => { s with statusCache := Id.run do
+    let cache := s.statusCache
+    match c.fresh? with
+    | some key => return { cache.insert statusCacheSize key c.status with misses := cache.misses + 1 }
+    | none => return if c.cached then { cache with hits := cache.hits + 1 } else cache }
+  return c.status
+
+/-- Start `checkProof` as a task. -/
+def checkProofAsync (proofState : ProofSnapshot) (cache : StatusCache) :
+    IO (Task (Except IO.Error StatusCheck)) :=
+  IO.asTask (checkProof proofState cache)
+
+/-- The status of a proof, checked now (see `checkProof`). -/
+def getProofStatus (proofState : ProofSnapshot) : M m String := do
+  recordStatusCheck (← checkProof proofState (← get).statusCache)
+
+/-- How a proof step's status is to be filled in once it is recorded. -/
+inductive StatusDraft where
+  /-- Checked (or skipped); record it with `recordStatusCheck`. -/
+  | checked (c : StatusCheck)
+  /-- Checking in the background, for a later `Verify`. -/
+  | deferred (task : Task (Except IO.Error StatusCheck))
+
+/-- Everything in a `ProofStepResponse` but the ids it hands out. -/
+structure ProofStepDraft where
+  messages : List Message
+  traces   : List String
+  goals    : List String
+  sorries  : List SorryDraft
+  status   : StatusDraft
+
+/-- First half of `createProofStepReponse`: print the messages, goals and
+sorries of `proofState` and check its proof against `cache`. Touches no
+REPL state, so batch mode runs it outside the lock. `checkProof?` is
+`ProofStep.checkProof`. -/
+def draftProofStep (proofState : ProofSnapshot) (old? : Option ProofSnapshot)
+    (checkProof? : Option String) (cache : StatusCache) : IO ProofStepDraft := do
   let messages := proofState.newMessages old?
   let messages ← messages.mapM fun m => Message.of m
   let traces ← proofState.newTraces old?
@@ -245,21 +453,45 @@ def createProofStepReponse (proofState : ProofSnapshot) (old? : Option ProofSnap
   | none => pure trees
   -- For debugging purposes, sometimes we print out the trees here:
   -- trees.forM fun t => do IO.println (← t.format)
-  let sorries ← sorries trees none (some proofState.rootGoals)
+  let sorries ← sorryDrafts trees none (some proofState.rootGoals)
+  let status ← match checkProof?, proofState.tacticState.goals with
+    | some "skip", [] => pure (.checked { status := "Not verified: skipped" })
+    | some "defer", [] => StatusDraft.deferred <$> checkProofAsync proofState cache
+    | _, _ => StatusDraft.checked <$> checkProof proofState cache
+  return {
+    messages, traces, sorries, status
+    goals := (← proofState.ppGoals).map fun s => s!"{s}" }
+
+/-- Second half of `createProofStepReponse`: record the proof state, its
+sorries and its status. -/
+def finishProofStep (proofState : ProofSnapshot) (d : ProofStepDraft) : M m ProofStepResponse := do
+  let sorries ← d.sorries.mapM (·.record)
   let id ← recordProofSnapshot proofState
+  let proofStatus ← match d.status with
+    | .checked c => recordStatusCheck c
+    | .deferred task => do
+      modify fun s => { s with pendingChecks := s.pendingChecks.insert maxPendingChecks id task }
+      pure s!"Not verified: deferred, send verify {id}"
   return {
     proofState := id
-    goals := (← proofState.ppGoals).map fun s => s!"{s}"
-    messages
+    goals := d.goals
+    messages := d.messages
     sorries
-    traces
-    proofStatus := (← getProofStatus proofState) }
+    traces := d.traces
+    proofStatus }
+
+/-- Record a `ProofSnapshot` and generate a JSON response for it. `checkProof?`
+is `ProofStep.checkProof`. -/
+def createProofStepReponse (proofState : ProofSnapshot) (old? : Option ProofSnapshot := none)
+    (checkProof? : Option String := none) : M m ProofStepResponse := do
+  let draft ← draftProofStep proofState old? checkProof? (← get).statusCache
+  finishProofStep proofState draft
 
 /-- Pickle a `CommandSnapshot`, generating a JSON response. -/
 def pickleCommandSnapshot (n : PickleEnvironment) : M m (CommandResponse ⊕ Error) := do
-  match (← get).cmdStates[n.env]? with
-  | none => return .inr ⟨"Unknown environment."⟩
-  | some env =>
+  match ← commandSnapshot n.env with
+  | .error e => return .inr ⟨e⟩
+  | .ok env =>
     discard <| env.pickle n.pickleTo
     return .inl { env := n.env }
 
@@ -272,50 +504,150 @@ def unpickleCommandSnapshot (n : UnpickleEnvironment) : M IO CommandResponse :=
 /-- Pickle a `ProofSnapshot`, generating a JSON response. -/
 -- This generates a new identifier, which perhaps is not what we want?
 def pickleProofSnapshot (n : PickleProofState) : M m (ProofStepResponse ⊕ Error) := do
-  match (← get).proofStates[n.proofState]? with
-  | none => return .inr ⟨"Unknown proof State."⟩
-  | some proofState =>
+  match ← proofSnapshot n.proofState with
+  | .error e => return .inr ⟨e⟩
+  | .ok proofState =>
     discard <| proofState.pickle n.pickleTo
     return .inl (← createProofStepReponse proofState)
 
 /-- Unpickle a `ProofSnapshot`, generating a JSON response. -/
 def unpickleProofSnapshot (n : UnpickleProofState) : M IO (ProofStepResponse ⊕ Error) := do
-  let (cmdSnapshot?, notFound) ← do match n.env with
-  | none => pure (none, false)
-  | some i => do match (← get).cmdStates[i]? with
-    | some env => pure (some env, false)
-    | none => pure (none, true)
-  if notFound then
-    return .inr ⟨"Unknown environment."⟩
+  let (cmdSnapshot?, notFound?) ← do match n.env with
+  | none => pure (none, none)
+  | some i => do match ← commandSnapshot i with
+    | .ok env => pure (some env, none)
+    | .error e => pure (none, some e)
+  if let some e := notFound? then
+    return .inr ⟨e⟩
   let (proofState, _) ← ProofSnapshot.unpickle n.unpickleProofStateFrom cmdSnapshot?
   Sum.inl <$> createProofStepReponse proofState
 
-/--
-Run a command, returning the id of the new environment, and any messages and sorries.
--/
-def runCommand (s : Command) : M IO (CommandResponse ⊕ Error) := do
-  let (cmdSnapshot?, notFound) ← do match s.env with
-  | none => pure (none, false)
-  | some i => do match (← get).cmdStates[i]? with
-    | some env => pure (some env, false)
-    | none => pure (none, true)
-  if notFound then
-    return .inr ⟨"Unknown environment."⟩
-  let initialCmdState? := cmdSnapshot?.map fun c => c.cmdState
-  let (initialCmdState, cmdState, messages, trees) ← try
-    IO.processInput s.cmd initialCmdState?
+/-- First phase of `queryInfoTrees`: the trees `q` walks, with their
+cached renderings. -/
+def planInfoTreeQuery (q : InfoTreeQuery) : M IO (Except String InfoTreePlan) := do
+  let st ← get
+  let some trees := st.infoTrees.find? q.infotreeOf
+    | return .error s!"No InfoTrees kept for environment {q.infotreeOf}: only the last \
+        {maxRetainedTrees} commands that asked for `infotree` or `infotreeTo` keep theirs."
+  let selection := q.infotree.getD "full"
+  let selected := (selectTrees selection trees).toArray
+  let trees := selected.mapIdx fun i t =>
+    let key := (q.infotreeOf, selection, i)
+    (key, t, st.infoTrees.rendered.find? key)
+  let trees := trees.filter fun ((_, _, i), _) => q.path.all (·[0]?.all (· == i))
+  let cached := (trees.filter (·.2.2.isSome)).size
+  set { st with infoTrees.rendered := { st.infoTrees.rendered with
+    hits := st.infoTrees.rendered.hits + cached
+    misses := st.infoTrees.rendered.misses + (trees.size - cached) } }
+  return .ok { trees }
+
+/-- Last phase of `queryInfoTrees`: keep what `InfoTreePlan.run` rendered. -/
+def finishInfoTreeQuery (rendered : Array (TreeKey × Array InfoTree.NodeLine)) : M IO Unit :=
+  modify fun st => { st with
+    infoTrees := rendered.foldl (fun c (k, lines) => c.insert infoTreeCacheNodes k lines) st.infoTrees }
+
+/-- Answer an `InfoTreeQuery`: the selected nodes from `q.offset` on, at
+most `q.limit` of them, returned or written to `q.infotreeTo`. -/
+def queryInfoTrees (q : InfoTreeQuery) : M IO (InfoTreeResponse ⊕ Error) := do
+  match ← planInfoTreeQuery q with
+  | .error e => return .inr ⟨e⟩
+  | .ok plan =>
+    let (response, rendered) ← plan.run q
+    finishInfoTreeQuery rendered
+    return .inl response
+
+/-- The answer to a `Command`, with its raw InfoTrees. -/
+abbrev CommandResult := (CommandResponse × List InfoTree) ⊕ Error
+
+/-- What `runCommandWithTrees` carries from looking up the parent
+environment to recording the result. -/
+structure CommandPlan where
+  cmdSnapshot? : Option CommandSnapshot
+  key          : ExecKey
+  cache        : Bool
+  incremental  : Bool
+  previous?    : Option IO.IncrementalRun
+
+/-- What elaborating a command produced: see `IO.processInput`. -/
+abbrev CommandOutput :=
+  Lean.Elab.Command.State × Lean.Elab.Command.State × List Lean.Message × List InfoTree × Option IO.IncrementalRun
+
+/-- First phase of `runCommandWithTrees`: resolve the parent environment
+and consult the cache. `.error r` means `r` is already the answer (an
+unknown environment, or a cache hit). -/
+def planCommand (s : Command) (cache incremental : Bool) (parallel? : Option Nat) :
+    M IO (Except CommandResult CommandPlan) := do
+  let (cmdSnapshot?, notFound?) ← do match s.env with
+  | none => pure (none, none)
+  | some i => do match ← commandSnapshot i with
+    | .ok env => pure (some env, none)
+    | .error e => pure (none, some e)
+  if let some e := notFound? then
+    return .error (.inr ⟨e⟩)
+  let key := ExecKey.ofCommand s
+  let cache := cache && execCacheConfig.admits s
+  if cache then
+    let st ← get
+    if let some (response, trees) := st.execCache.find? key then
+      -- Only while the recorded environment can still be handed out.
+      if st.cmdStates.contains response.env then
+        set { st with
+          cmdStates := st.cmdStates.touch response.env
+          execCache.hits := st.execCache.hits + 1
+          infoTrees := if s.keepsTrees then st.infoTrees.retain response.env trees else st.infoTrees }
+        return .error (.inl (response, trees))
+    modify fun st => { st with execCache.misses := st.execCache.misses + 1 }
+  let incremental := incremental && incrementalEnabled && s.env.isSome && parallel?.isNone
+  let previous? := (← get).lastRuns.find? (some ·.1 == s.env) |>.map (·.2)
+  return .ok { cmdSnapshot?, key, cache, incremental, previous? }
+
+/-- Second phase of `runCommandWithTrees`: elaborate. Touches no REPL
+state, so it can run outside whatever serializes access to it. -/
+def CommandPlan.elaborate (p : CommandPlan) (s : Command) (cancelTk? : Option IO.CancelToken)
+    (parallel? : Option Nat) : IO (Except String CommandOutput) := do
+  try
+    return .ok (← IO.processInput s.cmd (p.cmdSnapshot?.map (·.cmdState)) (cancelTk? := cancelTk?)
+      (incremental := p.incremental) (previous? := p.previous?) (parallel? := parallel?))
   catch ex =>
-    return .inr ⟨ex.toString⟩
-  let messages ← messages.mapM fun m => Message.of m
+    return .error ex.toString
+
+/-- Third phase of `runCommandWithTrees`: the `infotree` field of the
+response, or, with `infotreeTo`, write the trees out as they are
+rendered. Touches no REPL state. -/
+def renderInfoTrees (s : Command) (trees : List InfoTree) : IO (Option Json) :=
+  Spans.withSpan "infotree_json" do
+    match s.infotreeTo with
+    | some path =>
+      writeNodeLines path (selectTrees (s.infotree.getD "full") trees)
+      return none
+    | none =>
+      let jsonTrees := selectTrees s.infotree trees
+      if jsonTrees.isEmpty then return none
+      return some <| Json.arr (← jsonTrees.toArray.mapM fun t => t.toJson none)
+
+/-- Last phase of `runCommandWithTrees`: record the new environment and
+any sorries, and build the response around `infotree` (see
+`renderInfoTrees`). -/
+def finishCommand (s : Command) (p : CommandPlan) (out : CommandOutput) (infotree : Option Json) :
+    M IO CommandResult := do
+  let (initialCmdState, cmdState, messages, trees, run?) := out
+  let cmdSnapshot? := p.cmdSnapshot?
+  if let (some parent, some run) := (s.env, run?) then
+    modify fun st =>
+      let runs := st.lastRuns.filter (·.1 != parent) |>.push (parent, run)
+      { st with lastRuns := runs.extract (runs.size - maxIncrementalRuns) runs.size }
+  let messages ← Spans.withSpan "messages" <| messages.mapM fun m => Message.of m
   -- For debugging purposes, sometimes we print out the trees here:
   -- trees.forM fun t => do IO.println (← t.format)
-  let sorries ← sorries trees initialCmdState.env none
-  let sorries ← match s.rootGoals with
-  | some true => pure (sorries ++ (← collectRootGoalsAsSorries trees initialCmdState.env))
-  | _ => pure sorries
-  let tactics ← match s.allTactics with
-  | some true => tactics trees initialCmdState.env
-  | _ => pure []
+  let (sorries, tactics) ← Spans.withSpan "sorries" do
+    let sorries ← sorries trees initialCmdState.env none
+    let sorries ← match s.rootGoals with
+    | some true => pure (sorries ++ (← collectRootGoalsAsSorries trees initialCmdState.env))
+    | _ => pure sorries
+    let tactics ← match s.allTactics with
+    | some true => tactics trees initialCmdState.env
+    | _ => pure []
+    return (sorries, tactics)
   let cmdSnapshot :=
   { cmdState
     cmdContext := (cmdSnapshot?.map fun c => c.cmdContext).getD
@@ -323,23 +655,68 @@ def runCommand (s : Command) : M IO (CommandResponse ⊕ Error) := do
         fileMap := default,
         snap? := none,
         cancelTk? := none } }
-  let env ← recordCommandSnapshot cmdSnapshot
-  let jsonTrees := match s.infotree with
-  | some "full" => trees
-  | some "tactics" => trees.flatMap InfoTree.retainTacticInfo
-  | some "original" => trees.flatMap InfoTree.retainTacticInfo |>.flatMap InfoTree.retainOriginal
-  | some "substantive" => trees.flatMap InfoTree.retainTacticInfo |>.flatMap InfoTree.retainSubstantive
-  | _ => []
-  let infotree ← if jsonTrees.isEmpty then
-    pure none
-  else
-    pure <| some <| Json.arr (← jsonTrees.toArray.mapM fun t => t.toJson none)
-  return .inl
+  let env ← Spans.withSpan "snapshot" <| recordCommandSnapshot cmdSnapshot
+  if s.keepsTrees then
+    modify fun st => { st with infoTrees := st.infoTrees.retain env trees }
+  let response : CommandResponse :=
     { env,
       messages,
       sorries,
       tactics
       infotree }
+  if p.cache then
+    -- Trees only if asked for: they keep the environments they saw alive.
+    let cached := if s.infotree.isSome then trees else []
+    modify fun st => { st with
+      execCache := st.execCache.insert execCacheConfig.maxEntries p.key (response, cached) }
+  return .inl (response, trees)
+
+/--
+Run a command, returning the id of the new environment, and any messages and sorries.
+
+If `cancelTk?` is set while the command is elaborating, elaboration stops
+and an error is returned; no snapshot is recorded, so every previously
+returned `env` id stays valid.
+
+Also returns the raw InfoTrees, whatever `s.infotree` asks to serialize,
+for callers that index them (see `REPL.Inspect`).
+
+A side-effect free command that already ran on the same environment with
+the same options is answered from `State.execCache` without elaborating,
+unless `cache := false`. Such an answer carries InfoTrees only if the command
+asked for `infotree`.
+
+With `incremental`, a command run on an environment that already ran an
+earlier version of it skips the leading commands the two have in common
+(see `IO.IncrementalRun.reusable`), so editing the end of a long cell
+only re-elaborates from the edit on.
+
+With `parallel? := some workers`, proof bodies are elaborated in parallel
+on up to `workers` commands at a time (see `IO.processCommandsParallel`);
+`incremental` does not apply then.
+-/
+def runCommandWithTrees (s : Command) (cancelTk? : Option IO.CancelToken := none)
+    (cache := true) (incremental := false) (parallel? : Option Nat := none) :
+    M IO CommandResult := do
+  match ← planCommand s cache incremental parallel? with
+  | .error done => return done
+  | .ok plan =>
+    match ← plan.elaborate s cancelTk? parallel? with
+    | .error e => return .inr ⟨e⟩
+    | .ok out =>
+      let (_, _, _, trees, _) := out
+      finishCommand s plan out (← renderInfoTrees s trees)
+
+/-- Drop the InfoTrees. -/
+def CommandResult.toResponse : CommandResult → CommandResponse ⊕ Error
+  | .inl (r, _) => .inl r
+  | .inr e => .inr e
+
+/-- Run a command, returning the id of the new environment, and any messages and sorries.
+See `runCommandWithTrees`. -/
+def runCommand (s : Command) (cancelTk? : Option IO.CancelToken := none) :
+    M IO (CommandResponse ⊕ Error) :=
+  CommandResult.toResponse <$> runCommandWithTrees s cancelTk?
 
 def processFile (s : File) : M IO (CommandResponse ⊕ Error) := do
   try
@@ -353,12 +730,34 @@ Run a single tactic, returning the id of the new proof statement, and the new go
 -/
 -- TODO detect sorries?
 def runProofStep (s : ProofStep) : M IO (ProofStepResponse ⊕ Error) := do
-  match (← get).proofStates[s.proofState]? with
-  | none => return .inr ⟨"Unknown proof state."⟩
-  | some proofState =>
+  match ← proofSnapshot s.proofState with
+  | .error e => return .inr ⟨e⟩
+  | .ok proofState =>
     try
       let proofState' ← proofState.runString s.tactic
-      return .inl (← createProofStepReponse proofState' proofState)
+      return .inl (← createProofStepReponse proofState' proofState s.checkProof)
+    catch ex =>
+      return .inr ⟨"Lean error:\n" ++ ex.toString⟩
+
+/-- How to get the status of proof state `v.verify`: wait for its deferred
+check if there is one, otherwise check it. -/
+def planVerify (v : Verify) : M IO (Except String (IO StatusCheck)) := do
+  if let some task := (← get).pendingChecks.find? v.verify then
+    modify fun s => { s with pendingChecks := s.pendingChecks.erase v.verify }
+    return .ok (do IO.ofExcept (← IO.wait task))
+  match ← proofSnapshot v.verify with
+  | .error e => return .error e
+  | .ok proofState =>
+    let cache := (← get).statusCache
+    return .ok (checkProof proofState cache)
+
+/-- Answer a `Verify` request. -/
+def verifyProof (v : Verify) : M IO (ProofStatusResponse ⊕ Error) := do
+  match ← planVerify v with
+  | .error e => return .inr ⟨e⟩
+  | .ok check =>
+    try
+      return .inl { proofState := v.verify, proofStatus := ← recordStatusCheck (← check) }
     catch ex =>
       return .inr ⟨"Lean error:\n" ++ ex.toString⟩
 
@@ -366,13 +765,17 @@ end REPL
 
 open REPL
 
-/-- Get lines from stdin until a blank line is entered. -/
-partial def getLines : IO String := do
-  let line ← (← IO.getStdin).getLine
-  if line.trimAscii.isEmpty then
-    return line
-  else
-    return line.trimAsciiEnd.toString ++ (← getLines)
+/-- Get lines from stdin until a blank line is entered. Appends to one
+buffer, so a long command costs linear, not quadratic, time. -/
+def getLines : IO String := do
+  let stdin ← IO.getStdin
+  let mut acc := ""
+  repeat
+    let line ← stdin.getLine
+    if line.trimAscii.isEmpty then
+      return acc ++ line
+    acc := acc ++ line.trimAsciiEnd.toString
+  return acc
 
 instance [ToJson α] [ToJson β] : ToJson (α ⊕ β) where
   toJson x := match x with
@@ -388,29 +791,66 @@ inductive Input
 | unpickleEnvironment : REPL.UnpickleEnvironment → Input
 | pickleProofSnapshot : REPL.PickleProofState → Input
 | unpickleProofSnapshot : REPL.UnpickleProofState → Input
+| verify : REPL.Verify → Input
+| infotreeQuery : REPL.InfoTreeQuery → Input
+
+/-- The `"type"` of each input command. -/
+def Input.kinds : List String :=
+  ["command", "file", "proofStep", "pickleEnvironment", "unpickleEnvironment",
+    "pickleProofSnapshot", "unpickleProofSnapshot", "verify", "infotreeQuery"]
+
+/-- Which input command `j` is: its `"type"` field, or else the first of
+these keys it has (the order the untagged protocol has always used). -/
+def inputKind (j : Json) : Option String :=
+  match j with
+  | .obj kvs =>
+    let has (k : String) := (kvs.find compare k).isSome
+    match kvs.find compare "type" with
+    | some (.str t) => some t
+    | _ =>
+      if has "tactic" then some "proofStep"
+      else if has "pickleTo" then some (if has "env" then "pickleEnvironment" else "pickleProofSnapshot")
+      else if has "unpickleEnvFrom" then some "unpickleEnvironment"
+      else if has "unpickleProofStateFrom" then some "unpickleProofSnapshot"
+      else if has "verify" then some "verify"
+      else if has "infotreeOf" then some "infotreeQuery"
+      else if has "cmd" then some "command"
+      else if has "path" then some "file"
+      else none
+  | _ => none
+
+private def decodeAs [FromJson α] (j : Json) (kind : String) (f : α → Input) : IO Input :=
+  match fromJson? j with
+  | .ok r => pure (f r)
+  | .error e => throw <| IO.userError <| toString <| toJson <|
+      (⟨s!"Could not parse as a valid JSON {kind}:\n{e}"⟩ : Error)
+
+/-- Parse a JSON object to an input command, decoding it once, as the
+kind `inputKind` picks. -/
+def parseJson (j : Json) : IO Input := do
+  match inputKind j with
+  | some "command" => decodeAs j "command" Input.command
+  | some "file" => decodeAs j "file" Input.file
+  | some "proofStep" => decodeAs j "proofStep" Input.proofStep
+  | some "pickleEnvironment" => decodeAs j "pickleEnvironment" Input.pickleEnvironment
+  | some "unpickleEnvironment" => decodeAs j "unpickleEnvironment" Input.unpickleEnvironment
+  | some "pickleProofSnapshot" => decodeAs j "pickleProofSnapshot" Input.pickleProofSnapshot
+  | some "unpickleProofSnapshot" => decodeAs j "unpickleProofSnapshot" Input.unpickleProofSnapshot
+  | some "verify" => decodeAs j "verify" Input.verify
+  | some "infotreeQuery" => decodeAs j "infotreeQuery" Input.infotreeQuery
+  | some k => throw <| IO.userError <| toString <| toJson <|
+      (⟨s!"Unknown request type '{k}'; expected one of {Input.kinds}"⟩ : Error)
+  | none => throw <| IO.userError <| toString <| toJson <|
+      (⟨"Could not parse as a valid JSON command: expected a \"type\" field or one of \
+        the keys cmd, path, tactic, pickleTo, unpickleEnvFrom, unpickleProofStateFrom, \
+        verify, infotreeOf"⟩ : Error)
 
 /-- Parse a user input string to an input command. -/
 def parse (query : String) : IO Input := do
-  let json := Json.parse query
-  match json with
+  match Json.parse query with
   | .error e => throw <| IO.userError <| toString <| toJson <|
       (⟨"Could not parse JSON:\n" ++ e⟩ : Error)
-  | .ok j => match fromJson? j with
-    | .ok (r : REPL.ProofStep) => return .proofStep r
-    | .error _ => match fromJson? j with
-    | .ok (r : REPL.PickleEnvironment) => return .pickleEnvironment r
-    | .error _ => match fromJson? j with
-    | .ok (r : REPL.UnpickleEnvironment) => return .unpickleEnvironment r
-    | .error _ => match fromJson? j with
-    | .ok (r : REPL.PickleProofState) => return .pickleProofSnapshot r
-    | .error _ => match fromJson? j with
-    | .ok (r : REPL.UnpickleProofState) => return .unpickleProofSnapshot r
-    | .error _ => match fromJson? j with
-    | .ok (r : REPL.Command) => return .command r
-    | .error _ => match fromJson? j with
-    | .ok (r : REPL.File) => return .file r
-    | .error e => throw <| IO.userError <| toString <| toJson <|
-        (⟨"Could not parse as a valid JSON command:\n" ++ e⟩ : Error)
+  | .ok j => parseJson j
 
 /-- Avoid buffering the output. -/
 def printFlush [ToString α] (s : α) : IO Unit := do
@@ -418,6 +858,18 @@ def printFlush [ToString α] (s : α) : IO Unit := do
   out.putStr (toString s)
   out.flush -- Flush the output
 
+/-- Run one input command. -/
+def runInput : Input → M IO Json
+  | .command r => return toJson (← runCommand r)
+  | .file r => return toJson (← processFile r)
+  | .proofStep r => return toJson (← runProofStep r)
+  | .pickleEnvironment r => return toJson (← pickleCommandSnapshot r)
+  | .unpickleEnvironment r => return toJson (← unpickleCommandSnapshot r)
+  | .pickleProofSnapshot r => return toJson (← pickleProofSnapshot r)
+  | .unpickleProofSnapshot r => return toJson (← unpickleProofSnapshot r)
+  | .verify r => return toJson (← verifyProof r)
+  | .infotreeQuery r => return toJson (← queryInfoTrees r)
+
 /-- Read-eval-print loop for Lean. -/
 unsafe def repl : IO Unit :=
   StateT.run' loop {}
@@ -426,18 +878,126 @@ where loop : M IO Unit := do
   if query = "" then
     return ()
   if query.startsWith "#" || query.startsWith "--" then loop else
-  IO.println <| toString <| ← match ← parse query with
-  | .command r => return toJson (← runCommand r)
-  | .file r => return toJson (← processFile r)
-  | .proofStep r => return toJson (← runProofStep r)
-  | .pickleEnvironment r => return toJson (← pickleCommandSnapshot r)
-  | .unpickleEnvironment r => return toJson (← unpickleCommandSnapshot r)
-  | .pickleProofSnapshot r => return toJson (← pickleProofSnapshot r)
-  | .unpickleProofSnapshot r => return toJson (← unpickleProofSnapshot r)
+  IO.println <| toString <| ← runInput (← parse query)
   printFlush "\n" -- easier to parse the output if there are blank lines
   loop
 
-/-- Main executable function, run as `lake exe repl`. -/
-unsafe def main_ (_ : List String) : IO Unit := do
-  initSearchPath (← Lean.findSysroot)
-  repl
+/-! ## Batch mode
+
+`repl --batch` reads one JSON request per line and writes one JSON
+response per line, each carrying the request's `"id"` (its line number,
+counting from 0, when it has none). Requests run concurrently as Lean
+tasks and are answered as they finish. Only requests on the same
+snapshot (the same `proofState`, or the same `env`) keep their input
+order: each waits for the one before it. Elaboration and tactics run
+outside the lock that guards the REPL state, and so does rendering
+InfoTrees; looking up and recording snapshots run under it.
+-/
+
+/-- Run `x` on the shared REPL state. -/
+def locked (st : Std.Mutex State) (x : M IO α) : IO α :=
+  st.atomically do
+    let (a, s) ← x.run (← get)
+    set s
+    return a
+
+/-- The snapshot a request reads, if any: requests with the same key run
+in input order. -/
+def Input.lineage : Input → Option String
+  | .command r => r.env.map (s!"env {·}")
+  | .file r => r.env.map (s!"env {·}")
+  | .proofStep r => some s!"proofState {r.proofState}"
+  | .pickleEnvironment r => some s!"env {r.env}"
+  | .pickleProofSnapshot r => some s!"proofState {r.proofState}"
+  | .verify r => some s!"proofState {r.verify}"
+  | .infotreeQuery r => some s!"env {r.infotreeOf}"
+  | .unpickleEnvironment _ | .unpickleProofSnapshot _ => none
+
+/-- `runInput` with commands and tactics elaborated outside the lock. -/
+def runInputConcurrently (st : Std.Mutex State) : Input → IO Json
+  | .command r => do
+    match ← locked st (planCommand r (cache := true) (incremental := false) none) with
+    | .error done => return toJson (CommandResult.toResponse done)
+    | .ok plan =>
+      match ← plan.elaborate r none none with
+      | .error e => return toJson (⟨e⟩ : Error)
+      | .ok out =>
+        let (_, _, _, trees, _) := out
+        let infotree ← renderInfoTrees r trees
+        return toJson (CommandResult.toResponse (← locked st (finishCommand r plan out infotree)))
+  | .proofStep r => do
+    match ← locked st (proofSnapshot r.proofState) with
+    | .error e => return toJson (⟨e⟩ : Error)
+    | .ok proofState =>
+      try
+        let proofState' ← proofState.runString r.tactic
+        let cache ← locked st do return (← get).statusCache
+        let draft ← draftProofStep proofState' proofState r.checkProof cache
+        return toJson (← locked st (finishProofStep proofState' draft))
+      catch ex =>
+        return toJson (⟨"Lean error:\n" ++ ex.toString⟩ : Error)
+  | .verify r => do
+    match ← locked st (planVerify r) with
+    | .error e => return toJson (⟨e⟩ : Error)
+    | .ok check =>
+      let check ← check
+      let proofStatus ← locked st (recordStatusCheck check)
+      return toJson ({ proofState := r.verify, proofStatus } : ProofStatusResponse)
+  | .infotreeQuery r => do
+    match ← locked st (planInfoTreeQuery r) with
+    | .error e => return toJson (⟨e⟩ : Error)
+    | .ok plan =>
+      let (response, rendered) ← plan.run r
+      locked st (finishInfoTreeQuery rendered)
+      return toJson (response : InfoTreeResponse)
+  | input => locked st (runInput input)
+
+/-- Read NDJSON requests from stdin until EOF; see "Batch mode". -/
+def batch : IO Unit := do
+  let st ← Std.Mutex.new ({} : State)
+  let out ← Std.Mutex.new ()
+  let stdin ← IO.getStdin
+  let stdout ← IO.getStdout
+  let mut tails : Std.HashMap String (Task (Except IO.Error Unit)) := {}
+  let mut tasks : Array (Task (Except IO.Error Unit)) := #[]
+  let mut seq := 0
+  repeat
+    let line ← stdin.getLine
+    if line.isEmpty then break
+    let line := line.trimAscii.toString
+    if line.isEmpty then continue
+    let n := seq
+    seq := seq + 1
+    let (id, input) ← match Json.parse line with
+      | .error e => pure (toJson n, Except.error s!"Could not parse JSON:\n{e}")
+      | .ok j => do
+        let id := (j.getObjVal? "id").toOption.getD (toJson n)
+        try pure (id, .ok (← parseJson j)) catch e => pure (id, .error e.toString)
+    let respond (resp : Json) : IO Unit := out.atomically do
+      stdout.putStrLn (resp.setObjVal! "id" id).compress
+      stdout.flush
+    let job : IO Unit := do
+      match input with
+      | .error e => respond (toJson (⟨e⟩ : Error))
+      | .ok input =>
+        try respond (← runInputConcurrently st input)
+        catch e => respond (toJson (⟨e.toString⟩ : Error))
+    let key? := input.toOption.bind (·.lineage)
+    let prev? := key?.bind fun k => tails[k]?
+    let task ← match prev? with
+      | some prev => IO.bindTask prev fun _ => IO.asTask job
+      | none => IO.asTask job
+    if let some key := key? then
+      tails := tails.insert key task
+    tasks := tasks.push task
+  for t in tasks do
+    discard <| IO.wait t
+
+/-- Main executable function, run as `lake exe repl`; `--batch` selects
+the NDJSON batch mode. -/
+unsafe def main_ (args : List String) : IO Unit := do
+  discard Runtime.get
+  try
+    if args.contains "--batch" then batch else repl
+  finally
+    removeSpillDir
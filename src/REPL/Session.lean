@@ -0,0 +1,123 @@
+/-
+Copyright (c) 2025, xeus-lean contributors
+Released under Apache 2.0 license as described in the file LICENSE.
+-/
+import REPL.Main
+import REPL.Cells
+
+/-!
+# Saved sessions
+
+A notebook kernel's cell chain (see `REPL.Cells`) written to a directory,
+so that a new kernel can pick up where a crashed or drained one left off
+without re-running every cell:
+
+* `session.json`: format version, the imports, and each cell's
+  execution count and declared names (`Cells.Node.declared`);
+* `root.olean`: the post-import environment, which only records its
+  imports;
+* `cell-<k>.olean`: the constants the `k`-th cell on the chain added,
+  relative to the cell before it (`CommandSnapshot.pickleDelta`).
+
+Restoring re-imports (or reuses the kernel's own post-import
+environment when the imports match) and replays the cells' constants in
+order. Like `pickleTo`, only constants survive: attributes, instances and
+other environment extension entries the cells added are not restored,
+nor are their messages or hover info.
+-/
+
+open Lean Elab System
+
+namespace REPL.Session
+
+def formatVersion : Nat := 1
+
+private def loadEnv (i : Nat) : M IO CommandSnapshot := do
+  match ← commandSnapshot i with
+  | .ok snap => return snap
+  | .error e => throw (IO.userError e)
+
+private def importNames (env : Environment) : Array Name :=
+  env.header.imports.map (·.module)
+
+/-- Write `cells` to `dir`. `saved` is what an earlier call wrote there
+(`Cells.Graph.pinned` of the chain it saved): cells that are still on the
+chain in the same place are not written again. Returns what `dir` holds
+now. The manifest goes last, after every cell file it lists. -/
+def sync (cells : Cells.Graph) (dir : FilePath) (saved : Array Nat := #[]) :
+    M IO (Array Nat) := do
+  let some root := cells.root? | throw (IO.userError "nothing to save: no cell has run yet")
+  let target := cells.pinned
+  if target == saved then return saved
+  IO.FS.createDirAll dir
+  let rootSnap ← loadEnv root
+  unless saved[0]? == some root do
+    rootSnap.pickle (dir / "root.olean")
+  let mut entries : Array Json := #[]
+  for h : k in [0:cells.chain.size] do
+    let node := cells.chain[k]
+    unless saved[k]? == some node.parent && saved[k + 1]? == some node.env do
+      let parent ← loadEnv node.parent
+      (← loadEnv node.env).pickleDelta parent.cmdState.env (dir / s!"cell-{k}.olean")
+    entries := entries.push (Json.mkObj [("execCount", toJson node.execCount.toNat),
+      ("declared", toJson (node.declared.map toString))])
+  let manifest := Json.mkObj [
+    ("version", toJson formatVersion),
+    ("imports", toJson ((importNames rootSnap.cmdState.env).map toString)),
+    ("cells", Json.arr entries)]
+  IO.FS.writeFile (dir / "session.json.tmp") manifest.pretty
+  IO.FS.rename (dir / "session.json.tmp") (dir / "session.json")
+  return target
+
+/-- Write `cells` to `dir`. Returns how many cells were saved. -/
+def save (cells : Cells.Graph) (dir : FilePath) : M IO Nat := do
+  discard <| sync cells dir
+  return cells.chain.size
+
+/-- Replace the session with the one saved in `dir`, on top of the
+post-import environment `root?` when there is one. Returns the restored
+cell chain. -/
+def restore (root? : Option Nat) (dir : FilePath) : M IO Cells.Graph := do
+  let manifest ← IO.ofExcept <| Json.parse (← IO.FS.readFile (dir / "session.json"))
+  let version ← IO.ofExcept <| manifest.getObjValAs? Nat "version"
+  unless version == formatVersion do
+    throw (IO.userError s!"{dir}: unsupported session format {version}")
+  let imports ← IO.ofExcept <| manifest.getObjValAs? (Array String) "imports"
+  let saved ← IO.ofExcept <| manifest.getObjValAs? (Array Json) "cells"
+  let rootSnap ← match root? with
+    | some r =>
+      let snap ← loadEnv r
+      let current := (importNames snap.cmdState.env).map toString
+      unless current == imports do
+        throw (IO.userError s!"{dir} was saved with imports {imports}, this kernel has \
+          {current}; restore it in a fresh kernel instead")
+      pure snap
+    | none => Prod.fst <$> CommandSnapshot.unpickle (dir / "root.olean")
+  -- Read every cell before touching the session, so that a bad save
+  -- leaves it as it was.
+  let mut snaps : Array (Nat × Array Name × CommandSnapshot) := #[]
+  let mut parent := rootSnap.cmdState.env
+  for h : k in [0:saved.size] do
+    let execCount ← IO.ofExcept <| saved[k].getObjValAs? Nat "execCount"
+    let declared := (saved[k].getObjValAs? (Array String) "declared").toOption.getD #[]
+    let (snap, _) ← CommandSnapshot.unpickleDelta (dir / s!"cell-{k}.olean") parent
+    snaps := snaps.push (execCount, declared.map String.toName, snap)
+    parent := snap.cmdState.env
+  let rootId ← match root? with
+    | some r => do resetTo r; pure r
+    | none => recordCommandSnapshot rootSnap
+  modify fun s => { s with cmdStates := s.cmdStates.pin #[rootId] }
+  let mut cells : Cells.Graph := { root? := some rootId }
+  parent := rootSnap.cmdState.env
+  let mut parentId := rootId
+  for (execCount, declared, snap) in snaps do
+    let env ← recordCommandSnapshot snap
+    let decls := Cells.addedConstants (some parent) snap.cmdState.env
+    cells := cells.push { execCount := execCount.toUInt32, parent := parentId, env, decls, declared }
+    -- Before the next cell can push this one out of memory.
+    modify fun s => { s with cmdStates := s.cmdStates.pin cells.pinned }
+    parent := snap.cmdState.env
+    parentId := env
+  return cells
+
+end REPL.Session
@@ -0,0 +1,262 @@
+/-
+Copyright (c) 2025, xeus-lean contributors
+Released under Apache 2.0 license as described in the file LICENSE.
+-/
+import Lean.Data.Json
+
+/-!
+# Bounded snapshot storage
+
+`REPL.State` hands out environment and proof-state ids as indices into
+append-only stores. Left alone, a long notebook session or an MCP-driven
+proof search keeps every snapshot it ever made alive. A `SnapshotStore`
+keeps ids stable but can bound how many snapshots stay in memory: once
+the live count exceeds the budget, the least recently used ones are
+spilled to disk (when a spill directory is configured) or dropped. With
+neither a budget nor a spill directory configured there is no bound, so
+an id a client was handed stays usable.
+
+Spill files go to a directory of their own per process under the
+configured one (`processSpillDir`): kernels sharing it, such as the
+children of one zygote, hand out the same ids.
+
+A spilled snapshot is reloaded transparently the next time its id is
+used; a dropped one reports a clear error instead of "unknown id". The
+newest snapshot, which is what the next cell builds on, is never evicted.
+
+A snapshot can also be recorded deferred, as the action that builds it:
+`tactics` and `sorries` hand out an id for every node of a proof, and
+clients follow up on few of them. The action runs the first time the id
+is loaded. Until then the slot is a closure over data the proof keeps
+anyway, so it does not count towards the budget and is never evicted;
+once built it is an ordinary live snapshot.
+
+A reloaded snapshot remembers its file. Evicting it again just goes back
+to that file: rewriting it would pull the pages out from under the
+reloaded copy, which may still be mapped from it.
+-/
+
+open Lean
+
+namespace REPL
+
+/-- Where a recorded snapshot currently lives. -/
+inductive Slot (α : Type) where
+  /-- In memory; `file?` is the spill file it was reloaded from. -/
+  | live (snap : α) (lastUse : Nat) (file? : Option System.FilePath)
+  | spilled (path : System.FilePath)
+  | evicted
+  /-- Not built yet; `make` builds it. -/
+  | deferred (make : IO α) (lastUse : Nat)
+
+instance : Inhabited (Slot α) := ⟨.evicted⟩
+
+/-- How many snapshots of one kind to keep in memory (`none`: all of
+them), and where to spill the rest (`none`: drop them). -/
+structure SnapshotBudget where
+  maxLive   : Option Nat := none
+  spillDir? : Option System.FilePath := none
+
+/-- The spill directory this process made, with the pid that made it. -/
+initialize spillDirRef : IO.Ref (Option (UInt32 × System.FilePath)) ← IO.mkRef none
+
+/-- This process's spill directory under `base`, `xlean-<pid>-<nonce>`.
+A forked child gets a directory of its own. -/
+def processSpillDir (base : System.FilePath) : IO System.FilePath := do
+  let pid ← IO.getPID
+  if let some (p, dir) ← spillDirRef.get then
+    if p == pid then return dir
+  let dir := base / s!"xlean-{pid}-{(← IO.monoNanosNow) % 1000000}"
+  spillDirRef.set (some (pid, dir))
+  return dir
+
+/-- Remove this process's spill directory, if it made one. Called on
+exit. -/
+def removeSpillDir : IO Unit := do
+  if let some (pid, dir) ← spillDirRef.get then
+    if pid == (← IO.getPID) then
+      try IO.FS.removeDirAll dir catch _ => pure ()
+
+/-- Read a budget from the environment: `maxVar` caps the live count,
+`XLEAN_SNAPSHOT_SPILL_DIR` enables spilling. A spill directory without
+a cap caps at `default`; neither means no bound. -/
+def SnapshotBudget.fromEnv (maxVar : String) (default : Nat) : IO SnapshotBudget := do
+  let max? := (← IO.getEnv maxVar).bind (·.toNat?)
+  let base? := (← IO.getEnv "XLEAN_SNAPSHOT_SPILL_DIR").filter (!·.isEmpty)
+    |>.map System.FilePath.mk
+  let spillDir? ← base?.mapM processSpillDir
+  let maxLive := match max?, spillDir? with
+    | some n, _ => some (max n 2)
+    | none, some _ => some default
+    | none, none => none
+  return { maxLive, spillDir? }
+
+structure SnapshotStore (α : Type) where
+  slots     : Array (Slot α) := #[]
+  /-- Logical clock for LRU; bumped on every record and use. -/
+  clock     : Nat := 0
+  live      : Nat := 0
+  spills    : Nat := 0
+  reloads   : Nat := 0
+  evictions : Nat := 0
+  /-- Deferred snapshots built so far. -/
+  builds    : Nat := 0
+  /-- Ids that are never evicted, whatever the budget (the notebook
+  kernel pins the environments its cell chain can still fork from). -/
+  pinned    : Array Nat := #[]
+
+namespace SnapshotStore
+
+variable {α : Type}
+
+instance : Inhabited (SnapshotStore α) := ⟨{}⟩
+
+/-- Number of ids handed out so far. -/
+def size (s : SnapshotStore α) : Nat :=
+  s.slots.size
+
+/-- Append a snapshot, returning the store and its id. -/
+def push (s : SnapshotStore α) (a : α) : SnapshotStore α × Nat :=
+  ({ s with slots := s.slots.push (.live a s.clock none), clock := s.clock + 1, live := s.live + 1 },
+   s.slots.size)
+
+/-- Append a deferred snapshot (see `Slot.deferred`), returning the store
+and its id. -/
+def defer (s : SnapshotStore α) (make : IO α) : SnapshotStore α × Nat :=
+  ({ s with slots := s.slots.push (.deferred make s.clock), clock := s.clock + 1 },
+   s.slots.size)
+
+/-- The snapshot with id `i`, if it is in memory. Does not count as a use. -/
+def get? (s : SnapshotStore α) (i : Nat) : Option α :=
+  match s.slots[i]? with
+  | some (.live a _ _) => some a
+  | _ => none
+
+/-- Can id `i` still be used (it is live or spilled)? -/
+def contains (s : SnapshotStore α) (i : Nat) : Bool :=
+  match s.slots[i]? with
+  | some .evicted | none => false
+  | _ => true
+
+/-- The newest snapshot, if it is in memory. -/
+def back? (s : SnapshotStore α) : Option α :=
+  s.get? (s.size - 1)
+
+/-- Mark live snapshot `i` as just used. -/
+def touch (s : SnapshotStore α) (i : Nat) : SnapshotStore α :=
+  match s.slots[i]? with
+  | some (.live a _ f) => { s with slots := s.slots.set! i (.live a s.clock f), clock := s.clock + 1 }
+  | some (.deferred m _) => { s with slots := s.slots.set! i (.deferred m s.clock), clock := s.clock + 1 }
+  | _ => s
+
+/-- Replace the set of pinned ids. -/
+def pin (s : SnapshotStore α) (ids : Array Nat) : SnapshotStore α :=
+  { s with pinned := ids }
+
+/-- Live ids to evict to get down to `maxLive`, least recently used first.
+The newest id, `keep` and pinned ids are never chosen. -/
+def victims (s : SnapshotStore α) (maxLive : Option Nat) (keep : Option Nat := none) : Array Nat :=
+  let some maxLive := maxLive | #[]
+  if s.live ≤ maxLive then #[] else Id.run do
+    let mut cands : Array (Nat × Nat) := #[]
+    for i in [0:s.slots.size - 1] do
+      if keep == some i || s.pinned.contains i then continue
+      match s.slots[i]! with
+      | .live _ t _ => cands := cands.push (t, i)
+      | _ => pure ()
+    let cands := cands.qsort (·.1 < ·.1)
+    return (cands.extract 0 (s.live - maxLive)).map (·.2)
+
+/-- Bring the store within `budget`, spilling each victim with `pickle`
+when a spill directory is set. `kind` names the files (`env-3.olean`). A
+failed spill degrades to a plain eviction. `release` is called for each
+reloaded snapshot that leaves memory. -/
+def enforce (s : SnapshotStore α) (budget : SnapshotBudget) (kind : String)
+    (pickle : α → System.FilePath → IO Unit) (keep : Option Nat := none)
+    (release : α → IO Unit := fun _ => pure ()) :
+    IO (SnapshotStore α) := do
+  let mut s := s
+  for i in s.victims budget.maxLive keep do
+    let some (.live a _ file?) := s.slots[i]? | continue
+    let mut slot : Slot α := .evicted
+    if let some path := file? then
+      release a
+      slot := .spilled path
+    else if let some dir := budget.spillDir? then
+      let path := dir / s!"{kind}-{i}.olean"
+      try
+        IO.FS.createDirAll dir
+        pickle a path
+        slot := .spilled path
+      catch _ => pure ()
+    s := { s with
+      slots := s.slots.set! i slot
+      live := s.live - 1
+      spills := if (slot matches .spilled _) && file?.isNone then s.spills + 1 else s.spills
+      evictions := if slot matches .evicted then s.evictions + 1 else s.evictions }
+  return s
+
+/-- Look up id `i`, reloading it with `unpickle` if it was spilled. On
+success the snapshot counts as used (and, if reloaded, is live again;
+call `enforce` afterwards). `what` names the kind in error messages. -/
+def load (s : SnapshotStore α) (i : Nat) (what : String)
+    (unpickle : System.FilePath → IO α) : IO (Except String (α × SnapshotStore α)) := do
+  match s.slots[i]? with
+  | none => return .error s!"Unknown {what}."
+  | some (.live a _ _) => return .ok (a, s.touch i)
+  | some (.deferred make _) =>
+    try
+      let a ← make
+      return .ok (a, { s with
+        slots := s.slots.set! i (.live a s.clock none)
+        clock := s.clock + 1
+        live := s.live + 1
+        builds := s.builds + 1 })
+    catch e =>
+      return .error s!"Could not build {what} {i}: {e}"
+  | some .evicted =>
+    return .error s!"{what.capitalize} {i} was evicted to stay within the snapshot budget; \
+      re-run the code that produced it, raise XLEAN_MAX_ENV_SNAPSHOTS / \
+      XLEAN_MAX_PROOF_SNAPSHOTS, or set XLEAN_SNAPSHOT_SPILL_DIR."
+  | some (.spilled path) =>
+    try
+      let a ← unpickle path
+      return .ok (a, { s with
+        slots := s.slots.set! i (.live a s.clock (some path))
+        clock := s.clock + 1
+        live := s.live + 1
+        reloads := s.reloads + 1 })
+    catch e =>
+      return .error s!"Could not reload spilled {what} {i} from {path}: {e}"
+
+/-- Forget ids `n` and later, deleting their spill files. The next id
+handed out is `n` again. `release` is called for each dropped snapshot
+that had been reloaded. -/
+def truncate (s : SnapshotStore α) (n : Nat) (release : α → IO Unit := fun _ => pure ()) :
+    IO (SnapshotStore α) := do
+  for slot in s.slots.extract n s.slots.size do
+    match slot with
+    | .spilled path => try IO.FS.removeFile path catch _ => pure ()
+    | .live a _ (some path) =>
+      release a
+      try IO.FS.removeFile path catch _ => pure ()
+    | _ => pure ()
+  let slots := s.slots.extract 0 n
+  return { s with
+    slots
+    live := (slots.filter (· matches .live _ _ _)).size
+    pinned := s.pinned.filter (· < n) }
+
+/-- Counts for metrics. -/
+def stats (s : SnapshotStore α) : Json :=
+  Json.mkObj [
+    ("ids", toJson s.size), ("live", toJson s.live),
+    ("spilled", toJson (s.slots.filter (· matches .spilled _)).size),
+    ("evicted", toJson (s.slots.filter (· matches .evicted)).size),
+    ("deferred", toJson (s.slots.filter (· matches .deferred _ _)).size),
+    ("spills", toJson s.spills), ("reloads", toJson s.reloads),
+    ("evictions", toJson s.evictions), ("builds", toJson s.builds)]
+
+end SnapshotStore
+
+end REPL
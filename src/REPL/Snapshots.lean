@@ -27,6 +27,56 @@ end Lean.Elab.Command
 
 namespace REPL
 
+/-- An imported environment shared by the snapshots unpickled onto it. -/
+structure ImportedBase where
+  env     : Environment
+  /-- Reloaded store snapshots built on `env` that are still in memory. -/
+  refs    : Nat
+  /-- When the last reference was taken or given back (`IO.monoNanosNow`). -/
+  lastUse : Nat
+
+/-- Imported environments by import list. A snapshot is pickled relative
+to its imports, so unpickling it means importing them; thousands of
+snapshots on the same imports should pay for that once. -/
+initialize importedBases : IO.Ref (Std.HashMap (Array (Name × Bool)) ImportedBase) ←
+  IO.mkRef {}
+
+/-- How many import lists stay imported with nothing built on them, for
+the next snapshot that reloads onto one. -/
+def maxIdleImportedBases : Nat := 2
+
+private def importsKey (imports : Array Import) : Array (Name × Bool) :=
+  imports.map fun i => (i.module, i.importAll)
+
+/-- The environment `imports` produce, imported at most once while
+anything holds a reference to it. Takes a reference, which
+`releaseImports` gives back; snapshots unpickled by the `unpickleEnvFrom`
+and `unpickleProofStateFrom` commands never give theirs back, so their
+imports stay cached for the session. -/
+def acquireImports (imports : Array Import) : IO Environment := do
+  let key := importsKey imports
+  let now ← IO.monoNanosNow
+  if let some b := (← importedBases.get)[key]? then
+    importedBases.modify (·.insert key { b with refs := b.refs + 1, lastUse := now })
+    return b.env
+  let env ← importModules imports {} 0 (loadExts := true)
+  importedBases.modify (·.insert key { env, refs := 1, lastUse := now })
+  return env
+
+/-- Give back a reference taken by `acquireImports`. An environment
+nothing holds a reference to stays cached, so a snapshot that is evicted
+and reloaded again does not import again; only the
+`maxIdleImportedBases` most recently used of those are kept (snapshots
+built on a dropped one keep it alive for as long as they need it). -/
+def releaseImports (imports : Array Import) : IO Unit := do
+  let now ← IO.monoNanosNow
+  importedBases.modify fun m => Id.run do
+    let key := importsKey imports
+    let some b := m[key]? | return m
+    let m := m.insert key { b with refs := b.refs - 1, lastUse := now }
+    let idle := m.toArray.filter (·.2.refs == 0) |>.qsort (·.2.lastUse > ·.2.lastUse)
+    return idle.extract maxIdleImportedBases idle.size |>.foldl (fun m (k, _) => m.erase k) m
+
 /--
 Bundled structure for the `State` and `Context` objects
 for the `CommandElabM` monad.
@@ -83,7 +133,41 @@ def unpickle (path : FilePath) : IO (CommandSnapshot × CompactedRegion) := unsa
   let ((imports, map₂, cmdState, cmdContext), region) ←
     _root_.unpickle (Array Import × PHashMap Name ConstantInfo × CompactableCommandSnapshot ×
       Command.Context) path
-  let env ← (← importModules imports {} 0 (loadExts := true)).replay (Std.HashMap.ofList map₂.toList)
+  let env ← (← acquireImports imports).replay (Std.HashMap.ofList map₂.toList)
+  let p' : CommandSnapshot :=
+  { cmdState := { cmdState with env }
+    cmdContext }
+  let (_, p'') ← p'.runCommandElabM do
+    for o in ← getOpenDecls do
+      if let .simple ns _ := o then do
+        activateScoped ns
+  return (p'', region)
+
+/--
+Pickle a `CommandSnapshot` relative to `parent`, an environment it was
+built on: only the constants `parent` does not have are written.
+-/
+def pickleDelta (p : CommandSnapshot) (parent : Environment) (path : FilePath) : IO Unit := do
+  let env := p.cmdState.env
+  let delta : PHashMap Name ConstantInfo := env.constants.map₂.foldl (init := {}) fun acc n c =>
+    if parent.constants.map₂.contains n then acc else acc.insert n c
+  let p' := { p with cmdState := { p.cmdState with env := ← mkEmptyEnvironment }}
+  _root_.pickle path
+    (env.header.imports,
+     delta,
+     ({ p'.cmdState with } : CompactableCommandSnapshot),
+     p'.cmdContext)
+
+/--
+Unpickle a `pickleDelta` file on top of `parent`, the environment it was
+taken relative to (or an equivalent one): no imports are loaded.
+-/
+def unpickleDelta (path : FilePath) (parent : Environment) :
+    IO (CommandSnapshot × CompactedRegion) := unsafe do
+  let ((_, delta, cmdState, cmdContext), region) ←
+    _root_.unpickle (Array Import × PHashMap Name ConstantInfo × CompactableCommandSnapshot ×
+      Command.Context) path
+  let env ← parent.replay (Std.HashMap.ofList delta.toList)
   let p' : CommandSnapshot :=
   { cmdState := { cmdState with env }
     cmdContext }
@@ -291,7 +375,7 @@ def unpickle (path : FilePath) (cmd? : Option CommandSnapshot) :
   let env ← match cmd? with
   | none =>
     enableInitializersExecution
-    (← importModules imports {} 0 (loadExts := true)).replay (Std.HashMap.ofList map₂.toList)
+    (← acquireImports imports).replay (Std.HashMap.ofList map₂.toList)
   | some cmd =>
     cmd.cmdState.env.replay (Std.HashMap.ofList map₂.toList)
   let p' : ProofSnapshot :=
@@ -0,0 +1,59 @@
+/-
+Copyright (c) 2025, xeus-lean contributors
+Released under Apache 2.0 license as described in the file LICENSE.
+-/
+import Lean.Environment
+import Lean.Data.Json
+import REPL.Util.FifoCache
+
+/-!
+# Proof status cache
+
+Once a tactic closes every goal, `getProofStatus` sends the proof term
+through the kernel. In a proof search, sibling steps often close a goal
+with the same term, so the kernel's verdict is kept here, keyed by the
+closed proof term and its type.
+
+The verdict also depends on the environment the term is checked in. The
+key carries a hash of the imports and of every non-imported constant
+the term reaches, so a term that mentions a redefined constant misses.
+`XLEAN_STATUS_CACHE_SIZE` bounds the entry count (default 1024, `0`
+turns the cache off); the oldest entries go first.
+-/
+
+open Lean
+
+namespace REPL
+
+/-- A closed proof term, its type, and a hash of what else checking it
+depends on (`ProofKey.depsHash`). Terms are kept whole, so a hash
+collision cannot return the wrong verdict. -/
+structure ProofKey where
+  value : Expr
+  type  : Expr
+  deps  : UInt64
+  deriving BEq, Hashable
+
+/-- Hash of the imports of `env` and of the non-imported constants `es`
+reach, directly or through other non-imported constants. -/
+def ProofKey.depsHash (env : Environment) (es : Array Expr) : UInt64 := Id.run do
+  let mut h := hash (env.header.imports.map (·.module))
+  let mut seen : NameSet := {}
+  let mut todo := es.flatMap (·.getUsedConstants)
+  repeat
+    let some n := todo.back? | break
+    todo := todo.pop
+    if seen.contains n then continue
+    seen := seen.insert n
+    if let some c := env.constants.map₂.find? n then
+      let value? := c.value? (allowOpaque := true)
+      h := mixHash h (mixHash (hash n) (mixHash c.type.hash (value?.map (·.hash) |>.getD 0)))
+      todo := todo ++ c.type.getUsedConstants ++ (value?.map (·.getUsedConstants) |>.getD #[])
+  return h
+
+abbrev StatusCache := FifoCache ProofKey String
+
+initialize statusCacheSize : Nat ← do
+  return (← IO.getEnv "XLEAN_STATUS_CACHE_SIZE").bind (·.toNat?) |>.getD 1024
+
+end REPL
@@ -0,0 +1,101 @@
+/-
+Copyright (c) 2025, xeus-lean contributors
+Released under Apache 2.0 license as described in the file LICENSE.
+-/
+import Lean.Data.Json
+import Std.Data.HashMap
+
+/-!
+# Bounded FIFO caches
+
+The REPL's caches (`ExecCache`, `StatusCache`, the rendered trees of
+`InfoTreeCache`) and its pending proof checks all keep entries up to a
+budget and drop the oldest first. Each entry has a cost (`1` unless the
+caller says otherwise) and the total stays within `maxCost`.
+
+Keys wait in an insertion-order queue tagged with the insertion they
+belong to, so eviction is amortized constant time per entry. A key that
+was erased or re-inserted leaves a stale tag behind; the queue is
+compacted once stale tags outnumber the entries.
+-/
+
+namespace REPL
+
+structure FifoCache.Entry (β : Type) where
+  value : β
+  cost  : Nat
+  /-- Which insertion put it there (see `FifoCache.order`). -/
+  seq   : Nat
+
+structure FifoCache (α β : Type) [BEq α] [Hashable α] where
+  entries : Std.HashMap α (FifoCache.Entry β) := {}
+  /-- Keys with the insertion that queued them, oldest first. -/
+  order   : Std.Queue (α × Nat) := .empty
+  /-- Length of `order`. -/
+  queued  : Nat := 0
+  nextSeq : Nat := 0
+  cost    : Nat := 0
+  hits    : Nat := 0
+  misses  : Nat := 0
+
+namespace FifoCache
+
+variable {α β : Type} [BEq α] [Hashable α]
+
+def size (c : FifoCache α β) : Nat :=
+  c.entries.size
+
+def find? (c : FifoCache α β) (k : α) : Option β :=
+  c.entries[k]?.map (·.value)
+
+def contains (c : FifoCache α β) (k : α) : Bool :=
+  c.entries.contains k
+
+/-- Drop the stale tags from `order`. -/
+private def compact (c : FifoCache α β) : FifoCache α β :=
+  let live := c.order.toArray.filter fun (k, s) => c.entries[k]?.any (·.seq == s)
+  { c with order := Std.Queue.enqueueAll live.toList .empty, queued := live.size }
+
+/-- Compact once stale tags outnumber the entries. -/
+private def tidy (c : FifoCache α β) : FifoCache α β :=
+  if c.queued > 2 * c.entries.size + 16 then c.compact else c
+
+def erase (c : FifoCache α β) (k : α) : FifoCache α β :=
+  match c.entries[k]? with
+  | some e => tidy { c with entries := c.entries.erase k, cost := c.cost - e.cost }
+  | none => c
+
+/-- Add or replace the entry for `k`, then drop the oldest entries until
+the total cost is within `maxCost`. A replaced entry keeps its place in
+line. An entry that costs more than `maxCost` on its own is not kept. -/
+def insert (c : FifoCache α β) (maxCost : Nat) (k : α) (v : β) (cost : Nat := 1) :
+    FifoCache α β := Id.run do
+  if cost > maxCost then return c.erase k
+  let mut c := match c.entries[k]? with
+    | some e => { c with
+        entries := c.entries.insert k { e with value := v, cost }, cost := c.cost - e.cost + cost }
+    | none => { c with
+        entries := c.entries.insert k { value := v, cost, seq := c.nextSeq }
+        order := c.order.enqueue (k, c.nextSeq), queued := c.queued + 1
+        nextSeq := c.nextSeq + 1, cost := c.cost + cost }
+  while c.cost > maxCost do
+    let some ((old, s), order) := c.order.dequeue? | break
+    c := { c with order, queued := c.queued - 1 }
+    if let some e := c.entries[old]? then
+      if e.seq == s then
+        c := { c with entries := c.entries.erase old, cost := c.cost - e.cost }
+  return c
+
+/-- Keep only the entries `p` holds for. -/
+def filter (c : FifoCache α β) (p : α → β → Bool) : FifoCache α β :=
+  let entries := c.entries.filter fun k e => p k e.value
+  if entries.size == c.entries.size then c
+  else tidy { c with entries, cost := entries.fold (fun n _ e => n + e.cost) 0 }
+
+def stats (c : FifoCache α β) : Lean.Json :=
+  Lean.Json.mkObj [("entries", Lean.toJson c.size), ("hits", Lean.toJson c.hits),
+    ("misses", Lean.toJson c.misses)]
+
+end FifoCache
+
+end REPL
@@ -0,0 +1,113 @@
+/-
+Copyright (c) 2025, xeus-lean contributors
+Released under Apache 2.0 license as described in the file LICENSE.
+-/
+import Lean.Util.Path
+import Std.Data.HashSet
+import REPL.Util.Trace
+
+/-!
+# Session runtime context
+
+What `processInput` needs to know about the Lean installation: the
+sysroot, the search path, and the `import` lines a first cell gets.
+Resolving these is not free. On native, `Lean.findSysroot` spawns
+`lean --print-prefix`. The auto-import registry means probing oleans
+and reading a file under every search root. So they are resolved once
+per session and reused by every cell.
+
+The context is rebuilt when `LEAN_PATH` changes, or when `invalidate`
+is called, which the WASM kernel does after `%load` has unpacked a
+bundle into `/lib/lean`.
+-/
+
+open Lean System
+
+namespace REPL.Runtime
+
+structure Context where
+  isWasm      : Bool
+  sysroot     : FilePath
+  /-- Roots probed for oleans and `.xeus-auto-imports` registries. -/
+  roots       : List FilePath
+  /-- `import` lines prepended to the first cell of a session. -/
+  autoImports : String
+  /-- `LEAN_PATH` at resolution time. -/
+  leanPath?   : Option String
+
+initialize contextRef : IO.Ref (Option Context) ← IO.mkRef none
+
+/-- Imports the first cell gets for free: `Display`, plus every module
+listed in a `.xeus-auto-imports` file under one of `roots`.
+
+A downstream lib (anything shipped via EXTRA_WASM_DIRS) registers its
+own auto-imports by writing one module name per line into
+
+    /lib/lean/.xeus-auto-imports          (WASM VFS)
+    <root>/.xeus-auto-imports             (each native search root)
+
+Lines starting with `#` and blank lines are ignored. A module is only
+imported if its olean is actually present, so an outdated registry
+doesn't fail elaboration. xeus-lean itself names no third-party module;
+they appear only in the registry files third-party build scripts write. -/
+def resolveAutoImports (roots : List FilePath) : IO String := do
+  let oleanExists (mod : String) : IO Bool := do
+    let rel : FilePath := FilePath.mk (mod.replace "." "/" ++ ".olean")
+    for root in roots do
+      if (← (root / rel).pathExists) then return true
+    return false
+  let coreImports := if (← oleanExists "Display") then "import Display\n" else ""
+  let mut extras : List String := []
+  let mut seen : Std.HashSet String := {}
+  for root in roots do
+    let registry := root / ".xeus-auto-imports"
+    if ← registry.pathExists then
+      let body ← IO.FS.readFile registry
+      for line in body.splitOn "\n" do
+        let line := line.trim
+        if line.isEmpty || line.startsWith "#" then continue
+        if seen.contains line then continue
+        seen := seen.insert line
+        extras := extras ++ [line]
+  let mut extraImports := ""
+  for mod in extras do
+    if ← oleanExists mod then
+      extraImports := extraImports ++ s!"import {mod}\n"
+    else
+      Trace.warn "runtime" ".xeus-auto-imports: olean not found, skipping" [("module", mod)]
+  return coreImports ++ extraImports
+
+/-- Resolve the context from scratch and install its search path. -/
+def resolve (leanPath? : Option String) : IO Context := do
+  -- In WASM the .olean files are embedded at /lib/lean/ so sysroot is "/".
+  -- Lean.findSysroot would spawn `lean --print-prefix`, which is impossible
+  -- in WASM but is the right thing on a native build. Detect by probing
+  -- for the embedded VFS file; fall back to findSysroot otherwise.
+  let isWasm ← (FilePath.mk "/lib/lean/Init.olean").pathExists
+  let sysroot ← if isWasm then pure (FilePath.mk "/") else Lean.findSysroot
+  Lean.initSearchPath sysroot
+  -- WASM probes the fixed /lib/lean prefix because LEAN_PATH isn't
+  -- populated from the kernelspec there; native uses the search path.
+  let roots ← if isWasm then pure [FilePath.mk "/lib/lean"] else Lean.searchPathRef.get
+  Trace.debug "runtime" "resolved"
+    [("sysroot", toString sysroot), ("wasm", toString isWasm), ("searchPath", toString roots)]
+  let autoImports ← resolveAutoImports roots
+  return { isWasm, sysroot, roots, autoImports, leanPath? }
+
+/-- The session's context, resolved on first use and whenever `LEAN_PATH`
+has changed since. -/
+def get : IO Context := do
+  let leanPath? ← IO.getEnv "LEAN_PATH"
+  if let some ctx ← contextRef.get then
+    if ctx.leanPath? == leanPath? then
+      return ctx
+  let ctx ← resolve leanPath?
+  contextRef.set (some ctx)
+  return ctx
+
+/-- Forget the context, so the next cell re-resolves it (new oleans or
+registries appeared, e.g. after `%load`). -/
+def invalidate : BaseIO Unit :=
+  contextRef.set none
+
+end REPL.Runtime
@@ -0,0 +1,60 @@
+/-
+Copyright (c) 2025, xeus-lean contributors
+Released under Apache 2.0 license as described in the file LICENSE.
+-/
+import Std.Data.HashMap
+
+/-!
+# Phase timing
+
+A minimal span recorder: inside `recording x`, `withSpan "phase" y` runs
+`y` and appends `("phase", elapsed ns)` to the buffer `recording` hands
+back with `x`'s result. The kernel records each cell run this way and
+ships the breakdown with the reply.
+
+Recording is per thread. Only spans taken on the thread running
+`recording` are kept; other work that reaches `withSpan` (a `repl`
+session, batch-mode tasks, the kernel loop answering hovers) is not
+recorded and costs one thread-id lookup.
+
+Spans are flat: a nested span is recorded on its own and also counted
+inside its parent.
+-/
+
+namespace REPL.Spans
+
+/-- Span buffers of the threads currently inside `recording`. -/
+initialize recorders : IO.Ref (Std.HashMap UInt64 (Array (String × Nat))) ← IO.mkRef {}
+
+/-- Record a finished span of `nanos` nanoseconds for thread `tid`. -/
+def record (tid : UInt64) (name : String) (nanos : Nat) : BaseIO Unit :=
+  recorders.modify fun m => m.modify tid (·.push (name, nanos))
+
+/-- Run `x`, returning the spans recorded on this thread while it ran. -/
+def recording (x : IO α) : IO (α × Array (String × Nat)) := do
+  let tid ← IO.getTID
+  recorders.modify (·.insert tid #[])
+  let take : BaseIO (Array (String × Nat)) :=
+    recorders.modifyGet fun m => (m[tid]?.getD #[], m.erase tid)
+  try
+    let a ← x
+    return (a, ← take)
+  catch e =>
+    discard take
+    throw e
+
+/-- Run `x`, recording its wall time under `name` (also when it throws)
+when this thread is inside `recording`. -/
+@[inline] def withSpan {m : Type → Type} {α : Type} [Monad m] [MonadLiftT BaseIO m]
+    [MonadFinally m] (name : String) (x : m α) : m α := do
+  let tid ← IO.getTID
+  unless (← recorders.get).contains tid do
+    return ← x
+  let t0 ← IO.monoNanosNow
+  try
+    x
+  finally
+    let t1 ← IO.monoNanosNow
+    record tid name (t1 - t0)
+
+end REPL.Spans
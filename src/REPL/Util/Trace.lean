@@ -0,0 +1,119 @@
+/-
+Copyright (c) 2025, xeus-lean contributors
+Released under Apache 2.0 license as described in the file LICENSE.
+-/
+
+/-!
+# Leveled, per-subsystem tracing
+
+Diagnostics for the kernel, the REPL frontend and the WASM bridge.
+Records go to stderr as
+
+    [xlean debug frontend] commands processed messages=3 env=12
+
+Thresholds come from the environment, read once at startup:
+
+* `XLEAN_DEBUG=1` (or `true`) lowers the default threshold to `debug`;
+* `XLEAN_TRACE` is a comma-separated list of `level` (the default for
+  every subsystem) or `subsystem=level` items, e.g.
+  `XLEAN_TRACE=warn,frontend=trace,kernel=debug`.
+
+Levels are `error`, `warn`, `info`, `debug`, `trace`; the default
+threshold is `warn`. The C++ side (`xeus-lean/xtrace.hpp`) parses the
+same variables.
+
+The logging functions are `@[macro_inline]`: the message and the fields
+are substituted into an `if` on the threshold, so a disabled record
+builds neither. Guard anything costlier than string interpolation
+(walking an environment, pretty-printing JSON) with `enabled`.
+-/
+
+namespace REPL.Trace
+
+inductive Level where
+  | error | warn | info | debug | trace
+  deriving Inhabited, BEq
+
+def Level.toNat : Level → Nat
+  | .error => 0 | .warn => 1 | .info => 2 | .debug => 3 | .trace => 4
+
+def Level.name : Level → String
+  | .error => "error" | .warn => "warn" | .info => "info" | .debug => "debug" | .trace => "trace"
+
+def Level.ofString? : String → Option Level
+  | "error" => some .error | "warn" => some .warn | "info" => some .info
+  | "debug" => some .debug | "trace" => some .trace
+  | _ => none
+
+/-- Thresholds: `default` for every subsystem without a rule. `max` is
+the most verbose level any subsystem allows, for a one-compare reject. -/
+structure Config where
+  default : Level := .warn
+  rules   : Array (String × Level) := #[]
+  max     : Nat := Level.warn.toNat
+
+/-- Parse `XLEAN_TRACE` on top of `base`; malformed items are ignored. -/
+def Config.parse (spec : String) (base : Config := {}) : Config := Id.run do
+  let mut c := base
+  for item in spec.splitOn "," do
+    match item.splitOn "=" with
+    | [lvl] | ["*", lvl] =>
+      if let some l := Level.ofString? lvl then c := { c with default := l }
+    | [sub, lvl] =>
+      if let some l := Level.ofString? lvl then c := { c with rules := c.rules.push (sub, l) }
+    | _ => pure ()
+  let max := c.rules.foldl (fun m (_, l) => Nat.max m l.toNat) c.default.toNat
+  return { c with max }
+
+def Config.fromEnv : IO Config := do
+  let debug := (← IO.getEnv "XLEAN_DEBUG").any fun v => v == "1" || v == "true"
+  let base : Config := if debug then { default := .debug, max := Level.debug.toNat } else {}
+  return match ← IO.getEnv "XLEAN_TRACE" with
+    | some spec => Config.parse spec base
+    | none => base
+
+/-- Threshold for subsystem `sub`. -/
+def Config.threshold (c : Config) (sub : String) : Level :=
+  match c.rules.find? (·.1 == sub) with
+  | some (_, l) => l
+  | none => c.default
+
+initialize config : Config ← Config.fromEnv
+
+/-- Would a record at `lvl` for `sub` be written? -/
+@[inline] def enabled (sub : String) (lvl : Level) : Bool :=
+  lvl.toNat ≤ config.max && lvl.toNat ≤ (config.threshold sub).toNat
+
+private def renderField (kv : String × String) : String :=
+  let v := if kv.2.any (fun c => c == ' ' || c == '"' || c == '=') then kv.2.quote else kv.2
+  s!" {kv.1}={v}"
+
+/-- Write one record unconditionally. -/
+def emit (sub : String) (lvl : Level) (msg : String) (fields : List (String × String)) : IO Unit :=
+  IO.eprintln (s!"[xlean {lvl.name} {sub}] {msg}" ++ String.join (fields.map renderField))
+
+@[macro_inline] def log (sub : String) (lvl : Level) (msg : String)
+    (fields : List (String × String) := []) : IO Unit :=
+  if enabled sub lvl then emit sub lvl msg fields else pure ()
+
+@[macro_inline] def error (sub : String) (msg : String) (fields : List (String × String) := []) :
+    IO Unit :=
+  if enabled sub .error then emit sub .error msg fields else pure ()
+
+@[macro_inline] def warn (sub : String) (msg : String) (fields : List (String × String) := []) :
+    IO Unit :=
+  if enabled sub .warn then emit sub .warn msg fields else pure ()
+
+@[macro_inline] def info (sub : String) (msg : String) (fields : List (String × String) := []) :
+    IO Unit :=
+  if enabled sub .info then emit sub .info msg fields else pure ()
+
+@[macro_inline] def debug (sub : String) (msg : String) (fields : List (String × String) := []) :
+    IO Unit :=
+  if enabled sub .debug then emit sub .debug msg fields else pure ()
+
+@[macro_inline] def trace (sub : String) (msg : String) (fields : List (String × String) := []) :
+    IO Unit :=
+  if enabled sub .trace then emit sub .trace msg fields else pure ()
+
+end REPL.Trace
@@ -6,6 +6,10 @@ Lean REPL exports for the WASM xeus kernel.
 These functions are called from C++ via @[export] attributes.
 -/
 import REPL.Main
+import REPL.Inspect
+import REPL.Cells
+import REPL.Util.Runtime
+import REPL.Util.Trace
 import Lean.Data.Json
 -- Import Display so that #html / #latex / #md / #svg commands and the
 -- Display.html / Display.latex / ... helpers are available in REPL cells
@@ -18,7 +22,7 @@ open REPL Lean
 
 /-- Global REPL state reference, created once and reused across calls. -/
 private def mkInitialState : REPL.State :=
-  { cmdStates := #[], proofStates := #[] }
+  {}
 
 /-- Initialize the Lean search path and runtime.
     In WASM, .olean files are embedded at /lib/lean/ in the virtual filesystem,
@@ -28,11 +32,44 @@ private def mkInitialState : REPL.State :=
 def init : IO Unit := do
   Lean.initSearchPath "/"
 
+/-- Forget the cached sysroot / search path / auto-import context, so
+    the next cell re-resolves it. Called after `%load` unpacks a bundle. -/
+@[export lean_wasm_repl_invalidate_runtime]
+def invalidateRuntime : IO Unit :=
+  REPL.Runtime.invalidate
+
+/-- The post-import environment, recorded by the first `execute`;
+    `%reset` goes back to it. -/
+initialize rootEnvRef : IO.Ref (Option Nat) ← IO.mkRef none
+
 /-- Create a new REPL state reference (IO.Ref State). -/
 @[export lean_wasm_repl_create_state]
 def createState : IO (IO.Ref REPL.State) :=
   IO.mkRef mkInitialState
 
+/-- Run `code` on `env`. With no environment yet (the first cell), the
+    cell's `import` header is elaborated on its own first and its
+    environment recorded in `rootEnvRef`; a header with errors is the
+    whole result. -/
+private def runCell (state : REPL.State) (code : String) (env : Option Nat) :
+    IO (((CommandResponse × List InfoTree) ⊕ REPL.Error) × REPL.State) := do
+  let run (cmd : String) (env : Option Nat) (state : REPL.State) :=
+    runCommandWithTrees { cmd, env, infotree := none } |>.run state
+  if env.isSome then
+    return ← run code env state
+  let (header, body) ← Cells.splitHeader code
+  match ← run header none state with
+  | (.inl (hdr, trees), state) =>
+    if hdr.messages.any (·.severity matches .error) then
+      return (.inl (hdr, trees), state)
+    rootEnvRef.set (some hdr.env)
+    let outcome ← run body (some hdr.env) state
+    return match outcome with
+      | (.inl (r, trees), state) =>
+        (.inl ({ r with messages := hdr.messages ++ r.messages }, trees), state)
+      | outcome => outcome
+  | outcome => return outcome
+
 /-- Execute a command via the REPL and return the result as a JSON string.
 
     Parameters:
@@ -47,29 +84,22 @@ def createState : IO (IO.Ref REPL.State) :=
     path crashes on the 5th call inside `importModulesCore` (memory access out
     of bounds — root cause unknown, likely a Lean runtime bug specific to
     memory64). Workaround: the first call (when `cmdStates` is empty) creates
-    env 0 by parsing the header; every subsequent `hasEnv=0` call auto-chains
+    env 0 from the header alone (`runCell`) and runs the rest of the cell on
+    it; every subsequent `hasEnv=0` call auto-chains
     on the latest env, skipping `processHeader` entirely. This also matches
     Jupyter notebook semantics — each cell sees the previous cell's defs. -/
 @[export lean_wasm_repl_execute]
 def execute (stateRef : IO.Ref REPL.State) (code : String) (envId : UInt32) (hasEnv : UInt8) : IO String := do
-  IO.eprintln s!"[WasmRepl] execute: code='{code.take 50}' envId={envId} hasEnv={hasEnv}"
+  Trace.debug "wasm" "execute"
+    [("code", s!"{code.take 50}"), ("envId", toString envId), ("hasEnv", toString hasEnv)]
   let state ← stateRef.get
   let env : Option Nat :=
     if hasEnv.toNat == 1 then some envId.toNat
     else if state.cmdStates.size > 0 then some (state.cmdStates.size - 1)
     else none
 
-  let cmd : REPL.Command := {
-    cmd := code,
-    env := env,
-    infotree := none,
-    allTactics := none,
-    rootGoals := none
-  }
-
-  IO.eprintln s!"[WasmRepl] calling runCommand (env={env})"
-  let result ← runCommand cmd |>.run state
-  IO.eprintln "[WasmRepl] runCommand returned"
+  Trace.trace "wasm" "runCommand" [("env", toString env)]
+  let result ← runCell state code env
 
   -- Drain the Display buffer. Display.html/latex/... append MIME
   -- markers to a global IO.Ref rather than printing to stdout,
@@ -83,11 +113,12 @@ def execute (stateRef : IO.Ref REPL.State) (code : String) (envId : UInt32) (has
   -- the SVG / HTML / LaTeX previews vanish under a duplicate copy
   -- of the same marker on every cell, which broke the Playwright
   -- `#svg embeds an SVG` test.  Keep the diagnostic length-only.
-  IO.eprintln s!"[WasmRepl] displayOutput len={displayOutput.length}"
+  Trace.trace "wasm" "display drained" [("len", toString displayOutput.length)]
 
   match result with
-  | (.inl response, newState) =>
+  | (.inl (response, trees), newState) =>
     stateRef.set newState
+    Inspect.record code trees
     -- If there was rich-display output, inject it as an additional
     -- info message. The C++ interpreter will parse MIME markers out.
     -- Use the raw string as message data (don't trim) to preserve
@@ -101,16 +132,35 @@ def execute (stateRef : IO.Ref REPL.State) (code : String) (envId : UInt32) (has
           data := displayOutput
         }
         { response with messages := response.messages ++ [displayMsg] }
-    let json := Lean.toJson response
-    IO.eprintln s!"[WasmRepl] success (full): {json.pretty}"
-    let jsonStr := json.compress
-    return jsonStr
+    let json := Lean.toJson response |>.compress
+    Trace.trace "wasm" "success" [("response", s!"{json.take 200}")]
+    return json
   | (.inr error, newState) =>
     stateRef.set newState
     let json := Lean.toJson error |>.compress
-    IO.eprintln s!"[WasmRepl] error: {json.take 200}"
+    Trace.debug "wasm" "error" [("response", s!"{json.take 200}")]
     return json
 
+/-- `%reset`: rewind to the post-import environment the first cell
+    recorded, dropping every later environment and proof state. Returns
+    a response JSON the C++ side renders like an `execute` result; its
+    `env` is where the next cell continues. -/
+@[export lean_wasm_repl_reset]
+def reset (stateRef : IO.Ref REPL.State) : IO String := do
+  let some root ← rootEnvRef.get
+    | return (Json.mkObj [("error", "%reset: no post-import environment to go back to yet")]).compress
+  let ((), st) ← (resetTo root : M IO Unit).run (← stateRef.get)
+  stateRef.set st
+  Inspect.clear
+  Trace.debug "wasm" "reset" [("env", toString root)]
+  let msg : REPL.Message := {
+    pos := ⟨0, 0⟩
+    endPos := none
+    severity := .info
+    data := "Session reset to the post-import environment."
+  }
+  return (Lean.toJson ({ env := root, messages := [msg] } : CommandResponse)).compress
+
 /-- Return tab-completion candidates as a JSON string.
 
     Parameters:
@@ -127,7 +177,7 @@ def complete (stateRef : IO.Ref REPL.State) (pfx : String) (envId : UInt32) (has
   let envIdx := if hasEnv.toNat == 1 then envId.toNat
     else if state.cmdStates.size > 0 then state.cmdStates.size - 1
     else 0
-  let env? := (state.cmdStates[envIdx]?).map (·.cmdState.env)
+  let env? := (state.cmdStates.get? envIdx).map (·.cmdState.env)
   -- Keywords and # commands to always suggest
   let keywords : Array String := #["def", "theorem", "lemma", "example",
     "structure", "class", "instance", "where", "let", "have", "do",
@@ -154,4 +204,18 @@ def complete (stateRef : IO.Ref REPL.State) (pfx : String) (envId : UInt32) (has
   let json := Lean.Json.mkObj [("matches", Lean.toJson limited.toArray)]
   return json.compress
 
+/-- Return hover text (markdown) for byte offset `pos` of `code`, or ""
+    when nothing is known there.
+
+    Cells that were executed are answered from their retained InfoTrees;
+    other source falls back to resolving `ident` (the identifier under
+    the cursor) in the latest environment. -/
+@[export lean_wasm_repl_inspect]
+def inspect (stateRef : IO.Ref REPL.State) (code : String) (pos : UInt32) (ident : String) : IO String := do
+  if let some text ← Inspect.inspectCell code pos.toNat then
+    return text
+  match (← stateRef.get).cmdStates.back? with
+  | some snap => return (← Inspect.inspectName snap.cmdState ident).getD ""
+  | none => return ""
+
 end WasmRepl
@@ -5,6 +5,11 @@ Released under Apache 2.0 license as described in the file LICENSE.
 Xeus Kernel - Lean owns the main loop and calls C++ xeus via FFI
 -/
 import REPL.Main
+import REPL.Inspect
+import REPL.Cells
+import REPL.Session
+import REPL.Util.Spans
+import REPL.Util.Trace
 import Lean.Data.Json
 import Lean.LoadDynlib
 -- Display lets user cells emit MIME-typed payloads (HTML / SVG / Markdown / ...).
@@ -20,15 +25,10 @@ namespace XeusKernel
 
 open REPL Lean
 
-/-- Check if debug mode is enabled via XLEAN_DEBUG environment variable -/
-def isDebugEnabled : IO Bool := do
-  let env ← IO.getEnv "XLEAN_DEBUG"
-  return env.isSome && (env.get! == "1" || env.get! == "true")
-
-/-- Debug logging - only outputs if XLEAN_DEBUG is set -/
-def debugLog (msg : String) : IO Unit := do
-  if ← isDebugEnabled then
-    IO.eprintln msg
+/-- Kernel debug logging: `XLEAN_DEBUG=1`, or `XLEAN_TRACE=kernel=debug`
+    (see `REPL.Trace`). The message is not built when disabled. -/
+@[macro_inline] def debugLog (msg : String) : IO Unit :=
+  Trace.debug "kernel" msg
 
 /-- Opaque handle to the C++ xeus kernel (external object managed by Lean's GC) -/
 opaque KernelHandle : Type
@@ -41,231 +41,829 @@ opaque ffiInitialize : IO Unit
 @[extern "xeus_kernel_init"]
 opaque kernelInit (connectionFile : @& String) : IO (Option KernelHandle)
 
-/-- Poll for messages from Jupyter (returns JSON or empty string if no message) -/
-@[extern "xeus_kernel_poll"]
-opaque kernelPoll (handle : @& KernelHandle) (timeoutMs : UInt32) : IO String
+/-- Requests from Jupyter, built directly as Lean objects by the C++
+    side (`to_lean_request` in xeus_ffi.cpp, which depends on the field
+    layout — keep the two in sync). -/
+inductive KernelRequest
+  | execute (code : String) (executionCount : UInt32)
+  /-- Hover at byte offset `pos` of `code`; `ident` is the identifier
+      under the cursor, for source that was never run. -/
+  | inspect (id : UInt32) (code : String) (pos : Nat) (ident : String)
+  deriving Inhabited
+
+/-- One message of a cell's output, positions as Lean reports them. -/
+structure CellMessage where
+  line     : UInt32
+  column   : UInt32
+  severity : REPL.Severity
+  text     : String
+
+/-- A timed phase of a cell on the Lean side (see `REPL.Spans`). -/
+structure CellSpan where
+  name  : String
+  nanos : UInt64
+
+/-- A cell's output, read field by field by the C++ side
+    (`cell_result_of_lean` in xeus_ffi.cpp), which renders the messages
+    and builds the iopub MIME bundle without a JSON round trip. -/
+structure CellResult where
+  messages : Array CellMessage
+  /-- `Display` payloads as (mime type, content). -/
+  displays : Array (String × String)
+  /-- Phase breakdown, reported in the execute_reply's `xlean_timing`. -/
+  spans    : Array CellSpan := #[]
+  /-- Snapshot store counts as JSON text (`xlean_snapshots` in the reply). -/
+  snapshots : String := ""
+
+/-- Everything the C++ side queues for the loop (`to_lean_comm_event` /
+    `xeus_kernel_poll_batch` build these; same layout caveat). -/
+inductive KernelEvent
+  | request (req : KernelRequest)
+  /-- The JS frontend opened comm `id` for the Lean session `session`. -/
+  | commOpen (id : String) (session : String)
+  /-- A comm message; `data` is its JSON payload as text. -/
+  | commMsg (id : String) (data : String)
+  | commClose (id : String)
+  deriving Inhabited
+
+/-- Wait up to `timeoutMs` for work, then take up to `max` queued events
+    in one call (comm events first). Blocks on a condition variable on
+    the C++ side only while both queues are empty, so it returns as soon
+    as anything is queued; `#[]` means timeout or a shutdown wakeup. -/
+@[extern "xeus_kernel_poll_batch"]
+opaque kernelPollBatch (handle : @& KernelHandle) (timeoutMs : UInt32) (max : UInt32) :
+    IO (Array KernelEvent)
+
+/-- Queue depth and per-event dwell-time counters, as a JSON object. -/
+@[extern "xeus_kernel_queue_stats"]
+opaque kernelQueueStats (handle : @& KernelHandle) : IO String
 
 /-- Send execution result back to Jupyter -/
 @[extern "xeus_kernel_send_result"]
-opaque kernelSendResult (handle : @& KernelHandle) (executionCount : UInt32) (result : @& String) : IO Unit
+opaque kernelSendResult (handle : @& KernelHandle) (executionCount : UInt32) (result : @& CellResult) : IO Unit
 
-/-- Send execution error back to Jupyter -/
+/-- Send an execution error (a plain message) back to Jupyter -/
 @[extern "xeus_kernel_send_error"]
-opaque kernelSendError (handle : @& KernelHandle) (executionCount : UInt32) (error : @& String) : IO Unit
+opaque kernelSendError (handle : @& KernelHandle) (executionCount : UInt32) (message : @& String) : IO Unit
 
 /-- Check if kernel should shutdown -/
 @[extern "xeus_kernel_should_stop"]
 opaque kernelShouldStop (handle : @& KernelHandle) : IO Bool
 
-/-- Pop one queued comm event (open/msg/close) as JSON, "" if none. -/
-@[extern "xeus_kernel_poll_comm"]
-opaque kernelPollComm (handle : @& KernelHandle) : IO String
-
 /-- Send a JSON message back to the JS side over the comm `commId`.
     Returns true on success, false if the comm has been closed. -/
 @[extern "xeus_kernel_send_comm"]
 opaque kernelSendComm (handle : @& KernelHandle) (commId : @& String) (data : @& String) : IO Bool
 
-/-- Process a single comm event JSON. -/
-private def processOneCommEvent (handle : KernelHandle) (ev : String) : IO Unit := do
-  match Lean.Json.parse ev with
-  | .error e => IO.eprintln s!"[Lean Kernel] comm event parse error: {e}"
-  | .ok j =>
-    let op := j.getObjValAs? String "op" |>.toOption.getD ""
-    let id := j.getObjValAs? String "id" |>.toOption.getD ""
-    match op with
-    | "open" =>
-      -- JS frontend names which Lean session it wants in data.session.
-      let data := j.getObjVal? "data" |>.toOption.getD .null
-      let session := data.getObjValAs? String "session" |>.toOption.getD ""
-      let bound ← CommBus.bindOnOpen session id
-      if bound then
-        IO.eprintln s!"[Lean Kernel] comm open session={session} id={id}"
-      else
-        IO.eprintln s!"[Lean Kernel] comm open for unknown session={session} id={id}"
-    | "msg" =>
-      let data := j.getObjVal? "data" |>.toOption.getD .null
-      match ← CommBus.lookup id with
-      | none => IO.eprintln s!"[Lean Kernel] comm msg for unknown id={id}"
-      | some h =>
-        try
-          let reply ← h data
-          let _ ← kernelSendComm handle id reply.compress
-        catch e =>
-          IO.eprintln s!"[Lean Kernel] comm handler raised: {e.toString}"
-    | "close" =>
-      CommBus.unbind id
-    | _ =>
-      IO.eprintln s!"[Lean Kernel] unknown comm op: {op}"
-
-/-- Drain the C++ comm event queue and dispatch each entry. Called once
-    per poll-loop iteration so comm traffic is interleaved with
-    execute_request handling at the same ~100 ms cadence. -/
-partial def drainCommEvents (handle : KernelHandle) : IO Unit := do
-  let ev ← kernelPollComm handle
-  if ev.isEmpty then return
-  processOneCommEvent handle ev
-  drainCommEvents handle
-
-/-- Message types from Jupyter -/
-inductive MessageType
-  | executeRequest (code : String) (executionCount : UInt32)
-  | shutdownRequest
-  | unknown
+/-- A cell is starting: begin streaming its stdout to iopub. -/
+@[extern "xeus_kernel_begin_cell"]
+opaque kernelBeginCell (handle : @& KernelHandle) : IO Unit
+
+/-- Wake the kernel loop if it is parked in `kernelPollBatch`. Called
+    once a cell task has finished (see `startCell`). -/
+@[extern "xeus_kernel_wake_loop"]
+opaque kernelWakeLoop (handle : @& KernelHandle) : IO Unit
+
+/-- Block up to `timeoutMs` for a kernel interrupt (Jupyter sends SIGINT,
+    see `interrupt_mode` in share/jupyter/kernels/xlean/kernel.json).
+    Returns true if one arrived since the last call; a zero timeout just
+    discards stale interrupts. -/
+@[extern "xeus_kernel_wait_interrupt"]
+opaque kernelWaitInterrupt (handle : @& KernelHandle) (timeoutMs : UInt32) : IO Bool
+
+/-- Wake a thread blocked in `kernelWaitInterrupt` without raising an
+    interrupt, so a finished cell's watcher exits immediately. -/
+@[extern "xeus_kernel_wake_interrupt_waiter"]
+opaque kernelWakeInterruptWaiter (handle : @& KernelHandle) : IO Unit
+
+/-- Answer inspect request `id` with markdown hover text ("" when
+    nothing was found). -/
+@[extern "xeus_kernel_send_inspect"]
+opaque kernelSendInspect (handle : @& KernelHandle) (id : UInt32) (text : @& String) : IO Unit
+
+/-- Add constant names to the C++ completion index. The first batch
+    after `kernelCompletionClear` becomes the (imported) base. -/
+@[extern "xeus_kernel_completion_add"]
+opaque kernelCompletionAdd (handle : @& KernelHandle) (names : @& Array String) : IO Unit
+
+/-- Remove names cells added from the completion index. -/
+@[extern "xeus_kernel_completion_remove"]
+opaque kernelCompletionRemove (handle : @& KernelHandle) (names : @& Array String) : IO Unit
+
+/-- Replace the namespaces whose members complete unqualified. -/
+@[extern "xeus_kernel_completion_set_scope"]
+opaque kernelCompletionSetScope (handle : @& KernelHandle) (namespaces : @& Array String) : IO Unit
+
+/-- Empty the completion index. -/
+@[extern "xeus_kernel_completion_clear"]
+opaque kernelCompletionClear (handle : @& KernelHandle) : IO Unit
+
+/-- Drop the names cells added to the completion index, keeping the
+    imported base. -/
+@[extern "xeus_kernel_completion_clear_cells"]
+opaque kernelCompletionClearCells (handle : @& KernelHandle) : IO Unit
+
+/-- Zygote server: listen on the Unix socket `socketPath` and fork this
+    process once per `zygoteAttach` request. Returns only in a forked
+    child, with the connection file it is to serve; refuses to fork while
+    the process has more than one thread, since the child would get only
+    the calling one. -/
+@[extern "xeus_zygote_serve"]
+opaque zygoteServe (socketPath : @& String) : IO String
+
+/-- Have the zygote at `socketPath` fork a kernel for `connectionFile`,
+    then stand in for it until it exits, forwarding interrupt and
+    termination signals. -/
+@[extern "xeus_zygote_attach"]
+opaque zygoteAttach (socketPath : @& String) (connectionFile : @& String) : IO Unit
+
+/-- CPUs this process may use: the cgroup CPU quota when the container
+    sets one, otherwise the hardware thread count. -/
+@[extern "xeus_kernel_cpu_quota"]
+opaque kernelCpuQuota : IO UInt32
+
+/-- With `XLEAN_PARALLEL=1`, cells elaborate proof bodies in parallel,
+    on at most this many commands at a time: `XLEAN_PARALLEL_WORKERS`,
+    or the CPU quota. -/
+initialize parallelWorkers : Option Nat ← do
+  unless (← IO.getEnv "XLEAN_PARALLEL").any fun v => v == "1" || v == "true" do
+    return none
+  match (← IO.getEnv "XLEAN_PARALLEL_WORKERS").bind (·.toNat?) with
+  | some n => return some n
+  | none => return some (← kernelCpuQuota).toNat
+
+/-- Names worth offering for completion. Skips internal and generated
+    auxiliary declarations, the same ones the language server hides. -/
+def isCompletionCandidate (env : Environment) (n : Name) : Bool :=
+  !n.isInternal && !isAuxRecursor env n && !isNoConfusion env n &&
+    !Meta.isMatcherCore env n
+
+/-- Namespaces whose members resolve unqualified after a cell: the
+    current namespace and its ancestors, plus every simple `open`. -/
+def scopeNamespaces (cmdState : Elab.Command.State) : Array String := Id.run do
+  let scope := cmdState.scopes.head!
+  let mut out := #[]
+  let mut ns := scope.currNamespace
+  while !ns.isAnonymous do
+    out := out.push ns.toString
+    ns := ns.getPrefix
+  for d in scope.openDecls do
+    if let .simple ns _ := d then
+      out := out.push ns.toString
+  return out
+
+/-- Feed the C++ completion index after a cell. With no parent env (the
+    cell that imported the header) the index is rebuilt from scratch;
+    otherwise only the constants this cell added are pushed. `map₂` of
+    the constant map holds exactly the non-imported constants, so the
+    delta costs O(notebook), never O(imports). -/
+def updateCompletionIndex (handle : KernelHandle) (parent? : Option Environment)
+    (snap : CommandSnapshot) : IO Unit := do
+  let env := snap.cmdState.env
+  let keep (acc : Array String) (n : Name) (_ : ConstantInfo) : Array String :=
+    if isCompletionCandidate env n then acc.push n.toString else acc
+  match parent? with
+  | none =>
+    kernelCompletionClear handle
+    kernelCompletionAdd handle (env.constants.map₁.fold keep #[])
+    kernelCompletionAdd handle (env.constants.map₂.foldl keep #[])
+  | some parent =>
+    let delta := env.constants.map₂.foldl (init := #[]) fun acc n c =>
+      if parent.constants.map₂.contains n then acc else keep acc n c
+    unless delta.isEmpty do
+      kernelCompletionAdd handle delta
+  kernelCompletionSetScope handle (scopeNamespaces snap.cmdState)
+
+/-- Runs on a dedicated thread while a cell elaborates: trips the cell's
+    cancel token when an interrupt arrives. Exits once `cellDone` is set
+    (the caller wakes it with `kernelWakeInterruptWaiter`). -/
+partial def watchInterrupts (handle : KernelHandle) (tk : IO.CancelToken)
+    (cellDone : IO.Ref Bool) : IO Unit := do
+  if ← kernelWaitInterrupt handle 1000 then
+    debugLog "Interrupt received, cancelling cell"
+    tk.set
+  if ← cellDone.get then return
+  watchInterrupts handle tk cellDone
+
+/-- Dispatch one comm event to the CommBus session registry. -/
+private def processCommEvent (handle : KernelHandle) : KernelEvent → IO Unit
+  | .commOpen id session => do
+    let bound ← CommBus.bindOnOpen session id
+    if bound then
+      Trace.debug "comm" "open" [("session", session), ("id", id)]
+    else
+      Trace.warn "comm" "open for unknown session" [("session", session), ("id", id)]
+  | .commMsg id data => do
+    match ← CommBus.lookup id with
+    | none => Trace.warn "comm" "message for unknown comm" [("id", id)]
+    | some h =>
+      try
+        let reply ← h ((Json.parse data).toOption.getD .null)
+        let _ ← kernelSendComm handle id reply.compress
+      catch e =>
+        Trace.warn "comm" "handler raised" [("error", e.toString)]
+  | .commClose id => CommBus.unbind id
+  | .request _ => pure ()
+
+/-- Timing magic on a cell's first line. -/
+inductive TimingMagic
+  | plain
+  /-- `%time`: run and commit the cell as usual, then report its wall
+      time and phase breakdown. -/
+  | time
+  /-- `%timeit [-n N | N]`: run the cell `runs` times against the same
+      parent environment and report min/median/p95. Nothing is committed. -/
+  | timeit (runs : Nat)
   deriving Inhabited
 
-/-- Parse message JSON from xeus -/
-def parseMessage (json : String) : IO MessageType := do
-  if json.isEmpty then
-    return .unknown
-
-  let parsed := Json.parse json
-  match parsed with
-  | .error _ => return .unknown
-  | .ok j =>
-    match j.getObjVal? "msg_type" with
-    | .error _ => return .unknown
-    | .ok msgType =>
-      let msgTypeStr := msgType.getStr?.toOption.getD ""
-
-      if msgTypeStr == "execute_request" then
-        match j.getObjVal? "content" with
-        | .ok content =>
-          let code := content.getObjVal? "code" |>.toOption.bind (·.getStr?.toOption) |>.getD ""
-          let execCount := content.getObjVal? "execution_count" |>.toOption.bind (·.getNat?.toOption) |>.getD 0
-          return .executeRequest code execCount.toUInt32
-        | .error _ => return .unknown
-      else if msgTypeStr == "shutdown_request" then
-        return .shutdownRequest
+def defaultTimeitRuns : Nat := 7
+
+/-- Split a leading `%time` / `%timeit` line off `code`. The magic line
+    is blanked to spaces rather than removed, so line numbers and byte
+    offsets in the rest of the cell (and hover positions) are unchanged. -/
+def parseTimingMagic (code : String) : Except String (TimingMagic × String) := do
+  let lines := code.splitOn "\n"
+  let first := lines.headD ""
+  let words := (first.map fun c => if c.isWhitespace then ' ' else c).splitOn " "
+    |>.filter (!·.isEmpty)
+  let magic ← match words with
+    | ["%time"] => pure TimingMagic.time
+    | ["%timeit"] => pure (.timeit defaultTimeitRuns)
+    | ["%timeit", n] | ["%timeit", "-n", n] =>
+      match n.toNat? with
+      | some k@(_ + 1) => pure (.timeit k)
+      | _ => throw s!"%timeit: expected a positive run count, got '{n}'"
+    | "%time" :: _ => throw "usage: %time"
+    | "%timeit" :: _ => throw "usage: %timeit [-n N | N]"
+    | _ => pure .plain
+  if magic matches .plain then return (magic, code)
+  return (magic, "\n".intercalate ("".pushn ' ' first.utf8ByteSize :: lines.tail))
+
+/-- Is the cell just `%reset`? -/
+def isResetMagic (code : String) : Bool :=
+  code.trimAscii.toString == "%reset"
+
+/-- A cell that is only `%save-session PATH` or `%restore-session PATH`. -/
+inductive SessionMagic
+  | save (path : String)
+  | restore (path : String)
+
+/-- Recognize a session magic; `none` for any other cell. -/
+def parseSessionMagic (code : String) : Except String (Option SessionMagic) :=
+  match code.trimAscii.toString.splitOn " " |>.filter (!·.isEmpty) with
+  | ["%save-session", path] => pure (some (.save path))
+  | ["%restore-session", path] => pure (some (.restore path))
+  | "%save-session" :: _ => throw "usage: %save-session PATH"
+  | "%restore-session" :: _ => throw "usage: %restore-session PATH"
+  | _ => pure none
+
+/-- `nanos` as milliseconds with three decimals. -/
+def fmtMs (nanos : Nat) : String :=
+  let frac := toString (nanos / 1000 % 1000)
+  s!"{nanos / 1000000}.{"".pushn '0' (3 - frac.length)}{frac} ms"
+
+/-- Sum spans by name, keeping first-seen order. -/
+def mergeSpans (spans : Array (String × Nat)) : Array (String × Nat) :=
+  spans.foldl (init := #[]) fun acc (n, t) =>
+    match acc.findIdx? (·.1 == n) with
+    | some i => acc.modify i fun (n, t') => (n, t' + t)
+    | none => acc.push (n, t)
+
+/-- The `%time` report: total wall time, then the Lean-side phases. -/
+def timeReport (wall : Nat) (spans : Array (String × Nat)) : String :=
+  let phases := mergeSpans spans |>.toList.map fun (n, t) => s!"{n} {fmtMs t}"
+  s!"Wall time: {fmtMs wall}" ++
+    (if phases.isEmpty then "" else s!" ({", ".intercalate phases})")
+
+/-- The `%timeit` report: min / median / p95 over the runs. -/
+def timeitReport (runs : Array Nat) : String :=
+  let xs := runs.qsort (· < ·)
+  let n := xs.size
+  if n == 0 then "no runs" else
+  let median := (xs[(n - 1) / 2]! + xs[n / 2]!) / 2
+  let p95 := xs[(95 * n + 99) / 100 - 1]!
+  s!"{n} run{if n == 1 then "" else "s"}: min {fmtMs xs[0]!}, median {fmtMs median}, p95 {fmtMs p95}"
+
+/-- What a cell task hands back: the REPL response (or error) and the
+    REPL state to commit. -/
+abbrev CellOutcome := ((CommandResponse × List InfoTree) ⊕ REPL.Error) × State
+
+/-- A cell elaborating on its own thread. -/
+structure RunningCell where
+  /-- The cell as submitted; hover requests refer to this text. -/
+  code      : String
+  execCount : UInt32
+  magic     : TimingMagic := .plain
+  /-- Wall time of each run, filled in by the cell task. -/
+  timings   : IO.Ref (Array Nat)
+  /-- Phase spans of the last run (`REPL.Spans.recording`). -/
+  spans     : IO.Ref (Array (String × Nat))
+  /-- The environment the cell builds on. -/
+  parentEnv : Option Nat
+  /-- The committed state the cell started from. -/
+  parent    : State
+  /-- The cell chain to extend on success: the loop's chain, cut back
+      to the fork point when the cell replaces an earlier one. -/
+  cells     : Cells.Graph
+  /-- Cells the fork drops, the replaced one first. -/
+  stale     : Array Cells.Node := #[]
+  /-- Names the cell declares (`Cells.Node.declared`). -/
+  declared  : Array Name := #[]
+  /-- Post-import environment, set by the cell task when this is the
+      session's first cell. -/
+  root      : IO.Ref (Option Nat)
+  cancelTk  : IO.CancelToken
+  task      : Task (Except IO.Error CellOutcome)
+
+/-- Loop bookkeeping: the committed cell chain (whose head is the
+    environment the next cell builds on), the running cell and the
+    execute requests waiting behind it, in submission order. -/
+structure LoopState where
+  cells   : Cells.Graph := {}
+  running : Option RunningCell := none
+  pending : Std.Queue (String × UInt32) := .empty
+  /-- What `autosaveSession` last wrote (see `Session.sync`). -/
+  autosaved : Array Nat := #[]
+
+/-- Elaborate one cell on top of `currentEnv`, `runs` times (for
+    `%timeit`; otherwise once), stopping early on an error. Runs on a
+    dedicated thread so the loop keeps servicing comm and inspect
+    traffic; it only reads `state` and leaves committing to `finishCell`.
+    Each run's wall time goes to `timings`, and `spans` holds the phases
+    of the last run.
+
+    With no environment yet (the session's first cell), the cell's
+    `import` header is elaborated first, on its own, and the resulting
+    post-import environment goes to `root`: it is the root of the cell
+    chain, which later forks rewind to without re-importing. A cell run
+    on `rootEnv` itself (the first cell re-run, or the first cell of a
+    kernel forked from a zygote) drops its header when `rootEnv` already
+    has every module it imports, and otherwise imports it afresh.
+
+    `cache := false` (timing magics) always elaborates, even when
+    `REPL.ExecCache` has the answer, and elaborates every command; other
+    cells reuse the unchanged leading commands of their last run on the
+    same parent (`runCommandWithTrees`'s `incremental`). -/
+def elaborateCell (handle : KernelHandle) (state : State) (currentEnv rootEnv : Option Nat)
+    (code : String) (tk : IO.CancelToken) (runs : Nat) (timings : IO.Ref (Array Nat))
+    (spans : IO.Ref (Array (String × Nat))) (root : IO.Ref (Option Nat)) (cache : Bool) : IO CellOutcome := do
+  debugLog s!"Executing: {code} (env: {currentEnv})"
+
+  -- Elaborate with a cancel token that a watcher thread trips on
+  -- kernel interrupt. An interrupted cell comes back as `.inr`
+  -- without recording a snapshot, so `cmdStates` (and
+  -- `currentEnv`) are untouched and no re-import is needed.
+  let cellDone ← IO.mkRef false
+  let watcher ← IO.asTask (prio := .dedicated) (watchInterrupts handle tk cellDone)
+  try
+    let mut state := state
+    let mut env := currentEnv
+    let mut code := code
+    let mut headerMessages : List REPL.Message := []
+    if let some snap := rootEnv.bind state.cmdStates.get? then
+      if currentEnv == rootEnv then
+        let (header, body) ← Cells.splitHeader code
+        let imported := snap.cmdState.env.header.moduleNames
+        if (← Cells.headerModules header).all imported.contains then
+          code := body
+        else
+          env := none
+    if env.isNone then
+      let (header, body) ← Cells.splitHeader code
+      let cmd : REPL.Command := { cmd := header, env := none, infotree := none }
+      match ← runCommandWithTrees cmd (cancelTk? := some tk) |>.run state with
+      | (.inl (response, trees), newState) =>
+        -- A broken header (unknown module) is the whole story; the
+        -- rest of the cell would only add follow-on errors.
+        if response.messages.any (·.severity matches .error) then
+          return (.inl (response, trees), newState)
+        root.set (some response.env)
+        state := newState
+        env := some response.env
+        code := body
+        headerMessages := response.messages
+      | outcome => return outcome
+
+    -- Run command through REPL, using the current environment
+    let cmd : REPL.Command := {
+      cmd := code,
+      env := env,  -- Use current environment to persist definitions
+      infotree := none,
+      allTactics := none,
+      rootGoals := none
+    }
+    let runOnce : IO CellOutcome := do
+      let t0 ← IO.monoNanosNow
+      let (r, phases) ← Spans.recording <|
+        runCommandWithTrees cmd (cancelTk? := some tk) (cache := cache)
+          (incremental := cache) (parallel? := parallelWorkers) |>.run state
+      let t1 ← IO.monoNanosNow
+      timings.modify (·.push (t1 - t0))
+      spans.set phases
+      return r
+    let mut r ← runOnce
+    for _ in [1:runs] do
+      if r.1 matches .inr _ then break
+      r ← runOnce
+    if let (.inl (response, trees), newState) := r then
+      r := (.inl ({ response with messages := headerMessages ++ response.messages }, trees), newState)
+    return r
+  finally
+    cellDone.set true
+    kernelWakeInterruptWaiter handle
+    let _ ← IO.wait watcher
+
+/-- Where a cell should run: on the head of the chain, or, when it
+    declares the same names as an earlier cell on the chain, in place of
+    that cell, i.e. on its parent environment (see `REPL.Cells`). Returns
+    the environment, the chain to extend, the cells the fork drops, and
+    the names the cell declares. -/
+def placeCell (state : State) (cells : Cells.Graph) (source : String) :
+    Option Nat × Cells.Graph × Array Cells.Node × Array Name :=
+  let head? := cells.head?
+  match head?.bind state.cmdStates.get? with
+  | none => (head?, cells, #[], #[])
+  | some snap =>
+    let declared := Cells.declaredNames snap.cmdState source
+    match cells.forkPoint? declared with
+    | none => (head?, cells, #[], declared)
+    | some k =>
+      let (cells', stale) := cells.truncate k
+      match stale[0]? with
+      | some replaced => (some replaced.parent, cells', stale, declared)
+      | none => (head?, cells, #[], declared)
+
+/-- Reply to a magic cell that ran nothing with `text`. -/
+def sendInfo (handle : KernelHandle) (replState : IO.Ref State) (execCount : UInt32)
+    (text : String) : IO Unit := do
+  let snapshots := (← (snapshotStats : M IO Json).run' (← replState.get)).compress
+  kernelSendResult handle execCount
+    { messages := #[{ line := 0, column := 0, severity := .info, text }], displays := #[],
+      snapshots }
+
+/-- `%reset`: rewind the session to the post-import environment without
+    re-importing. Every later environment and proof state is dropped,
+    with the cells' hover index and completion entries. Returns the new
+    (empty) cell chain. -/
+def resetSession (handle : KernelHandle) (replState : IO.Ref State) (cells : Cells.Graph)
+    (execCount : UInt32) : IO Cells.Graph := do
+  match cells.root? with
+  | none =>
+    kernelSendError handle execCount "%reset: no post-import environment to go back to yet"
+    return cells
+  | some root =>
+    let ((), st) ← (resetTo root : M IO Unit).run (← replState.get)
+    let cells : Cells.Graph := { root? := some root }
+    replState.set { st with cmdStates := st.cmdStates.pin cells.pinned }
+    Inspect.clear
+    kernelCompletionClearCells handle
+    if let some snap := st.cmdStates.get? root then
+      kernelCompletionSetScope handle (scopeNamespaces snap.cmdState)
+    sendInfo handle replState execCount "Session reset to the post-import environment."
+    debugLog s!"Reset to env {root}"
+    return cells
+
+/-- `%save-session` / `%restore-session` (see `REPL.Session`). Returns
+    the cell chain to continue on: the restored one, or `cells`. -/
+def runSessionMagic (handle : KernelHandle) (replState : IO.Ref State) (cells : Cells.Graph)
+    (execCount : UInt32) : SessionMagic → IO Cells.Graph
+  | .save path => do
+    try
+      let n ← (Session.save cells path : M IO Nat).run' (← replState.get)
+      sendInfo handle replState execCount s!"Saved {n} cells to {path}."
+    catch e =>
+      kernelSendError handle execCount s!"%save-session: {e}"
+    return cells
+  | .restore path => do
+    try
+      let (restored, st) ← (Session.restore cells.root? path).run (← replState.get)
+      replState.set st
+      Inspect.clear
+      if let some snap := restored.head?.bind st.cmdStates.get? then
+        updateCompletionIndex handle none snap
+      sendInfo handle replState execCount
+        s!"Restored {restored.chain.size} cells from {path}; continuing after them."
+      return restored
+    catch e =>
+      kernelSendError handle execCount s!"%restore-session: {e}"
+      return cells
+
+/-- With `XLEAN_AUTOSAVE_SESSION=DIR`, bring the session saved there up
+    to date. Runs whenever a cell is committed and again on shutdown, so
+    a kernel that is killed outright loses at most the running cell.
+    `saved` is what the last call wrote; returns what was written. -/
+def autosaveSession (replState : IO.Ref State) (cells : Cells.Graph) (saved : Array Nat) :
+    IO (Array Nat) := do
+  let some dir := (← IO.getEnv "XLEAN_AUTOSAVE_SESSION").filter (!·.isEmpty) | return saved
+  if cells.root?.isNone then return saved
+  try
+    let written ← (Session.sync cells dir saved : M IO (Array Nat)).run' (← replState.get)
+    if written != saved then
+      Trace.debug "kernel" "session saved" [("dir", dir), ("cells", toString cells.chain.size)]
+    return written
+  catch e =>
+    Trace.warn "kernel" "session autosave failed" [("dir", dir), ("error", toString e)]
+    return saved
+
+/-- Start the next queued cell, if any. A malformed timing magic is
+    answered with an error right away and the next cell is tried, and so
+    are `%reset` and the session magics, which need no elaboration. -/
+partial def startCell (handle : KernelHandle) (replState : IO.Ref State) (ls : LoopState) : IO LoopState := do
+  let some ((code, execCount), pending) := ls.pending.dequeue? | return ls
+  kernelBeginCell handle
+  if isResetMagic code then
+    let cells ← resetSession handle replState ls.cells execCount
+    return ← startCell handle replState { ls with pending, cells }
+  match parseSessionMagic code with
+  | .error msg =>
+    kernelSendError handle execCount msg
+    return ← startCell handle replState { ls with pending }
+  | .ok (some magic) =>
+    let cells ← runSessionMagic handle replState ls.cells execCount magic
+    return ← startCell handle replState { ls with pending, cells }
+  | .ok none => pure ()
+  match parseTimingMagic code with
+  | .error msg =>
+    kernelSendError handle execCount msg
+    startCell handle replState { ls with pending }
+  | .ok (magic, source) =>
+    let _ ← kernelWaitInterrupt handle 0  -- drop interrupts sent while idle
+    let tk ← IO.CancelToken.new
+    let parent ← replState.get
+    let timings ← IO.mkRef #[]
+    let spans ← IO.mkRef #[]
+    let root ← IO.mkRef none
+    let runs := if let .timeit n := magic then n else 1
+    let (parentEnv, cells, stale, declared) := placeCell parent ls.cells source
+    unless stale.isEmpty do
+      debugLog s!"Cell [{execCount}] replaces [{stale[0]!.execCount}], forking from env {parentEnv}"
+    let task ← IO.asTask (prio := .dedicated)
+      (elaborateCell handle parent parentEnv ls.cells.root? source tk runs timings spans
+        root (cache := magic matches .plain))
+    -- Only once the task has finished: woken any earlier, the loop
+    -- would find it still running and park again.
+    let _ ← IO.mapTask (fun _ => kernelWakeLoop handle) task
+    return { ls with pending, running := some {
+      code, execCount, magic, timings, spans, parentEnv, parent, cells, stale, declared, root,
+      cancelTk := tk, task } }
+
+/-- Commit a finished cell and send its reply. Runs on the loop thread,
+    one cell at a time in submission order. Returns the cell chain the
+    next cell builds on: `cells` unchanged unless the cell succeeded. -/
+def finishCell (handle : KernelHandle) (replState : IO.Ref State) (cells : Cells.Graph)
+    (cell : RunningCell) (outcome : Except IO.Error CellOutcome) : IO Cells.Graph := do
+  let code := cell.code
+  let execCount := cell.execCount
+  let currentEnv := cell.parentEnv
+  let state := cell.parent
+  let result : CellOutcome := match outcome with
+    | .ok r => r
+    | .error e => (.inr ⟨e.toString⟩, state)
+  -- `%timeit` measures the cell against its parent; nothing it did sticks.
+  let measureOnly := cell.magic matches .timeit _
+  let spans ← cell.spans.get
+  let timings ← cell.timings.get
+  -- A first cell leaves its imports behind even if the rest of it fails.
+  let cells := match ← cell.root.get with
+    | some root => if measureOnly then cells else { cells with root? := some root }
+    | none => cells
+  -- Keep the chain's environments out of the snapshot store's LRU.
+  let commit (g : Cells.Graph) : IO Cells.Graph := do
+    replState.modify fun s => { s with cmdStates := s.cmdStates.pin g.pinned }
+    return g
+
+  match result with
+  | (.inl (response, trees), newState) =>
+    unless measureOnly do replState.set newState
+
+    -- Re-running a cell that declares the same names replaces it (see
+    -- `placeCell`), so this is left for names that come from an import,
+    -- from an earlier cell that declared other names too, or from
+    -- another declaration in the same cell. Lean's message alone tells
+    -- a notebook user nothing actionable.
+    let augmentDuplicate (msg : String) : String :=
+      if msg.startsWith "'" && msg.endsWith "has already been declared" then
+        msg ++ "\n  hint: the name is already taken by an import, an\n"
+            ++ "    earlier cell or an earlier declaration in this cell.\n"
+            ++ "    Re-running a cell replaces it only if it declares the\n"
+            ++ "    same names as before. Rename this definition, put it\n"
+            ++ "    in a namespace, or run %reset to go back to the\n"
+            ++ "    post-import environment."
       else
-        return .unknown
-
-/-- Main kernel loop with environment tracking -/
-partial def kernelLoop (handle : KernelHandle) (replState : IO.Ref State) (currentEnv : Option Nat) : IO Unit := do
-  -- Pump any pending comm events first; they're independent of execute
-  -- requests and arrive on iopub, so leaving them in the queue would
-  -- delay JS frontends until the next user-driven cell.
-  drainCommEvents handle
-
-  -- Poll for messages with 100ms timeout
-  let msgJson ← kernelPoll handle 100
-
-  if msgJson.isEmpty then
-    -- No message, check if we should stop
-    let shouldStop ← kernelShouldStop handle
-    if shouldStop then
-      return ()
+        msg
+    -- Messages travel to C++ as structured values; it renders them
+    -- (`<line>:<col>: <severity>: <data>`, bare for info) and pulls
+    -- MIME markers that `#html` & co. logged out of the text.
+    let messages := response.messages.toArray.map fun m =>
+      { line := m.pos.line.toUInt32
+        column := m.pos.column.toUInt32
+        severity := m.severity
+        text := if m.severity matches .info then m.data else augmentDuplicate m.data
+        : CellMessage }
+    let report (text : String) : CellMessage :=
+      { line := 0, column := 0, severity := .info, text }
+    -- Tell the user which cells a fork left behind.
+    let messages := match cell.stale.toList with
+      | replaced :: downstream@(_ :: _) =>
+        if measureOnly then messages else
+        let counts := ", ".intercalate (downstream.map fun n => s!"[{n.execCount}]")
+        messages.push (report s!"Replaced cell [{replaced.execCount}]. Cells {counts} ran on \
+          its old definitions and are now stale; re-run them to bring them back.")
+      | _ => messages
+    -- `%timeit` keeps warnings and errors (the numbers mean little if
+    -- the cell is broken) but not the output of every run.
+    let messages := match cell.magic with
+      | .plain => messages
+      | .time => messages.push (report (timeReport (timings.back?.getD 0) spans))
+      | .timeit _ =>
+        (messages.filter fun m => !(m.severity matches .info)).push (report (timeitReport timings))
+
+    -- MIME-typed payloads (Display.html / .svg / .waveform / ...) the
+    -- cell deposited in the global Display buffer, already split by
+    -- mime type, so they go straight into the iopub bundle.
+    let displays ← Display.drainPayloads
+    let displays := if measureOnly then #[] else displays
+
+    let spans := spans.map fun (name, t) => { name, nanos := t.toUInt64 : CellSpan }
+    let snapshots := (← (snapshotStats : M IO Json).run' (← replState.get)).compress
+    kernelSendResult handle execCount { messages, displays, spans, snapshots }
+    if measureOnly then
+      return cells
+
+    -- Extend the completion index with this cell's constants and
+    -- keep its InfoTrees for hover. Done after the reply so indexing
+    -- a fresh Mathlib import does not hold back the first cell's output.
+    -- A fork first takes back what the cells it dropped added.
+    unless cell.stale.isEmpty do
+      kernelCompletionRemove handle (cell.stale.flatMap (·.decls.map toString))
+    if let some snap := newState.cmdStates.get? response.env then
+      let parent? := currentEnv.bind state.cmdStates.get? |>.map (·.cmdState.env)
+      updateCompletionIndex handle parent? snap
+    -- A cached answer comes without trees; the index from the run that
+    -- filled the cache still answers for the same code.
+    unless trees.isEmpty do Inspect.record code trees
+
+    debugLog s!"Success (env: {response.env})"
+
+    -- Continue with the new environment, on the (possibly forked) chain.
+    let decls := match newState.cmdStates.get? response.env with
+      | some snap =>
+        Cells.addedConstants (currentEnv.bind state.cmdStates.get? |>.map (·.cmdState.env))
+          snap.cmdState.env
+      | none => #[]
+    let parent := (currentEnv <|> cells.root?).getD response.env
+    let cellsOnto := match cells.root?, cell.cells.root? with
+      | some root, none => { cell.cells with root? := some root }
+      | _, _ => cell.cells
+    -- Only names the cell did add: one that failed as "already
+    -- declared" must not make this cell the one to replace next time.
+    commit (cellsOnto.push { execCount, parent, env := response.env, decls,
+      declared := cell.declared.filter decls.contains })
+
+  | (.inr error, newState) =>
+    unless measureOnly do replState.set newState
+
+    -- Send error back to Jupyter
+    kernelSendError handle execCount error.message
+
+    debugLog s!"Error: {error.message}"
+
+    -- Keep the same chain on error
+    commit cells
+
+/-- Answer an inspect (hover) request. -/
+def answerInspect (handle : KernelHandle) (replState : IO.Ref State) (currentEnv : Option Nat)
+    (id : UInt32) (code : String) (pos : Nat) (ident : String) : IO Unit := do
+  let text ← do
+    if let some t ← Inspect.inspectCell code pos then
+      pure t
     else
-      kernelLoop handle replState currentEnv
-  else
-    -- Process message
-    let msgType ← parseMessage msgJson
-
-    match msgType with
-    | .executeRequest code execCount =>
-      debugLog s!"[Lean Kernel] Executing: {code} (env: {currentEnv})"
-
-      -- Run command through REPL, using the current environment
-      let cmd : REPL.Command := {
-        cmd := code,
-        env := currentEnv,  -- Use current environment to persist definitions
-        infotree := none,
-        allTactics := none,
-        rootGoals := none
-      }
-      let state ← replState.get
-      let result ← runCommand cmd |>.run state
-
-      match result with
-      | (.inl response, newState) =>
-        replState.set newState
-
-        -- Lean's "X has already been declared" error is technically
-        -- correct but a notebook user trying to redefine a cell hits
-        -- it constantly and the message tells them nothing actionable.
-        -- Append a notebook-specific hint so they know what to do.
-        let augmentDuplicate (msg : String) : String :=
-          if msg.startsWith "'" && msg.endsWith "has already been declared" then
-            msg ++ "\n  hint: this notebook kernel keeps every previously-\n"
-                ++ "    defined name in scope. Either rename this definition,\n"
-                ++ "    or restart the kernel (Kernel → Restart) to clear the\n"
-                ++ "    old binding."
-          else
-            msg
-        -- Format messages for the notebook. We render every severity
-        -- (info, warning, error) the same way Lean's compiler does:
-        --   <line>:<col>: <severity>: <data>
-        -- so users see a compact, scannable trace instead of a JSON dump.
-        let renderMsg (m : REPL.Message) : String :=
-          let sev := match m.severity with
-            | .info    => "info"
-            | .warning => "warning"
-            | .error   => "error"
-            | .trace   => "trace"
-          let posStr := s!"{m.pos.line}:{m.pos.column}"
-          if sev == "info" then
-            -- Plain `#eval` / `#check` output: don't prepend a position
-            -- prefix, just show the data — matches what users expect from
-            -- a REPL.
-            m.data
-          else
-            s!"{posStr}: {sev}: {augmentDuplicate m.data}"
-        let renderedMsgs :=
-          if response.messages.isEmpty then ""
-          else String.intercalate "\n" (response.messages.map renderMsg)
-
-        -- Drain any MIME-typed payloads (Display.html / .svg / .waveform / ...)
-        -- that the cell deposited in the global Display buffer. C++ parses
-        -- the markers (`\x1bMIME:<type>\x1e<payload>\x1b/MIME\x1e`) and routes
-        -- each one to the correct Jupyter mime bundle key.
-        let displayOutput ← Display.drain
-        let formattedJson :=
-          if displayOutput.isEmpty then renderedMsgs
-          else if renderedMsgs.isEmpty then displayOutput
-          else renderedMsgs ++ "\n" ++ displayOutput
-
-        kernelSendResult handle execCount formattedJson
-
-        debugLog s!"[Lean Kernel] Success (env: {response.env})"
-
-        -- Continue with the new environment ID
-        kernelLoop handle replState (some response.env)
-
-      | (.inr error, newState) =>
-        replState.set newState
-
-        -- Send error back to Jupyter
-        let errorJson := Lean.toJson error |>.compress
-        kernelSendError handle execCount errorJson
-
-        debugLog s!"[Lean Kernel] Error: {errorJson}"
-
-        -- Keep the same environment on error
-        kernelLoop handle replState currentEnv
-
-    | .shutdownRequest =>
-      debugLog "[Lean Kernel] Shutdown requested"
+      -- Not a cell we ran (or its index was evicted): resolve the
+      -- identifier in the scope the last cell left behind.
+      let st ← replState.get
+      match currentEnv.bind st.cmdStates.get? with
+      | some snap => pure ((← Inspect.inspectName snap.cmdState ident).getD "")
+      | none => pure ""
+  kernelSendInspect handle id text
+
+/-- Main kernel loop with environment tracking.
+
+    Cells elaborate on their own thread (`elaborateCell`); the loop keeps
+    draining comm and inspect traffic meanwhile, answering it against the
+    last committed state. Execute requests queue up behind the running
+    cell and are started, and committed, strictly in submission order. -/
+partial def kernelLoop (handle : KernelHandle) (replState : IO.Ref State) (ls : LoopState) : IO Unit := do
+  -- Commit the running cell once its task is done, then start the next.
+  let mut ls := ls
+  if let some cell := ls.running then
+    if ← IO.hasFinished cell.task then
+      let cells ← finishCell handle replState ls.cells cell cell.task.get
+      ls := { ls with cells, running := none }
+  if ls.running.isNone then
+    -- Also covers what `%reset` and `%restore-session` did to the chain.
+    ls := { ls with autosaved := ← autosaveSession replState ls.cells ls.autosaved }
+    ls ← startCell handle replState ls
+
+  -- Block until something arrives, then take everything queued (up to a
+  -- bound) in one FFI call, so a burst of widget `comm_msg`s costs one
+  -- crossing instead of one per event. The timeout is only a safety
+  -- net: requests, comm events, shutdown and a finishing cell task all
+  -- wake the wait.
+  let events ← kernelPollBatch handle 1000 256
+  if events.isEmpty then
+    -- Woken with nothing queued, check if we should stop
+    if ← kernelShouldStop handle then
+      if let some cell := ls.running then
+        cell.cancelTk.set
+        let _ ← IO.wait cell.task
+      discard <| autosaveSession replState ls.cells ls.autosaved
+      if Trace.enabled "kernel" .debug then
+        debugLog s!"Queue stats: {← kernelQueueStats handle}"
       return ()
-
-    | .unknown =>
-      debugLog s!"[Lean Kernel] Unknown message: {msgJson}"
-      kernelLoop handle replState currentEnv
+    kernelLoop handle replState ls
+  else
+    for ev in events do
+      match ev with
+      | .request (.execute code execCount) =>
+        ls := { ls with pending := ls.pending.enqueue (code, execCount) }
+      | .request (.inspect id code pos ident) =>
+        answerInspect handle replState ls.cells.head? id code pos ident
+      | _ => processCommEvent handle ev
+    kernelLoop handle replState ls
 
 end XeusKernel
 
 open XeusKernel
 
-/-- Main entry point -/
-def main (args : List String) : IO Unit := do
-  -- Get connection file from arguments
-  let connectionFile := match args with
-    | f :: _ => f
-    | [] => "connection.json"
+/-- Serve `connectionFile`, starting from `initialState` and the cell
+    chain `cells`. -/
+def runKernel (connectionFile : String) (initialState : REPL.State) (cells : Cells.Graph) :
+    IO Unit := do
+  debugLog s!"Starting with connection file: {connectionFile}"
+  debugLog "Initializing FFI..."
+  ffiInitialize
 
-  debugLog s!"[Lean Kernel] Starting with connection file: {connectionFile}"
+  debugLog "Initializing xeus kernel..."
 
-  -- Initialize search path
-  Lean.initSearchPath (← Lean.findSysroot)
+  -- Initialize xeus kernel
+  match ← kernelInit connectionFile with
+  | none =>
+    Trace.error "kernel" "failed to initialize xeus kernel"
+    throw (IO.userError "Kernel initialization failed")
+
+  | some handle =>
+    debugLog "Xeus kernel initialized successfully"
+
+    let replState ← IO.mkRef initialState
+    -- A preloaded root (zygote) never went through a first cell, which
+    -- is what normally seeds completion with the imported names.
+    if let some snap := cells.root?.bind initialState.cmdStates.get? then
+      updateCompletionIndex handle none snap
+
+    debugLog "Starting kernel event loop..."
+    try
+      kernelLoop handle replState { cells }
+    finally
+      removeSpillDir
+
+    debugLog "Kernel stopped"
+
+/-- `--zygote SOCKET`: import `XLEAN_ZYGOTE_IMPORTS` (whitespace-separated
+    module names) plus the auto-imports once, then fork a kernel per
+    `--attach` request. Children share the imported environment and the
+    mmapped `.olean`s copy-on-write, and start with it as their root.
+    `zygoteServe` stops Lean's task workers before it forks and each
+    child starts its own; nothing else here may start a thread. -/
+def zygoteMain (socketPath : String) : IO Unit := do
+  let raw := ((← IO.getEnv "XLEAN_ZYGOTE_IMPORTS").getD "").replace "\n" " "
+  let modules := raw.splitOn " " |>.filter (!·.isEmpty)
+  let header := String.join (modules.map fun m => s!"import {m}\n")
+  let cmd : REPL.Command := { cmd := header, env := none, infotree := none }
+  let t0 ← IO.monoNanosNow
+  let root ← match ← runCommandWithTrees cmd (cache := false) |>.run {} with
+    | (.inl (response, _), state) =>
+      if let some m := response.messages.find? (·.severity matches .error) then
+        throw (IO.userError s!"zygote: import failed: {m.data}")
+      pure (response.env, state)
+    | (.inr e, _) => throw (IO.userError s!"zygote: import failed: {e.message}")
+  let t1 ← IO.monoNanosNow
+  Trace.info "zygote" "imports loaded"
+    [("modules", toString modules), ("ms", toString ((t1 - t0) / 1000000))]
+  let (env, state) := root
+  let connectionFile ← zygoteServe socketPath
+  runKernel connectionFile { state with cmdStates := state.cmdStates.pin #[env] }
+    { root? := some env }
+
+/-- Main entry point. `xlean CONNECTION_FILE` runs a kernel; `xlean
+    --zygote SOCKET` and `xlean --attach SOCKET CONNECTION_FILE` split
+    that into a preloaded server and a per-notebook launcher (see
+    `zygoteMain`). -/
+def main (args : List String) : IO Unit := do
+  if let ["--attach", socketPath, connectionFile] := args then
+    return ← zygoteAttach socketPath connectionFile
+
+  -- Resolve sysroot and search path once for the session; cells reuse it.
+  discard REPL.Runtime.get
 
   -- Load any extra native shared libraries listed in `LEAN_DYNLIB_PATH`
   -- (colon-separated list of `.so` paths).  This is what makes
@@ -276,33 +874,13 @@ def main (args : List String) : IO Unit := do
   if let some dynlibPath ← IO.getEnv "LEAN_DYNLIB_PATH" then
     for entry in dynlibPath.splitOn ":" do
       if !entry.isEmpty then
-        debugLog s!"[Lean Kernel] Loading dynlib: {entry}"
+        debugLog s!"Loading dynlib: {entry}"
         try
           Lean.loadDynlib entry
         catch e =>
-          IO.eprintln s!"[Lean Kernel] Warning: failed to load {entry}: {e}"
-
-  debugLog "[Lean Kernel] Initializing FFI..."
-  ffiInitialize
-
-  debugLog "[Lean Kernel] Initializing xeus kernel..."
-
-  -- Initialize xeus kernel
-  match ← kernelInit connectionFile with
-  | none =>
-    IO.eprintln "[Lean Kernel] Failed to initialize xeus kernel"
-    throw (IO.userError "Kernel initialization failed")
-
-  | some handle =>
-    debugLog "[Lean Kernel] Xeus kernel initialized successfully"
-
-    -- Initialize REPL state
-    let initialState : REPL.State := { cmdStates := #[], proofStates := #[] }
-    let replState ← IO.mkRef initialState
-
-    debugLog "[Lean Kernel] Starting kernel event loop..."
-
-    -- Run kernel loop with initial empty environment
-    kernelLoop handle replState none
+          Trace.warn "kernel" "failed to load dynlib" [("path", entry), ("error", toString e)]
 
-    debugLog "[Lean Kernel] Kernel stopped"
+  match args with
+  | ["--zygote", socketPath] => zygoteMain socketPath
+  | f :: _ => runKernel f {} {}
+  | [] => runKernel "connection.json" {} {}
@@ -16,7 +16,7 @@ Module.preRun.push(() => {
 // See https://github.com/Verilean/xeus-lean/issues/11.
 //
 // stderr is treated differently: most of what the runtime writes to
-// it is `[WasmRepl] …` / `[WASM] …` instrumentation that's only
+// it is `[xlean …]` trace instrumentation (XLEAN_TRACE) that's only
 // useful in the DevTools console.  Capturing it like stdout would
 // flood every cell's output area and drown out the rich-display
 // payload that arrives a frame later — empirically that broke the
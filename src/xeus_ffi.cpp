@@ -5,17 +5,39 @@ Released under Apache 2.0 license as described in the file LICENSE.
 C++ FFI wrapper for xeus - called from Lean
 */
 
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <string>
-#include <queue>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <deque>
 #include <map>
+#include <optional>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <chrono>
 #include <atomic>
+#include <climits>
+#include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <cerrno>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
 
 #include <lean/lean.h>
 #include "nlohmann/json.hpp"
@@ -26,22 +48,20 @@ C++ FFI wrapper for xeus - called from Lean
 #include "xeus/xguid.hpp"
 #include "xeus-zmq/xserver_zmq.hpp"
 #include "xeus-zmq/xzmq_context.hpp"
+#include "xeus-lean/xtrace.hpp"
+#include "xeus-lean/xutf8.hpp"
 
 using json = nlohmann::json;
+using xeus_lean::lean_ident_end;
+using xeus_lean::lean_ident_start;
+using xeus_lean::utf8_byte_offset;
+using xeus_lean::utf8_codepoint_count;
 
 namespace {
 
-// Check if debug mode is enabled via environment variable
-inline bool is_debug_enabled() {
-    static bool debug = []() {
-        const char* env = std::getenv("XLEAN_DEBUG");
-        return env != nullptr && (std::string(env) == "1" || std::string(env) == "true");
-    }();
-    return debug;
-}
-
-// Debug logging macro
-#define DEBUG_LOG(msg) do { if (is_debug_enabled()) { std::cerr << msg << std::endl; } } while(0)
+// Debug logging for the FFI layer; see xeus-lean/xtrace.hpp for the
+// XLEAN_DEBUG / XLEAN_TRACE controls.
+#define DEBUG_LOG(msg) XLEAN_LOG("ffi", debug, msg)
 
 // Walk `text` and pull out MIME-typed payloads emitted by Lean's Display
 // module. Each payload is encoded as
@@ -87,25 +107,422 @@ static void extract_mime_payloads(const std::string& text,
     }
 }
 
+// Length of the longest prefix of `s` that does not end inside a UTF-8
+// multi-byte sequence. Stream chunks are cut wherever read() returned,
+// and nlohmann refuses to serialize a string holding half a codepoint.
+static std::size_t utf8_complete_prefix(const std::string& s)
+{
+    std::size_t n = s.size();
+    // A sequence is at most 4 bytes, so only the last 3 can be a stub.
+    for (std::size_t back = 1; back <= 3 && back <= n; ++back) {
+        unsigned char c = static_cast<unsigned char>(s[n - back]);
+        if ((c & 0xC0) == 0x80) continue;          // continuation byte
+        std::size_t need = (c & 0xE0) == 0xC0 ? 2
+                         : (c & 0xF0) == 0xE0 ? 3
+                         : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return need > back ? n - back : n;
+    }
+    return n;
+}
+
+// Incremental counterpart of extract_mime_payloads for the live stdout
+// stream. Bytes are fed in whatever chunks read() produced; `take` hands
+// back, in order, the plain-text runs and complete MIME payloads seen so
+// far, and keeps anything that might still turn into a marker (a
+// half-written `\x1bMIME:...` envelope, or a trailing partial ESC
+// prefix) for the next call. With `final` set everything left is
+// flushed, malformed envelopes as plain text — same fallback as the
+// one-shot parser.
+class mime_stream_splitter {
+public:
+    struct chunk {
+        std::string mime;   // empty for plain text
+        std::string text;
+    };
+
+    void feed(const char* data, std::size_t n) { m_buf.append(data, n); }
+
+    std::vector<chunk> take(bool final) {
+        static const std::string OPEN_PREFIX = "\x1b" "MIME:";
+        static const std::string CLOSE_MARK  = "\x1b" "/MIME" "\x1e";
+        static const char RS = '\x1e';
+
+        std::vector<chunk> out;
+        std::size_t cursor = 0;
+        while (cursor < m_buf.size()) {
+            std::size_t open = m_buf.find(OPEN_PREFIX, cursor);
+            if (open == std::string::npos) {
+                std::size_t keep = final ? 0 : partial_marker_suffix(OPEN_PREFIX, cursor);
+                emit_plain(out, cursor, m_buf.size() - keep, final);
+                break;
+            }
+            emit_plain(out, cursor, open, true);
+            cursor = open;
+            std::size_t mime_start = open + OPEN_PREFIX.size();
+            std::size_t rs_pos = m_buf.find(RS, mime_start);
+            std::size_t close_pos = rs_pos == std::string::npos
+                ? std::string::npos : m_buf.find(CLOSE_MARK, rs_pos + 1);
+            if (close_pos == std::string::npos) {
+                // Envelope not finished yet; wait for more bytes unless
+                // the stream is closing.
+                if (final) emit_plain(out, open, m_buf.size(), true);
+                else break;
+                cursor = m_buf.size();
+                break;
+            }
+            out.push_back({m_buf.substr(mime_start, rs_pos - mime_start),
+                           m_buf.substr(rs_pos + 1, close_pos - rs_pos - 1)});
+            cursor = close_pos + CLOSE_MARK.size();
+        }
+        m_buf.erase(0, std::min(cursor, m_buf.size()));
+        return out;
+    }
+
+private:
+    // Number of trailing bytes (at or after `from`) that form a proper
+    // prefix of `marker` and so may complete into one on the next read.
+    std::size_t partial_marker_suffix(const std::string& marker, std::size_t from) const {
+        std::size_t avail = m_buf.size() - from;
+        for (std::size_t len = std::min(marker.size() - 1, avail); len > 0; --len) {
+            if (m_buf.compare(m_buf.size() - len, len, marker, 0, len) == 0) return len;
+        }
+        return 0;
+    }
+
+    // Append m_buf[begin, end) as plain text, holding back a trailing
+    // partial UTF-8 sequence unless `whole` is set. `begin` is advanced
+    // past whatever was emitted, so a held-back stub stays buffered.
+    void emit_plain(std::vector<chunk>& out, std::size_t& begin, std::size_t end, bool whole) {
+        if (end <= begin) return;
+        std::string text = m_buf.substr(begin, end - begin);
+        if (!whole) text.resize(utf8_complete_prefix(text));
+        begin += text.size();
+        if (text.empty()) return;
+        if (!out.empty() && out.back().mime.empty()) out.back().text += text;
+        else out.push_back({"", std::move(text)});
+    }
+
+    std::string m_buf;
+};
+
+// Prefix index over constant names for native tab completion.
+//
+// Names arrive from the Lean loop: the imported base environment once
+// (after the first cell), then only each cell's new constants, so the
+// per-keystroke cost never involves walking the environment. Both are
+// kept as sorted vectors; a lookup is a lower_bound plus a scan over the
+// matches. The base stays immutable once built and cell deltas go to a
+// small second vector, so adding a cell never re-sorts ~300k Mathlib
+// names. Lookups run on the xeus shell thread while the Lean thread may
+// be adding names, hence the mutex.
+class completion_index {
+public:
+    // Drop everything; the next add() rebuilds the base.
+    void clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_base.clear();
+        m_cells.clear();
+        m_scope.clear();
+    }
+
+    // Drop the names cells added, keeping the imported base (`%reset`).
+    void clear_cells() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cells.clear();
+    }
+
+    // Add a batch of names. The first batch after clear() becomes the
+    // base; later batches are merged into the per-cell vector.
+    void add(std::vector<std::string> names) {
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_base.empty()) {
+            m_base = std::move(names);
+            return;
+        }
+        std::size_t mid = m_cells.size();
+        m_cells.insert(m_cells.end(), std::make_move_iterator(names.begin()),
+                       std::make_move_iterator(names.end()));
+        std::inplace_merge(m_cells.begin(), m_cells.begin() + mid, m_cells.end());
+        m_cells.erase(std::unique(m_cells.begin(), m_cells.end()), m_cells.end());
+    }
+
+    // Drop names cells added that a forked chain no longer has.
+    void remove(std::vector<std::string> names) {
+        std::sort(names.begin(), names.end());
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cells.erase(std::remove_if(m_cells.begin(), m_cells.end(),
+                                     [&](const std::string& n) {
+                                         return std::binary_search(names.begin(), names.end(), n);
+                                     }),
+                      m_cells.end());
+    }
+
+    // Namespaces whose members resolve unqualified: the current
+    // namespace and its parents, plus every `open`ed namespace.
+    void set_scope(std::vector<std::string> namespaces) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_scope = std::move(namespaces);
+    }
+
+    // Completions for `prefix`, as the text that should replace it.
+    // Names reachable through an open namespace are offered in their
+    // short form. At most `limit` results, shortest first.
+    std::vector<std::string> lookup(const std::string& prefix, std::size_t limit) const {
+        std::vector<std::string> out;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            collect(m_base, prefix, 0, limit, out);
+            collect(m_cells, prefix, 0, limit, out);
+            for (const auto& ns : m_scope) {
+                std::string qualified = ns + "." + prefix;
+                collect(m_base, qualified, ns.size() + 1, limit, out);
+                collect(m_cells, qualified, ns.size() + 1, limit, out);
+            }
+        }
+        std::sort(out.begin(), out.end(), [](const std::string& a, const std::string& b) {
+            return a.size() != b.size() ? a.size() < b.size() : a < b;
+        });
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+        if (out.size() > limit) out.resize(limit);
+        return out;
+    }
+
+private:
+    static void collect(const std::vector<std::string>& names, const std::string& prefix,
+                        std::size_t strip, std::size_t limit, std::vector<std::string>& out) {
+        auto it = std::lower_bound(names.begin(), names.end(), prefix);
+        for (std::size_t n = 0; it != names.end() && n < limit; ++it, ++n) {
+            if (it->compare(0, prefix.size(), prefix) != 0) break;
+            out.push_back(it->substr(strip));
+        }
+    }
+
+    mutable std::mutex m_mutex;
+    std::vector<std::string> m_base;
+    std::vector<std::string> m_cells;
+    std::vector<std::string> m_scope;
+};
+
+// Bounded lock-free multi-producer / single-consumer ring (Vyukov's
+// bounded queue, consumer side simplified for one reader). xeus threads
+// push, the Lean loop pops. Each slot carries a sequence number, so a
+// producer claims a slot with one CAS and publishes it with one release
+// store; neither side ever takes a lock. Entries are stamped on push so
+// the consumer can measure how long they waited (dwell time).
+template <typename T>
+class mpsc_ring {
+public:
+    explicit mpsc_ring(std::size_t capacity_pow2)
+        : m_slots(new slot[capacity_pow2]), m_mask(capacity_pow2 - 1) {
+        for (std::size_t i = 0; i < capacity_pow2; ++i) {
+            m_slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns false when the ring is full.
+    bool try_push(T&& value) {
+        std::size_t pos = m_tail.load(std::memory_order_relaxed);
+        for (;;) {
+            slot& s = m_slots[pos & m_mask];
+            std::size_t seq = s.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if (diff == 0) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    s.value = std::move(value);
+                    s.enqueued = std::chrono::steady_clock::now();
+                    s.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Push, yielding while the ring is full. Only a consumer stalled for
+    // thousands of events can get here; backpressure beats dropping a
+    // widget's messages.
+    void push(T&& value) {
+        while (!try_push(std::move(value))) std::this_thread::yield();
+    }
+
+    // Consumer only. Returns false when the ring is empty.
+    bool try_pop(T& out, std::chrono::steady_clock::time_point& enqueued) {
+        std::size_t pos = m_head.load(std::memory_order_relaxed);
+        slot& s = m_slots[pos & m_mask];
+        std::size_t seq = s.seq.load(std::memory_order_acquire);
+        if (static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1) < 0) {
+            return false;
+        }
+        out = std::move(s.value);
+        s.value = T();
+        enqueued = s.enqueued;
+        s.seq.store(pos + m_mask + 1, std::memory_order_release);
+        m_head.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate: exact when no producer is mid-push.
+    std::size_t size() const {
+        std::size_t tail = m_tail.load(std::memory_order_acquire);
+        std::size_t head = m_head.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    struct slot {
+        std::atomic<std::size_t> seq;
+        T value;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+    std::unique_ptr<slot[]> m_slots;
+    const std::size_t m_mask;
+    alignas(64) std::atomic<std::size_t> m_tail{0};   // producers
+    alignas(64) std::atomic<std::size_t> m_head{0};   // consumer
+};
+
+// Depth and dwell-time counters for one queue. Updated by the consumer
+// (dwell, depth seen at drain time) without locks; read by
+// xeus_kernel_queue_stats.
+struct queue_stats {
+    std::atomic<uint64_t> dequeued{0};
+    std::atomic<uint64_t> max_depth{0};
+    std::atomic<uint64_t> dwell_total_us{0};
+    std::atomic<uint64_t> dwell_max_us{0};
+
+    void on_drain(std::size_t depth) {
+        if (depth > max_depth.load(std::memory_order_relaxed)) {
+            max_depth.store(depth, std::memory_order_relaxed);
+        }
+    }
+
+    void on_pop(std::chrono::steady_clock::time_point enqueued) {
+        auto us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - enqueued).count());
+        dequeued.fetch_add(1, std::memory_order_relaxed);
+        dwell_total_us.fetch_add(us, std::memory_order_relaxed);
+        if (us > dwell_max_us.load(std::memory_order_relaxed)) {
+            dwell_max_us.store(us, std::memory_order_relaxed);
+        }
+    }
+
+    json to_json(std::size_t depth) const {
+        uint64_t n = dequeued.load();
+        return {
+            {"depth", depth},
+            {"max_depth", max_depth.load()},
+            {"dequeued", n},
+            {"dwell_avg_us", n ? dwell_total_us.load() / n : 0},
+            {"dwell_max_us", dwell_max_us.load()},
+        };
+    }
+};
+
+// Phase timer for the C++ side of a reply: each lap() records the time
+// since the previous lap (or construction) under `name`, in ms.
+class phase_timer {
+public:
+    phase_timer() : m_last(std::chrono::steady_clock::now()) {}
+
+    void lap(const char* name) {
+        auto now = std::chrono::steady_clock::now();
+        m_phases[name] = std::chrono::duration<double, std::milli>(now - m_last).count();
+        m_last = now;
+    }
+
+    json& phases() { return m_phases; }
+
+private:
+    std::chrono::steady_clock::time_point m_last;
+    json m_phases = json::object();
+};
+
+// Bytes handed out by malloc (arena plus mmap'd chunks), or -1 where
+// glibc's mallinfo2 is unavailable. Lean's small-object allocator
+// carves its pages out of malloc, so deltas track cell allocations
+// coarsely (pages, not objects).
+inline long long heap_in_use() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+    return static_cast<long long>(mi.uordblks + mi.hblkhd);
+#else
+    return -1;
+#endif
+}
+
+// A request for the Lean loop. Queued by xeus threads as plain C++ data
+// and turned into a Lean `XeusKernel.KernelRequest` object on the Lean
+// thread by xeus_kernel_poll_batch, so cell source crosses the boundary as a
+// single string copy with no JSON encode/parse in between.
+struct kernel_request {
+    enum class kind { execute, inspect };
+    kind k = kind::execute;
+    std::string code;
+    int execution_count = 0;    // execute
+    uint32_t id = 0;            // inspect: reply correlation id
+    std::size_t pos = 0;        // inspect: byte offset of the cursor
+    std::string ident;          // inspect: identifier under the cursor
+};
+
+// A comm event for the Lean loop. `payload` is the `session` field of
+// the open request's data for `open`, and the message data (as JSON
+// text, which is what CommBus handlers consume) for `msg`.
+struct comm_event {
+    enum class kind { open, msg, close };
+    kind k = kind::msg;
+    std::string id;
+    std::string payload;
+};
+
+// Field-wise copy of a Lean `XeusKernel.CellResult`. Severities follow
+// the constructor order of `REPL.Severity`.
+struct cell_message {
+    enum severity : uint8_t { trace, info, warning, error };
+    uint32_t line = 0;
+    uint32_t column = 0;
+    uint8_t sev = info;
+    std::string text;
+};
+
+struct cell_result {
+    std::vector<cell_message> messages;
+    std::vector<std::pair<std::string, std::string>> displays;  // (mime, payload)
+    std::vector<std::pair<std::string, uint64_t>> spans;         // (phase, ns)
+    std::string snapshots;                                        // JSON text
+};
+
+// SIGTERM and SIGHUP, and the attacher of a zygote child going away,
+// ask the Lean loop to stop rather than killing the process, so that it
+// cancels the running cell and saves the session (XLEAN_AUTOSAVE_SESSION)
+// on its way out. The loop polls at least once a second and sees the
+// flag through should_stop().
+std::atomic<bool> g_stop_requested{false};
+
 // Simple interpreter that queues messages for Lean to process
 class lean_interpreter : public xeus::xinterpreter {
 public:
-    lean_interpreter() : m_message_mutex(), m_should_stop(false), m_current_callback(nullptr) {
-        DEBUG_LOG("[C++ FFI] lean_interpreter constructed, mutex at " << (void*)&m_message_mutex);
+    lean_interpreter() : m_message_mutex(), m_should_stop(false) {
+        DEBUG_LOG("lean_interpreter constructed, mutex at " << (void*)&m_message_mutex);
     }
     virtual ~lean_interpreter() = default;
 
     void configure_impl() override {
-        DEBUG_LOG("[C++ FFI] Interpreter configured");
+        DEBUG_LOG("Interpreter configured");
         // Register a single comm target named "xlean". JS frontends open a
         // comm channel against this target and the per-channel `on_message`
         // handler queues incoming messages for the Lean side to process
-        // (see poll_comm / send_comm).
+        // (see drain_events / send_comm).
         comm_manager().register_comm_target(
             "xlean",
             [this](xeus::xcomm&& comm, xeus::xmessage open_request) {
                 xeus::xguid id = comm.id();
-                DEBUG_LOG("[C++ FFI] comm_open id=" << std::string(id.c_str()));
+                DEBUG_LOG("comm_open id=" << std::string(id.c_str()));
 
                 // Move the comm into our owned map. We need to keep it alive
                 // so we can call .send() on it later — xeus would otherwise
@@ -117,30 +534,23 @@ public:
                     // stored xcomm (the one in `comm_request` was moved out).
                     it->second.on_message(
                         [this, id](xeus::xmessage msg) {
-                            json ev;
-                            ev["op"] = "msg";
-                            ev["id"] = std::string(id.c_str());
-                            ev["data"] = msg.content().value("data", nl::json::object());
-                            std::lock_guard<std::mutex> lock(m_comm_mutex);
-                            m_comm_event_queue.push(ev.dump());
+                            push_comm_event({comm_event::kind::msg, std::string(id.c_str()),
+                                             msg.content().value("data", nl::json::object()).dump()});
                         });
                     it->second.on_close(
                         [this, id](xeus::xmessage /* msg */) {
-                            json ev;
-                            ev["op"] = "close";
-                            ev["id"] = std::string(id.c_str());
-                            std::lock_guard<std::mutex> lock(m_comm_mutex);
-                            m_comm_event_queue.push(ev.dump());
-                            m_comms.erase(id);
+                            {
+                                std::lock_guard<std::mutex> lock(m_comm_mutex);
+                                m_comms.erase(id);
+                            }
+                            push_comm_event({comm_event::kind::close, std::string(id.c_str()), ""});
                         });
                 }
-                // Queue the open event with any payload the JS side sent.
-                json ev;
-                ev["op"] = "open";
-                ev["id"] = std::string(id.c_str());
-                ev["data"] = open_request.content().value("data", nl::json::object());
-                std::lock_guard<std::mutex> lock(m_comm_mutex);
-                m_comm_event_queue.push(ev.dump());
+                // Queue the open event. The JS frontend names the Lean
+                // session it wants in data.session.
+                auto data = open_request.content().value("data", nl::json::object());
+                std::string session = data.is_object() ? data.value("session", "") : "";
+                push_comm_event({comm_event::kind::open, std::string(id.c_str()), std::move(session)});
             });
     }
 
@@ -149,39 +559,92 @@ public:
                               const std::string& code,
                               xeus::execute_request_config config,
                               nl::json /* user_expressions */) override {
-        DEBUG_LOG("[C++ FFI] Execute request: " << code);
-
-        // Redirect stdout into a pipe so we can capture writes that go
-        // straight to fd 1 — including `IO.println` calls inside elab
-        // macros (e.g. Sparkle's `#synthesizeVerilog`) that bypass
-        // Lean's `withIsolatedStreams` capture in `#eval`. Stderr is
-        // intentionally left alone so XLEAN_DEBUG-style logs still
-        // reach the kernel terminal.
-        begin_stdout_capture();
-
-        // Queue this message for Lean to process
-        std::lock_guard<std::mutex> lock(m_message_mutex);
-
-        json msg;
-        msg["msg_type"] = "execute_request";
-        msg["content"]["code"] = code;
-        msg["content"]["execution_count"] = execution_count;
-
-        m_message_queue.push(msg.dump());
-        m_current_callback = cb;
+        DEBUG_LOG("Execute request: " << code);
+
+        kernel_request req;
+        req.k = kernel_request::kind::execute;
+        req.code = code;
+        req.execution_count = execution_count;
+
+        // Queue this message for Lean to process, then wake the Lean
+        // loop if it is parked in drain_events(). Several cells can be
+        // queued while one runs; Lean finishes them in submission order,
+        // so replies pop their callbacks FIFO.
+        {
+            std::lock_guard<std::mutex> lock(m_message_mutex);
+            m_reply_callbacks.push_back({std::move(cb), std::chrono::steady_clock::now()});
+        }
+        m_requests.push(std::move(req));
+        notify_lean_loop();
 
         // Don't send reply now - Lean will call send_result/send_error later
     }
 
-    nl::json complete_request_impl(const std::string& /* code */,
-                                   int /* cursor_pos */) override {
-        return xeus::create_complete_reply({}, 0, 0);
+    nl::json complete_request_impl(const std::string& code,
+                                   int cursor_pos) override {
+        // Answered entirely on this thread from the prefix index, so
+        // completion stays responsive even while a cell is elaborating.
+        std::size_t end = utf8_byte_offset(code, static_cast<std::size_t>(std::max(cursor_pos, 0)));
+        std::size_t start = lean_ident_start(code, end);
+        // `#eval`, `#check`, ...: the `#` is part of the keyword.
+        if (start > 0 && code[start - 1] == '#') --start;
+        std::string prefix = code.substr(start, end - start);
+        if (prefix.empty()) {
+            return xeus::create_complete_reply({}, cursor_pos, cursor_pos);
+        }
+
+        std::vector<std::string> matches = m_completions.lookup(prefix, MAX_COMPLETIONS);
+        for (const char* kw : LEAN_KEYWORDS) {
+            if (std::strncmp(kw, prefix.c_str(), prefix.size()) == 0) {
+                matches.emplace_back(kw);
+            }
+        }
+        DEBUG_LOG("complete '" << prefix << "': " << matches.size() << " matches");
+        int cursor_start = static_cast<int>(utf8_codepoint_count(code, start));
+        return xeus::create_complete_reply(nl::json(matches), cursor_start, cursor_pos);
     }
 
-    nl::json inspect_request_impl(const std::string& /* code */,
-                                  int /* cursor_pos */,
+    nl::json inspect_request_impl(const std::string& code,
+                                  int cursor_pos,
                                   int /* detail_level */) override {
-        return xeus::create_inspect_reply(false);
+        // Hover text is rendered by the Lean loop from the InfoTrees it
+        // retained for the cell (or, for source that was never run, by
+        // resolving the identifier under the cursor). Queue the request
+        // like an execute and wait a bounded time for the answer; if the
+        // loop is busy elaborating, report "nothing found" rather than
+        // stalling the shell channel.
+        std::size_t pos = utf8_byte_offset(code, static_cast<std::size_t>(std::max(cursor_pos, 0)));
+        std::size_t ident_begin = lean_ident_start(code, pos);
+        std::string ident = code.substr(ident_begin, lean_ident_end(code, ident_begin) - ident_begin);
+
+        kernel_request req;
+        req.k = kernel_request::kind::inspect;
+        req.code = code;
+        req.pos = pos;
+        req.ident = std::move(ident);
+
+        std::unique_lock<std::mutex> lock(m_inspect_mutex);
+        uint32_t id = ++m_inspect_seq;
+        req.id = id;
+        m_inspect_pending[id];
+        m_requests.push(std::move(req));
+        notify_lean_loop();
+
+        bool answered = m_inspect_cv.wait_for(lock, INSPECT_TIMEOUT, [this, id] {
+            return m_inspect_pending[id].has_value();
+        });
+        std::optional<std::string> text = std::move(m_inspect_pending[id]);
+        m_inspect_pending.erase(id);
+        lock.unlock();
+
+        if (!answered || !text || text->empty()) {
+            DEBUG_LOG("inspect: " << (answered ? "nothing found" : "timed out"));
+            return xeus::create_inspect_reply(false);
+        }
+        nl::json data;
+        data["text/markdown"] = *text;
+        data["text/plain"] = *text;
+        return xeus::create_inspect_reply(true, data);
     }
 
     nl::json is_complete_request_impl(const std::string& /* code */) override {
@@ -210,154 +673,235 @@ public:
     }
 
     void shutdown_request_impl() override {
-        DEBUG_LOG("[C++ FFI] Shutdown requested");
+        DEBUG_LOG("Shutdown requested");
         m_should_stop = true;
+        wake_lean_loop();
     }
 
     // Methods for Lean to call
-    std::string poll_message() {
-        DEBUG_LOG("[C++ FFI] poll_message called, this=" << (void*)this);
-        DEBUG_LOG("[C++ FFI] About to lock mutex at " << (void*)&m_message_mutex);
-        try {
+
+    /** Block until a request or comm event is queued, shutdown is
+        requested, or `timeout` elapses — whichever comes first — then
+        move up to `max` queued entries into the output vectors, comm
+        events first (they never depend on a pending execute). Returns
+        false when nothing was drained: the caller should then check
+        should_stop(). */
+    bool drain_events(std::chrono::milliseconds timeout, std::size_t max,
+                      std::vector<comm_event>& comms, std::vector<kernel_request>& requests) {
+        if (m_comm_events.empty() && m_requests.empty()) {
+            std::unique_lock<std::mutex> lock(m_message_mutex);
+            m_lean_waiting.store(true);
+            m_message_cv.wait_for(lock, timeout, [this] {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                return !m_comm_events.empty() || !m_requests.empty() ||
+                       m_wakeup_pending || m_should_stop;
+            });
+            m_lean_waiting.store(false);
+            m_wakeup_pending = false;
+        }
+
+        m_comm_stats.on_drain(m_comm_events.size());
+        m_request_stats.on_drain(m_requests.size());
+        std::chrono::steady_clock::time_point enqueued;
+        comm_event ev;
+        while (comms.size() + requests.size() < max && m_comm_events.try_pop(ev, enqueued)) {
+            m_comm_stats.on_pop(enqueued);
+            comms.push_back(std::move(ev));
+        }
+        kernel_request req;
+        while (comms.size() + requests.size() < max && m_requests.try_pop(req, enqueued)) {
+            m_request_stats.on_pop(enqueued);
+            requests.push_back(std::move(req));
+        }
+        return !comms.empty() || !requests.empty();
+    }
+
+    /** Depth and dwell-time counters for both queues, as JSON. */
+    json queue_stats() const {
+        return {
+            {"requests", m_request_stats.to_json(m_requests.size())},
+            {"comm", m_comm_stats.to_json(m_comm_events.size())},
+        };
+    }
+
+    /** Wake a Lean loop parked in drain_events() without queueing
+        anything (shutdown). Safe to call from any xeus thread. */
+    void wake_lean_loop() {
+        {
             std::lock_guard<std::mutex> lock(m_message_mutex);
-            DEBUG_LOG("[C++ FFI] Mutex locked successfully");
-            if (m_message_queue.empty()) {
-                return "";
-            }
-            std::string msg = m_message_queue.front();
-            m_message_queue.pop();
-            return msg;
-        } catch (const std::exception& e) {
-            DEBUG_LOG("[C++ FFI] Exception in poll_message: " << e.what());
-            throw;
+            m_wakeup_pending = true;
         }
+        m_message_cv.notify_one();
     }
 
-    void send_result(int execution_count, const std::string& result_json) {
+    void send_result(int execution_count, cell_result&& result) {
         try {
-            nl::json pub_data;
+            phase_timer timer;
+            // Stop the live stdout stream first. end_stdout_capture()
+            // joins the reader thread only after it has published every
+            // byte the cell wrote to fd 1, so elab-time prints land in
+            // the notebook above the result, in the order they happened.
+            end_stdout_capture();
+            timer.lap("stdout_drain");
+
+            // Render messages the way Lean's compiler does,
+            // `<line>:<col>: <severity>: <text>`, except plain info
+            // (`#eval` / `#check` output) which is shown bare, as users
+            // expect from a REPL.
+            std::string rendered;
+            for (auto& m : result.messages) {
+                if (!rendered.empty()) rendered += '\n';
+                if (m.sev == cell_message::info) {
+                    rendered += m.text;
+                    continue;
+                }
+                static const char* const SEVERITY[] = {"trace", "info", "warning", "error"};
+                rendered += std::to_string(m.line) + ":" + std::to_string(m.column) + ": ";
+                rendered += SEVERITY[std::min<uint8_t>(m.sev, cell_message::error)];
+                rendered += ": ";
+                rendered += m.text;
+            }
 
-            // Drain anything that elab-time IO.println wrote to fd 1
-            // since execute_request_impl began. This is what makes
-            // plain `IO.println "..."` from inside an `elab` macro
-            // appear in the cell output even though Lean's #eval
-            // capture path doesn't see it.
-            std::string captured = end_stdout_capture();
-
-            // First pass: pull MIME payloads (Display.html/.svg/.waveform/...)
-            // out of the captured stdout AND the result string, leaving
-            // ordinary `#eval` / `IO.println` text behind in `plain`.
-            //
-            // Both channels carry MIME markers in practice:
-            //   - `result_json` is what Lean's message log produced via
-            //     `logInfo` / `logInfoAt` (xeus-lean's `Display.html`
-            //     etc. all go through this path inside an `elab`).
-            //   - `captured` is whatever Lean's `IO.println` wrote
-            //     directly to stdout from inside an `elab`/`#eval`
-            //     command.  Downstream packages (e.g. Sparkle.Display)
-            //     emit MIME markers from `IO.println` so a single
-            //     `#eval Sparkle.Display.Diagram.blockDiagram d` can
-            //     produce a rendered SVG cell.  Without this scan
-            //     those bytes would be forwarded as raw text and the
-            //     marker would show up as a literal `MIME:image/...`
-            //     string.
-            std::string plain_captured;
-            extract_mime_payloads(captured, pub_data, plain_captured);
+            // Messages may still carry MIME payloads: `#html` & co. log
+            // their marker through `logInfoAt` inside an `elab`. Pull
+            // those out, leaving ordinary text behind in `plain`. Markers
+            // that downstream packages print straight to stdout (e.g.
+            // Sparkle.Display) are handled by the stream reader instead.
+            nl::json pub_data;
             std::string plain;
-            extract_mime_payloads(result_json, pub_data, plain);
-
-            // Prepend the (now MIME-stripped) captured stdout. We do
-            // this *before* the pre-formatted Lean messages so the
-            // order matches what happened: elab-time prints first,
-            // then the result text.
-            if (!plain_captured.empty()) {
-                if (!plain.empty() && plain_captured.back() != '\n') {
-                    plain_captured.push_back('\n');
-                }
-                plain = plain_captured + plain;
+            extract_mime_payloads(rendered, pub_data, plain);
+            timer.lap("render");
+
+            // `Display.emit` payloads arrive already split by mime type.
+            for (auto& [mime, payload] : result.displays) {
+                pub_data[mime] = std::move(payload);
             }
 
             if (!plain.empty()) {
                 // Trim a single trailing newline added by IO.println so the
                 // cell output isn't padded with an extra blank line.
                 if (plain.back() == '\n') plain.pop_back();
-                pub_data["text/plain"] = plain;
-            } else if (pub_data.empty()) {
-                // No MIME markers and no plain text — keep the legacy
-                // behavior of trying to parse the whole string as JSON
-                // (used by the older error-dump path; harmless otherwise).
-                try {
-                    auto result = json::parse(result_json);
-                    if (result.is_object() &&
-                        (result.contains("text/html") || result.contains("image/svg+xml"))) {
-                        pub_data = result;
-                    } else {
-                        pub_data["text/plain"] = result.is_string()
-                            ? result.get<std::string>() : result.dump(2);
-                    }
-                } catch (const json::parse_error&) {
-                    pub_data["text/plain"] = result_json;
-                }
+                pub_data["text/plain"] = std::move(plain);
             }
 
-            publish_execution_result(execution_count, std::move(pub_data), nl::json::object());
+            if (!pub_data.empty()) {
+                std::lock_guard<std::mutex> lock(m_publish_mutex);
+                publish_execution_result(execution_count, std::move(pub_data), nl::json::object());
+            }
+            timer.lap("publish");
+
+            // Lean-side phases first (a phase may repeat, e.g. once per
+            // %timeit run; sum them), then ours.
+            json& phases = timer.phases();
+            for (auto& [name, ns] : result.spans) {
+                phases[name] = phases.value(name, 0.0) + static_cast<double>(ns) / 1e6;
+            }
 
             // Send successful reply to callback
-            if (m_current_callback) {
-                m_current_callback(xeus::create_successful_reply());
-                m_current_callback = nullptr;
+            if (auto cb = take_reply_callback()) {
+                nl::json reply = xeus::create_successful_reply();
+                reply["xlean_timing"] = cell_timing(std::move(phases));
+                if (!result.snapshots.empty()) {
+                    reply["xlean_snapshots"] = nl::json::parse(result.snapshots, nullptr, false);
+                }
+                cb(std::move(reply));
             }
 
-            DEBUG_LOG("[C++ FFI] Result sent");
+            DEBUG_LOG("Result sent");
         } catch (const std::exception& e) {
-            std::cerr << "[C++ FFI] Error sending result: " << e.what() << std::endl;
+            XLEAN_LOG("ffi", error, "Error sending result: " << e.what());
         }
     }
 
-    void send_error(int execution_count, const std::string& error_json) {
+    void send_error(int execution_count, const std::string& error_msg) {
         try {
+            phase_timer timer;
             // Make sure we don't leak the fd 1 redirect into the next
-            // cell. We drop the captured bytes — error path already has
-            // a structured payload and there's no good place to slot
-            // raw stdout in.
-            (void)end_stdout_capture();
-
-            auto error = json::parse(error_json);
-            std::string error_msg = error.dump(2);
-
-            publish_execution_error("LeanError", error_msg, {error_msg});
+            // cell. Whatever the cell printed before failing has already
+            // been streamed, which is exactly what a user debugging the
+            // failure wants to see.
+            end_stdout_capture();
+            timer.lap("stdout_drain");
+
+            {
+                std::lock_guard<std::mutex> lock(m_publish_mutex);
+                publish_execution_error("LeanError", error_msg, {error_msg});
+            }
 
             // Send error reply to callback
-            if (m_current_callback) {
-                nl::json err_reply = xeus::create_error_reply(error_msg, "LeanError", nl::json::array());
-                m_current_callback(std::move(err_reply));
-                m_current_callback = nullptr;
+            timer.lap("publish");
+
+            if (auto cb = take_reply_callback()) {
+                nl::json reply = xeus::create_error_reply(error_msg, "LeanError", nl::json::array());
+                reply["xlean_timing"] = cell_timing(std::move(timer.phases()));
+                cb(std::move(reply));
             }
 
-            DEBUG_LOG("[C++ FFI] Error sent");
+            DEBUG_LOG("Error sent");
         } catch (const std::exception& e) {
-            std::cerr << "[C++ FFI] Error sending error: " << e.what() << std::endl;
+            XLEAN_LOG("ffi", error, "Error sending error: " << e.what());
         }
     }
 
     bool should_stop() const {
-        return m_should_stop;
+        return m_should_stop || g_stop_requested.load();
     }
 
-    /** Save fd 1, create a pipe, dup the write end onto fd 1. After
-        this returns, anything written to stdout (printf, fputs,
-        IO.println from Lean elab time, ...) goes into the pipe. Idempotent
-        within a single execute_request — calling twice is harmless because
-        we only set up the pipe if `m_stdout_pipe_r == -1`. */
+    /** A cell is starting: note when (and when its request arrived) for
+        its timing breakdown, then start capturing its stdout. */
+    void begin_cell() {
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(m_message_mutex);
+            m_cell_queued = m_reply_callbacks.empty() ? now : m_reply_callbacks.front().queued;
+        }
+        m_cell_started = now;
+        m_cell_heap_start = heap_in_use();
+        begin_stdout_capture();
+    }
+
+    /** `xlean_timing` for the running cell's execute_reply. xeus 5.2.6
+        hands the reply callback only the reply content, so the
+        breakdown rides in the content rather than the metadata. */
+    json cell_timing(json phases) const {
+        using ms = std::chrono::duration<double, std::milli>;
+        auto now = std::chrono::steady_clock::now();
+        json t = {
+            {"wall_ms", ms(now - m_cell_started).count()},
+            {"queued_ms", ms(m_cell_started - m_cell_queued).count()},
+            {"phases_ms", std::move(phases)},
+        };
+        long long heap = heap_in_use();
+        if (heap >= 0 && m_cell_heap_start >= 0) {
+            t["heap_delta_bytes"] = heap - m_cell_heap_start;
+        }
+        return t;
+    }
+
+    /** Save fd 1, create a pipe, dup the write end onto fd 1 and start
+        the stream reader thread on the read end. After this returns,
+        anything written to stdout (printf, fputs, IO.println from Lean
+        elab time, ...) is published to iopub as `stream` messages while
+        the cell runs — including writes from elab macros (e.g. Sparkle's
+        `#synthesizeVerilog`) that bypass Lean's `withIsolatedStreams`
+        capture in `#eval`. Stderr is intentionally left alone so
+        XLEAN_DEBUG-style logs still reach the kernel terminal.
+
+        Called through xeus_kernel_begin_cell when a cell actually starts,
+        not when it is queued, so a queued cell's capture cannot swallow
+        the output of the cell running ahead of it. Idempotent — calling
+        twice is harmless because we only set up the pipe if
+        `m_stdout_pipe_r == -1`. */
     void begin_stdout_capture() {
         if (m_stdout_pipe_r != -1) return;  // already capturing
         int p[2];
         if (pipe(p) != 0) {
-            DEBUG_LOG("[C++ FFI] pipe() failed; skipping stdout capture");
+            DEBUG_LOG("pipe() failed; skipping stdout capture");
             return;
         }
-        // Make the read end non-blocking so end_stdout_capture's drain
-        // returns instead of waiting for EOF.
+        // Non-blocking read end: the reader poll()s with a timeout so it
+        // can flush batches on time and notice end_stdout_capture even
+        // if a child process still holds the write end open.
         int flags = fcntl(p[0], F_GETFL, 0);
         fcntl(p[0], F_SETFL, flags | O_NONBLOCK);
         m_saved_stdout_fd = dup(STDOUT_FILENO);
@@ -366,45 +910,140 @@ public:
             return;
         }
         // Make sure C stdout buffer is flushed before we redirect, so the
-        // captured bytes really come from this cell.
+        // captured bytes really come from this cell. Unbuffered while
+        // capturing: every write, partial lines from `IO.print` included,
+        // reaches the pipe at once, and nobody but the cell thread ever
+        // needs the stdio lock (the reader must never wait on a writer
+        // that is itself blocked on the full pipe).
         std::fflush(stdout);
+        std::setvbuf(stdout, nullptr, _IONBF, 0);
         dup2(p[1], STDOUT_FILENO);
         close(p[1]);
         m_stdout_pipe_r = p[0];
+        m_stdout_stop = false;
+        m_stdout_reader = std::thread([this, fd = p[0]] { stdout_reader_loop(fd); });
     }
 
-    /** Drain the pipe, restore fd 1, close the pipe. Returns whatever
-        was buffered. Empty string if capture wasn't active. */
-    std::string end_stdout_capture() {
-        if (m_stdout_pipe_r == -1) return "";
+    /** Restore fd 1, tell the reader to drain what is left, and join
+        it. Everything the cell wrote has been published when this
+        returns. No-op if capture wasn't active. */
+    void end_stdout_capture() {
+        if (m_stdout_pipe_r == -1) return;
         // Flush anything Lean's runtime still has in C-level buffers
-        // before we yank the fd back.
+        // before we yank the fd back, then go back to line buffering.
         std::fflush(stdout);
-        std::string out;
-        char buf[4096];
-        while (true) {
-            ssize_t n = read(m_stdout_pipe_r, buf, sizeof(buf));
-            if (n > 0) out.append(buf, buf + n);
-            else break;
-        }
-        // Restore the real stdout.
+        std::setvbuf(stdout, nullptr, _IOLBF, BUFSIZ);
+        // Restoring fd 1 drops the last write end we hold, so the reader
+        // normally sees EOF; the stop flag covers stray child processes
+        // that inherited it.
         if (m_saved_stdout_fd >= 0) {
             dup2(m_saved_stdout_fd, STDOUT_FILENO);
             close(m_saved_stdout_fd);
             m_saved_stdout_fd = -1;
         }
+        m_stdout_stop = true;
+        if (m_stdout_reader.joinable()) m_stdout_reader.join();
         close(m_stdout_pipe_r);
         m_stdout_pipe_r = -1;
-        return out;
     }
 
-    /** Pop one queued comm event (open/msg/close) as JSON, or "" if empty. */
-    std::string poll_comm() {
-        std::lock_guard<std::mutex> lock(m_comm_mutex);
-        if (m_comm_event_queue.empty()) return "";
-        std::string ev = m_comm_event_queue.front();
-        m_comm_event_queue.pop();
-        return ev;
+    /** Body of the stdout reader thread. Drains the pipe as data
+        arrives and publishes it in batches: plain text is held until
+        STREAM_BATCH_BYTES accumulate or STREAM_BATCH_MS pass since the
+        first unpublished byte, so a tight IO.println loop becomes a
+        handful of iopub messages instead of one per line. Complete MIME
+        payloads are published as display_data as soon as they close. */
+    void stdout_reader_loop(int fd) {
+        using clock = std::chrono::steady_clock;
+        static constexpr std::size_t STREAM_BATCH_BYTES = 16 * 1024;
+        static constexpr auto STREAM_BATCH_MS = std::chrono::milliseconds(50);
+
+        mime_stream_splitter splitter;
+        std::string batch;
+        clock::time_point batch_started;
+        char buf[16 * 1024];
+        bool eof = false;
+
+        auto flush_batch = [&] {
+            if (batch.empty()) return;
+            publish_stdout_chunk("", batch);
+            batch.clear();
+        };
+
+        while (true) {
+            int timeout_ms = static_cast<int>(STREAM_BATCH_MS.count());
+            if (!batch.empty()) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    batch_started + STREAM_BATCH_MS - clock::now()).count();
+                timeout_ms = static_cast<int>(std::max<long long>(0, left));
+            }
+            pollfd pfd{fd, POLLIN, 0};
+            if (!eof && poll(&pfd, 1, timeout_ms) > 0) {
+                while (true) {
+                    ssize_t n = read(fd, buf, sizeof(buf));
+                    if (n > 0) { splitter.feed(buf, static_cast<std::size_t>(n)); continue; }
+                    if (n == 0) eof = true;
+                    break;
+                }
+            }
+            bool done = eof || m_stdout_stop;
+            if (done && !eof) {
+                // One last non-blocking sweep for bytes written between
+                // the final poll and the stop flag.
+                ssize_t n;
+                while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                    splitter.feed(buf, static_cast<std::size_t>(n));
+                }
+            }
+
+            for (auto& c : splitter.take(done)) {
+                if (!c.mime.empty()) {
+                    flush_batch();
+                    publish_stdout_chunk(c.mime, c.text);
+                    continue;
+                }
+                if (batch.empty()) batch_started = clock::now();
+                batch += c.text;
+            }
+            if (done || batch.size() >= STREAM_BATCH_BYTES ||
+                (!batch.empty() && clock::now() - batch_started >= STREAM_BATCH_MS)) {
+                flush_batch();
+            }
+            if (done) return;
+        }
+    }
+
+    /** Publish one chunk from the stdout stream: plain text (empty
+        `mime`) as a `stream` message, a MIME payload as display_data. */
+    void publish_stdout_chunk(const std::string& mime, const std::string& text) {
+        try {
+            std::lock_guard<std::mutex> lock(m_publish_mutex);
+            if (mime.empty()) {
+                publish_stream("stdout", text);
+            } else {
+                nl::json bundle;
+                bundle[mime] = text;
+                display_data(std::move(bundle), nl::json::object(), nl::json::object());
+            }
+        } catch (const std::exception& e) {
+            XLEAN_LOG("ffi", error, "stdout stream publish failed: " << e.what());
+        }
+    }
+
+    /** The tab-completion index; the Lean loop feeds it names through
+        the xeus_kernel_completion_* calls below. */
+    completion_index& completions() { return m_completions; }
+
+    // Lean's answer to inspect request `id` ("" when nothing was found).
+    // Answers to requests that already timed out are dropped.
+    void send_inspect(uint32_t id, const std::string& text) {
+        {
+            std::lock_guard<std::mutex> lock(m_inspect_mutex);
+            auto it = m_inspect_pending.find(id);
+            if (it == m_inspect_pending.end()) return;
+            it->second = text;
+        }
+        m_inspect_cv.notify_all();
     }
 
     /**
@@ -425,26 +1064,99 @@ public:
             it->second.send(nl::json::object(), std::move(data), {});
             return true;
         } catch (const std::exception& e) {
-            DEBUG_LOG("[C++ FFI] send_comm failed: " << e.what());
+            DEBUG_LOG("send_comm failed: " << e.what());
             return false;
         }
     }
 
 private:
-    std::queue<std::string> m_message_queue;
+    void push_comm_event(comm_event&& ev) {
+        m_comm_events.push(std::move(ev));
+        notify_lean_loop();
+    }
+
+    // The oldest pending execute reply callback, if any.
+    send_reply_callback take_reply_callback() {
+        std::lock_guard<std::mutex> lock(m_message_mutex);
+        if (m_reply_callbacks.empty()) return nullptr;
+        send_reply_callback cb = std::move(m_reply_callbacks.front().cb);
+        m_reply_callbacks.pop_front();
+        return cb;
+    }
+
+    // Called after a push. The mutex is only taken when the Lean loop
+    // is actually parked: a burst of comm messages while Lean is busy
+    // costs one CAS each. The seq_cst fence pairs with the one in
+    // drain_events' predicate, so either the consumer sees the new
+    // entry or we see it waiting.
+    void notify_lean_loop() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_lean_waiting.load()) wake_lean_loop();
+    }
+
+    // Requests (execute, inspect) and comm events, pushed by xeus
+    // threads and drained in batches by the Lean loop.
+    mpsc_ring<kernel_request> m_requests{1024};
+    mpsc_ring<comm_event> m_comm_events{16384};
+    queue_stats m_request_stats;
+    queue_stats m_comm_stats;
+
+    // Parking for the Lean loop when both rings are empty. Signalled on
+    // enqueue and shutdown so the loop reacts immediately instead of
+    // sleeping out its timeout.
     std::mutex m_message_mutex;
-    bool m_should_stop = false;
-    send_reply_callback m_current_callback;
+    std::condition_variable m_message_cv;
+    std::atomic<bool> m_lean_waiting{false};
+    bool m_wakeup_pending = false;
+    std::atomic<bool> m_should_stop{false};
+    // Reply callbacks of queued and running execute requests, oldest
+    // first, with the time each request arrived.
+    struct pending_reply {
+        send_reply_callback cb;
+        std::chrono::steady_clock::time_point queued;
+    };
+    std::deque<pending_reply> m_reply_callbacks;
+
+    // Timing of the running cell, set by begin_cell() and reported in
+    // the `xlean_timing` field of its execute_reply.
+    std::chrono::steady_clock::time_point m_cell_queued;
+    std::chrono::steady_clock::time_point m_cell_started;
+    long long m_cell_heap_start = -1;
 
     // Comm channels we've taken ownership of. Keyed by guid; the xcomm
     // value lives here so its on_message handler stays alive across calls.
     std::map<xeus::xguid, xeus::xcomm> m_comms;
-    std::queue<std::string> m_comm_event_queue;
     std::mutex m_comm_mutex;
 
     // Stdout fd-capture machinery. -1 when no capture is active.
     int m_stdout_pipe_r = -1;
     int m_saved_stdout_fd = -1;
+    std::thread m_stdout_reader;
+    std::atomic<bool> m_stdout_stop{false};
+
+    // Constant names for complete_request, fed by the Lean loop.
+    completion_index m_completions;
+    static constexpr std::size_t MAX_COMPLETIONS = 200;
+    static constexpr const char* LEAN_KEYWORDS[] = {
+        "abbrev", "axiom", "by", "calc", "class", "def", "deriving", "do",
+        "else", "end", "example", "fun", "have", "if", "import", "inductive",
+        "instance", "let", "match", "namespace", "noncomputable", "open",
+        "private", "protected", "section", "show", "structure", "theorem",
+        "then", "universe", "variable", "where", "with",
+        "#check", "#eval", "#print", "#reduce", "#synth",
+    };
+
+    // Inspect requests waiting for the Lean loop, keyed by request id.
+    // An empty optional means "not answered yet".
+    std::mutex m_inspect_mutex;
+    std::condition_variable m_inspect_cv;
+    std::map<uint32_t, std::optional<std::string>> m_inspect_pending;
+    uint32_t m_inspect_seq = 0;
+    static constexpr std::chrono::milliseconds INSPECT_TIMEOUT{2000};
+
+    // Serializes our iopub publishes: the stdout reader thread and the
+    // Lean thread (send_result / send_error) both publish.
+    std::mutex m_publish_mutex;
 };
 
 // Global kernel state
@@ -455,14 +1167,192 @@ struct KernelState {
     std::thread kernel_thread;
 };
 
+// Kernel interrupts. The kernelspecs (share/jupyter/kernels/xlean,
+// scripts/install-kernelspec.sh) declare `interrupt_mode: signal`, so
+// Jupyter delivers an interrupt as SIGINT to this process (without a
+// handler that would kill the kernel and every env snapshot with it).
+// A control-channel interrupt_request is not handled. Interrupts reach
+// the elaborator and kernel checks only: a compiled `#eval` loop never
+// looks at the token and runs to completion.
+// The handler only does async-signal-safe work: raise a flag and write
+// a byte to a self-pipe, which wakes the Lean-side watcher blocked in
+// wait_interrupt(). The watcher then trips the running cell's
+// IO.CancelToken.
+std::atomic<bool> g_interrupt_pending{false};
+int g_interrupt_pipe[2] = {-1, -1};
+
+void on_sigterm(int /* signo */) {
+    g_stop_requested.store(true);
+}
+
+void on_sigint(int /* signo */) {
+    int saved_errno = errno;
+    g_interrupt_pending.store(true);
+    if (g_interrupt_pipe[1] >= 0) {
+        char b = 1;
+        (void)!write(g_interrupt_pipe[1], &b, 1);
+    }
+    errno = saved_errno;
+}
+
+/** Create the self-pipe and install the SIGINT and SIGTERM handlers. Safe to call
+    more than once; only the first call does anything. */
+void install_interrupt_handler() {
+    if (g_interrupt_pipe[0] != -1) return;
+    if (pipe(g_interrupt_pipe) != 0) {
+        XLEAN_LOG("ffi", warn, "pipe() failed; kernel interrupts disabled");
+        return;
+    }
+    for (int fd : g_interrupt_pipe) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    struct sigaction sa {};
+    sa.sa_handler = on_sigint;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, nullptr);
+    sa.sa_handler = on_sigterm;
+    sigaction(SIGTERM, &sa, nullptr);
+    sigaction(SIGHUP, &sa, nullptr);
+    DEBUG_LOG("SIGINT and SIGTERM handlers installed");
+}
+
+/** Wait up to `timeout_ms` for the self-pipe to become readable, drain
+    it, and report (and clear) whether an interrupt is pending. A wakeup
+    without a pending interrupt (wake_interrupt_waiter) returns false. */
+bool wait_interrupt(int timeout_ms) {
+    if (g_interrupt_pipe[0] < 0) return false;
+    pollfd pfd{g_interrupt_pipe[0], POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        char buf[64];
+        while (read(g_interrupt_pipe[0], buf, sizeof(buf)) > 0) {}
+    }
+    return g_interrupt_pending.exchange(false);
+}
+
+void wake_interrupt_waiter() {
+    if (g_interrupt_pipe[1] < 0) return;
+    char b = 0;
+    (void)!write(g_interrupt_pipe[1], &b, 1);
+}
+
 }  // namespace
 
 // Memory management for Lean external objects
+static lean_object* lean_mk_std_string(const std::string& s) {
+    return lean_mk_string_from_bytes(s.data(), s.size());
+}
+
+static std::string lean_std_string(b_lean_obj_arg s) {
+    return std::string(lean_string_cstr(s), lean_string_size(s) - 1);
+}
+
+// Build a `XeusKernel.KernelRequest`. Object fields come first in
+// declaration order, then scalar fields:
+//   execute (code : String) (executionCount : UInt32)         tag 0
+//   inspect (id : UInt32) (code : String) (pos : Nat) (ident : String)  tag 1
+static lean_object* to_lean_request(const kernel_request& req) {
+    switch (req.k) {
+    case kernel_request::kind::execute: {
+        lean_object* o = lean_alloc_ctor(0, 1, sizeof(uint32_t));
+        lean_ctor_set(o, 0, lean_mk_std_string(req.code));
+        lean_ctor_set_uint32(o, sizeof(void*) * 1, static_cast<uint32_t>(req.execution_count));
+        return o;
+    }
+    case kernel_request::kind::inspect: {
+        lean_object* o = lean_alloc_ctor(1, 3, sizeof(uint32_t));
+        lean_ctor_set(o, 0, lean_mk_std_string(req.code));
+        lean_ctor_set(o, 1, lean_usize_to_nat(req.pos));
+        lean_ctor_set(o, 2, lean_mk_std_string(req.ident));
+        lean_ctor_set_uint32(o, sizeof(void*) * 3, req.id);
+        return o;
+    }
+    }
+    return lean_box(0);
+}
+
+// Build a `XeusKernel.KernelEvent` for a comm event. Tag 0 is
+// `request`; the comm constructors follow in declaration order:
+//   commOpen (id session : String)   tag 1
+//   commMsg (id data : String)       tag 2
+//   commClose (id : String)          tag 3
+static lean_object* to_lean_comm_event(const comm_event& ev) {
+    lean_object* o = nullptr;
+    switch (ev.k) {
+    case comm_event::kind::open:
+        o = lean_alloc_ctor(1, 2, 0);
+        lean_ctor_set(o, 1, lean_mk_std_string(ev.payload));
+        break;
+    case comm_event::kind::msg:
+        o = lean_alloc_ctor(2, 2, 0);
+        lean_ctor_set(o, 1, lean_mk_std_string(ev.payload));
+        break;
+    case comm_event::kind::close:
+        o = lean_alloc_ctor(3, 1, 0);
+        break;
+    }
+    lean_ctor_set(o, 0, lean_mk_std_string(ev.id));
+    return o;
+}
+
+// Read a borrowed `XeusKernel.CellResult`:
+//   structure CellMessage where line column : UInt32; severity : Severity; text : String
+//   structure CellSpan where name : String; nanos : UInt64
+//   structure CellResult where
+//     messages : Array CellMessage; displays : Array (String × String); spans : Array CellSpan;
+//     snapshots : String
+// CellMessage has one object field (text); its scalars are laid out
+// largest first: line @0, column @4, severity @8. CellSpan has one
+// object field (name) and nanos @0.
+static cell_result cell_result_of_lean(b_lean_obj_arg obj) {
+    cell_result out;
+    lean_object* msgs = lean_ctor_get(obj, 0);
+    lean_object* displays = lean_ctor_get(obj, 1);
+    lean_object* spans = lean_ctor_get(obj, 2);
+    out.snapshots = lean_std_string(lean_ctor_get(obj, 3));
+    out.messages.reserve(lean_array_size(msgs));
+    for (std::size_t i = 0; i < lean_array_size(msgs); ++i) {
+        lean_object* m = lean_array_get_core(msgs, i);
+        cell_message cm;
+        cm.text = lean_std_string(lean_ctor_get(m, 0));
+        cm.line = lean_ctor_get_uint32(m, sizeof(void*) * 1);
+        cm.column = lean_ctor_get_uint32(m, sizeof(void*) * 1 + 4);
+        cm.sev = lean_ctor_get_uint8(m, sizeof(void*) * 1 + 8);
+        out.messages.push_back(std::move(cm));
+    }
+    out.displays.reserve(lean_array_size(displays));
+    for (std::size_t i = 0; i < lean_array_size(displays); ++i) {
+        lean_object* pair = lean_array_get_core(displays, i);
+        out.displays.emplace_back(lean_std_string(lean_ctor_get(pair, 0)),
+                                  lean_std_string(lean_ctor_get(pair, 1)));
+    }
+    out.spans.reserve(lean_array_size(spans));
+    for (std::size_t i = 0; i < lean_array_size(spans); ++i) {
+        lean_object* sp = lean_array_get_core(spans, i);
+        out.spans.emplace_back(lean_std_string(lean_ctor_get(sp, 0)),
+                               lean_ctor_get_uint64(sp, sizeof(void*) * 1));
+    }
+    return out;
+}
+
+// Copy a borrowed `Array String` into a vector.
+static std::vector<std::string> string_array_to_vector(b_lean_obj_arg arr) {
+    std::vector<std::string> out;
+    std::size_t n = lean_array_size(arr);
+    out.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        lean_object* s = lean_array_get_core(arr, i);
+        out.emplace_back(lean_string_cstr(s), lean_string_size(s) - 1);
+    }
+    return out;
+}
+
 extern "C" {
 
 // Finalizer called by Lean's GC when KernelHandle is collected
 extern "C" void finalize_kernel_state(void* ptr) {
-    DEBUG_LOG("[C++ FFI] Finalizing kernel state");
+    DEBUG_LOG("Finalizing kernel state");
     auto* state = static_cast<KernelState*>(ptr);
 
     // Stop and join kernel thread
@@ -479,12 +1369,12 @@ static lean_external_class* g_kernel_state_class = nullptr;
 
 static lean_external_class* get_kernel_state_class() {
     if (g_kernel_state_class == nullptr) {
-        DEBUG_LOG("[C++ FFI] About to call lean_register_external_class, finalizer=" << (void*)finalize_kernel_state);
+        DEBUG_LOG("About to call lean_register_external_class, finalizer=" << (void*)finalize_kernel_state);
         g_kernel_state_class = lean_register_external_class(
             finalize_kernel_state,  // finalizer
             nullptr                  // foreach (not needed)
         );
-        DEBUG_LOG("[C++ FFI] lean_register_external_class returned: " << (void*)g_kernel_state_class);
+        DEBUG_LOG("lean_register_external_class returned: " << (void*)g_kernel_state_class);
     }
     return g_kernel_state_class;
 }
@@ -498,20 +1388,20 @@ static inline KernelState* to_kernel_state(lean_object* obj) {
 
 // Initialize the FFI (must be called before using the kernel)
 lean_object* xeus_ffi_initialize(lean_object* /* world */) {
-    DEBUG_LOG("[C++ FFI] Initializing FFI, registering external class");
+    DEBUG_LOG("Initializing FFI, registering external class");
     // Force registration of the external class
     get_kernel_state_class();
-    DEBUG_LOG("[C++ FFI] FFI initialized");
+    DEBUG_LOG("FFI initialized");
     return lean_io_result_mk_ok(lean_box(0));
 }
 
 // Initialize kernel
 lean_object* xeus_kernel_init(lean_object* connection_file_obj, lean_object* /* world */) {
-    DEBUG_LOG("[C++ FFI] xeus_kernel_init called");
+    DEBUG_LOG("xeus_kernel_init called");
     try {
         std::string connection_file = lean_string_cstr(connection_file_obj);
 
-        DEBUG_LOG("[C++ FFI] Initializing kernel with: " << connection_file);
+        DEBUG_LOG("Initializing kernel with: " << connection_file);
 
         // Load configuration
         xeus::xconfiguration config = xeus::load_configuration(connection_file);
@@ -525,10 +1415,10 @@ lean_object* xeus_kernel_init(lean_object* connection_file_obj, lean_object* /*
         // Create interpreter as unique_ptr for kernel to own
         auto interpreter_ptr = std::make_unique<lean_interpreter>();
         state->interpreter = interpreter_ptr.get();  // Keep raw pointer for our use
-        DEBUG_LOG("[C++ FFI] Created interpreter at " << (void*)state->interpreter);
+        DEBUG_LOG("Created interpreter at " << (void*)state->interpreter);
 
         // Create kernel (takes ownership of interpreter)
-        DEBUG_LOG("[C++ FFI] Creating xkernel with interpreter at " << (void*)interpreter_ptr.get());
+        DEBUG_LOG("Creating xkernel with interpreter at " << (void*)interpreter_ptr.get());
         state->kernel = std::make_unique<xeus::xkernel>(
             config,
             xeus::get_user_name(),
@@ -536,77 +1426,98 @@ lean_object* xeus_kernel_init(lean_object* connection_file_obj, lean_object* /*
             std::move(interpreter_ptr),  // Kernel takes ownership
             xeus::make_xserver_default
         );
-        DEBUG_LOG("[C++ FFI] xkernel created, interpreter pointer in state: " << (void*)state->interpreter);
+        DEBUG_LOG("xkernel created, interpreter pointer in state: " << (void*)state->interpreter);
 
         // Start kernel in background thread
         state->kernel_thread = std::thread([kernel_ptr = state->kernel.get()]() {
-            DEBUG_LOG("[C++ FFI] Kernel thread started");
+            DEBUG_LOG("Kernel thread started");
             kernel_ptr->start();
-            DEBUG_LOG("[C++ FFI] Kernel thread stopped");
+            DEBUG_LOG("Kernel thread stopped");
         });
 
+        install_interrupt_handler();
+
         // Give kernel time to start
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
         // Return handle as external object (Lean's GC will manage it)
-        DEBUG_LOG("[C++ FFI] Creating external object for kernel state at " << (void*)state);
-        DEBUG_LOG("[C++ FFI] About to call get_kernel_state_class()");
+        DEBUG_LOG("Creating external object for kernel state at " << (void*)state);
+        DEBUG_LOG("About to call get_kernel_state_class()");
         auto* ext_class = get_kernel_state_class();
-        DEBUG_LOG("[C++ FFI] External class: " << (void*)ext_class);
+        DEBUG_LOG("External class: " << (void*)ext_class);
 
         if (ext_class == nullptr) {
-            std::cerr << "[C++ FFI] ERROR: External class is null!" << std::endl;
+            XLEAN_LOG("ffi", error, "external class is null");
             throw std::runtime_error("External class registration failed");
         }
 
-        DEBUG_LOG("[C++ FFI] About to call lean_alloc_external");
+        DEBUG_LOG("About to call lean_alloc_external");
         lean_object* handle = lean_alloc_external(ext_class, state);
-        DEBUG_LOG("[C++ FFI] External object created: " << (void*)handle);
+        DEBUG_LOG("External object created: " << (void*)handle);
 
         lean_object* some_result = lean_alloc_ctor(1, 1, 0);  // some
         lean_ctor_set(some_result, 0, handle);
-        DEBUG_LOG("[C++ FFI] Returning Some(handle)");
+        DEBUG_LOG("Returning Some(handle)");
 
         return lean_io_result_mk_ok(some_result);
 
     } catch (const std::exception& e) {
-        std::cerr << "[C++ FFI] Kernel init failed: " << e.what() << std::endl;
+        XLEAN_LOG("ffi", error, "Kernel init failed: " << e.what());
 
         lean_object* none_result = lean_box(0);  // none
         return lean_io_result_mk_ok(none_result);
     }
 }
 
-// Poll for messages
-lean_object* xeus_kernel_poll(lean_object* handle_obj, uint32_t timeout_ms, lean_object* /* world */) {
+// Wait up to `timeout_ms` for requests or comm events, then return up
+// to `max` of them as an `Array XeusKernel.KernelEvent` (comm events
+// first). Returns #[] on timeout or a bare wakeup (shutdown).
+lean_object* xeus_kernel_poll_batch(lean_object* handle_obj, uint32_t timeout_ms, uint32_t max,
+                                    lean_object* /* world */) {
     try {
         auto* state = to_kernel_state(handle_obj);
 
-        DEBUG_LOG("[C++ FFI] Poll: state=" << (void*)state << ", interpreter=" << (void*)state->interpreter);
-
         if (!state || !state->interpreter) {
-            DEBUG_LOG("[C++ FFI] Poll: Invalid state or interpreter");
-            return lean_io_result_mk_ok(lean_mk_string(""));
+            DEBUG_LOG("Poll: Invalid state or interpreter");
+            return lean_io_result_mk_ok(lean_mk_empty_array());
         }
 
-        // Poll for message
-        DEBUG_LOG("[C++ FFI] Calling poll_message on interpreter");
-        std::string msg = state->interpreter->poll_message();
-
-        if (msg.empty()) {
-            // Small delay
-            std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+        std::vector<comm_event> comms;
+        std::vector<kernel_request> requests;
+        state->interpreter->drain_events(std::chrono::milliseconds(timeout_ms),
+                                         std::max<uint32_t>(max, 1), comms, requests);
+        if (comms.empty() && requests.empty()) {
+            return lean_io_result_mk_ok(lean_mk_empty_array());
         }
 
-        lean_object* result = lean_mk_string(msg.c_str());
-        return lean_io_result_mk_ok(result);
+        DEBUG_LOG("Poll: drained " << comms.size() << " comm event(s), "
+                  << requests.size() << " request(s)");
+        lean_object* arr = lean_mk_empty_array_with_capacity(lean_box(comms.size() + requests.size()));
+        for (const auto& ev : comms) {
+            arr = lean_array_push(arr, to_lean_comm_event(ev));
+        }
+        for (const auto& req : requests) {
+            lean_object* ev = lean_alloc_ctor(0, 1, 0);  // KernelEvent.request
+            lean_ctor_set(ev, 0, to_lean_request(req));
+            arr = lean_array_push(arr, ev);
+        }
+        return lean_io_result_mk_ok(arr);
 
     } catch (const std::exception& e) {
-        std::cerr << "[C++ FFI] Poll failed: " << e.what() << std::endl;
-        return lean_io_result_mk_ok(lean_mk_string(""));
+        XLEAN_LOG("ffi", error, "Poll failed: " << e.what());
+        return lean_io_result_mk_ok(lean_mk_empty_array());
     }
 }
 
+// Queue depth and dwell-time counters for the request and comm queues,
+// as a JSON object string.
+lean_object* xeus_kernel_queue_stats(lean_object* handle_obj, lean_object* /* world */) {
+    auto* state = to_kernel_state(handle_obj);
+    std::string stats = state && state->interpreter
+        ? state->interpreter->queue_stats().dump() : "{}";
+    return lean_io_result_mk_ok(lean_mk_std_string(stats));
+}
+
 // Send result
 lean_object* xeus_kernel_send_result(lean_object* handle_obj, uint32_t exec_count,
                                      lean_object* result_obj, lean_object* /* world */) {
@@ -614,15 +1525,14 @@ lean_object* xeus_kernel_send_result(lean_object* handle_obj, uint32_t exec_coun
         auto* state = to_kernel_state(handle_obj);
 
         if (state && state->interpreter) {
-            std::string result = lean_string_cstr(result_obj);
-            state->interpreter->send_result(exec_count, result);
+            state->interpreter->send_result(exec_count, cell_result_of_lean(result_obj));
         }
 
         lean_object* unit = lean_box(0);
         return lean_io_result_mk_ok(unit);
 
     } catch (const std::exception& e) {
-        std::cerr << "[C++ FFI] Send result failed: " << e.what() << std::endl;
+        XLEAN_LOG("ffi", error, "Send result failed: " << e.what());
         lean_object* unit = lean_box(0);
         return lean_io_result_mk_ok(unit);
     }
@@ -635,15 +1545,14 @@ lean_object* xeus_kernel_send_error(lean_object* handle_obj, uint32_t exec_count
         auto* state = to_kernel_state(handle_obj);
 
         if (state && state->interpreter) {
-            std::string error = lean_string_cstr(error_obj);
-            state->interpreter->send_error(exec_count, error);
+            state->interpreter->send_error(exec_count, lean_std_string(error_obj));
         }
 
         lean_object* unit = lean_box(0);
         return lean_io_result_mk_ok(unit);
 
     } catch (const std::exception& e) {
-        std::cerr << "[C++ FFI] Send error failed: " << e.what() << std::endl;
+        XLEAN_LOG("ffi", error, "Send error failed: " << e.what());
         lean_object* unit = lean_box(0);
         return lean_io_result_mk_ok(unit);
     }
@@ -664,28 +1573,12 @@ lean_object* xeus_kernel_should_stop(lean_object* handle_obj, lean_object* /* wo
         return lean_io_result_mk_ok(result);
 
     } catch (const std::exception& e) {
-        std::cerr << "[C++ FFI] Should stop check failed: " << e.what() << std::endl;
+        XLEAN_LOG("ffi", error, "Should stop check failed: " << e.what());
         lean_object* result = lean_box(0);
         return lean_io_result_mk_ok(result);
     }
 }
 
-// Pop one queued comm event ({op:"open"|"msg"|"close",id:..,data?:..}) as JSON.
-// Returns "" when the queue is empty.
-lean_object* xeus_kernel_poll_comm(lean_object* handle_obj, lean_object* /* world */) {
-    try {
-        auto* state = to_kernel_state(handle_obj);
-        std::string ev;
-        if (state && state->interpreter) {
-            ev = state->interpreter->poll_comm();
-        }
-        return lean_io_result_mk_ok(lean_mk_string(ev.c_str()));
-    } catch (const std::exception& e) {
-        std::cerr << "[C++ FFI] poll_comm failed: " << e.what() << std::endl;
-        return lean_io_result_mk_ok(lean_mk_string(""));
-    }
-}
-
 // Send a JSON message to the JS side over a previously-opened comm channel.
 // Returns 1 on success, 0 if the comm id is unknown or send failed.
 lean_object* xeus_kernel_send_comm(lean_object* handle_obj,
@@ -702,9 +1595,388 @@ lean_object* xeus_kernel_send_comm(lean_object* handle_obj,
         }
         return lean_io_result_mk_ok(lean_box(ok ? 1 : 0));
     } catch (const std::exception& e) {
-        std::cerr << "[C++ FFI] send_comm failed: " << e.what() << std::endl;
+        XLEAN_LOG("ffi", error, "send_comm failed: " << e.what());
         return lean_io_result_mk_ok(lean_box(0));
     }
 }
 
+// Block up to `timeout_ms` waiting for a kernel interrupt (SIGINT).
+// Returns 1 if one arrived since the last call, 0 on timeout or when
+// woken by xeus_kernel_wake_interrupt_waiter. A zero timeout just
+// discards interrupts that arrived while no cell was running.
+lean_object* xeus_kernel_wait_interrupt(lean_object* /* handle_obj */, uint32_t timeout_ms,
+                                        lean_object* /* world */) {
+    bool hit = wait_interrupt(static_cast<int>(timeout_ms));
+    return lean_io_result_mk_ok(lean_box(hit ? 1 : 0));
+}
+
+// Wake a thread blocked in xeus_kernel_wait_interrupt without raising an
+// interrupt. Called when a cell finishes so its watcher exits promptly.
+lean_object* xeus_kernel_wake_interrupt_waiter(lean_object* /* handle_obj */,
+                                               lean_object* /* world */) {
+    wake_interrupt_waiter();
+    return lean_io_result_mk_ok(lean_box(0));
+}
+
+// Add constant names to the completion index. The first batch after a
+// clear becomes the base (imports); later batches are per-cell deltas.
+lean_object* xeus_kernel_completion_add(lean_object* handle_obj, b_lean_obj_arg names,
+                                        lean_object* /* world */) {
+    auto* state = to_kernel_state(handle_obj);
+    if (state && state->interpreter) {
+        state->interpreter->completions().add(string_array_to_vector(names));
+    }
+    return lean_io_result_mk_ok(lean_box(0));
+}
+
+// Remove names that cells on a dropped branch of the chain added.
+lean_object* xeus_kernel_completion_remove(lean_object* handle_obj, b_lean_obj_arg names,
+                                           lean_object* /* world */) {
+    auto* state = to_kernel_state(handle_obj);
+    if (state && state->interpreter) {
+        state->interpreter->completions().remove(string_array_to_vector(names));
+    }
+    return lean_io_result_mk_ok(lean_box(0));
+}
+
+// Replace the namespaces whose members complete unqualified.
+lean_object* xeus_kernel_completion_set_scope(lean_object* handle_obj, b_lean_obj_arg namespaces,
+                                              lean_object* /* world */) {
+    auto* state = to_kernel_state(handle_obj);
+    if (state && state->interpreter) {
+        state->interpreter->completions().set_scope(string_array_to_vector(namespaces));
+    }
+    return lean_io_result_mk_ok(lean_box(0));
+}
+
+// Empty the completion index, e.g. when the environment is rebuilt
+// from a different set of imports.
+lean_object* xeus_kernel_completion_clear(lean_object* handle_obj, lean_object* /* world */) {
+    auto* state = to_kernel_state(handle_obj);
+    if (state && state->interpreter) {
+        state->interpreter->completions().clear();
+    }
+    return lean_io_result_mk_ok(lean_box(0));
+}
+
+// Drop the per-cell completion names, keeping the imported base.
+lean_object* xeus_kernel_completion_clear_cells(lean_object* handle_obj, lean_object* /* world */) {
+    auto* state = to_kernel_state(handle_obj);
+    if (state && state->interpreter) {
+        state->interpreter->completions().clear_cells();
+    }
+    return lean_io_result_mk_ok(lean_box(0));
+}
+
+// Answer inspect request `id` with markdown ("" = nothing found).
+lean_object* xeus_kernel_send_inspect(lean_object* handle_obj, uint32_t id,
+                                      lean_object* text_obj, lean_object* /* world */) {
+    auto* state = to_kernel_state(handle_obj);
+    if (state && state->interpreter) {
+        state->interpreter->send_inspect(id, lean_string_cstr(text_obj));
+    }
+    return lean_io_result_mk_ok(lean_box(0));
+}
+
+// A cell is about to start elaborating: start its clock and capture its
+// stdout from here on.
+lean_object* xeus_kernel_begin_cell(lean_object* handle_obj, lean_object* /* world */) {
+    auto* state = to_kernel_state(handle_obj);
+    if (state && state->interpreter) {
+        state->interpreter->begin_cell();
+    }
+    return lean_io_result_mk_ok(lean_box(0));
+}
+
+// Wake the Lean loop from another Lean thread (a finished cell task).
+lean_object* xeus_kernel_wake_loop(lean_object* handle_obj, lean_object* /* world */) {
+    auto* state = to_kernel_state(handle_obj);
+    if (state && state->interpreter) {
+        state->interpreter->wake_lean_loop();
+    }
+    return lean_io_result_mk_ok(lean_box(0));
+}
+
+// CPUs the cgroup lets this process use, rounded up: cpu.max (v2) or
+// cpu.cfs_quota_us / cpu.cfs_period_us (v1). 0 when there is no quota.
+static unsigned cgroup_cpu_quota() {
+    long quota = -1, period = 0;
+    std::ifstream v2("/sys/fs/cgroup/cpu.max");
+    std::string q;
+    if (v2 >> q >> period) {
+        if (q == "max") return 0;
+        quota = std::atol(q.c_str());
+    } else {
+        std::ifstream fq("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        std::ifstream fp("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+        if (!(fq >> quota) || !(fp >> period)) return 0;
+    }
+    if (quota <= 0 || period <= 0) return 0;
+    return static_cast<unsigned>((quota + period - 1) / period);
+}
+
+// Worker count for parallel elaboration: the cgroup quota, capped by
+// the hardware thread count.
+lean_object* xeus_kernel_cpu_quota(lean_object* /* world */) {
+    unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+    unsigned quota = cgroup_cpu_quota();
+    if (quota > 0) cpus = std::min(cpus, quota);
+    return lean_io_result_mk_ok(lean_box_uint32(cpus));
+}
+
+// ---- Zygote ----
+// `xlean --zygote SOCKET` imports once, then forks a kernel for every
+// `xlean --attach SOCKET CONNECTION_FILE` (see `zygoteMain` in
+// XeusKernel.lean). Over the Unix socket the attacher first passes its
+// stdout and stderr (SCM_RIGHTS, on a single byte), so that the child's
+// output reaches the log Jupyter keeps for the attacher, then sends the
+// connection file and its working directory, one line each; the forked
+// child answers with its pid (or the zygote with "error: ...") and keeps
+// the connection open for as long as it runs. The socket is only open
+// to the user who started the zygote.
+
+static lean_object* io_error(const std::string& msg) {
+    return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string(msg.c_str())));
+}
+
+static bool read_line(int fd, std::string& out) {
+    out.clear();
+    char c;
+    while (true) {
+        ssize_t r = read(fd, &c, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        if (c == '\n') return true;
+        out.push_back(c);
+    }
+}
+
+static void write_all(int fd, const std::string& data) {
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t w = write(fd, data.data() + off, data.size() - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return;
+        off += static_cast<size_t>(w);
+    }
+}
+
+// Pass `fds` over `sock` with one byte of payload.
+static bool send_fds(int sock, const std::vector<int>& fds) {
+    char byte = 0;
+    iovec iov{&byte, 1};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()), 0);
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    ssize_t r;
+    do r = sendmsg(sock, &msg, 0); while (r < 0 && errno == EINTR);
+    return r == 1;
+}
+
+// Receive up to `max` descriptors sent by send_fds(). Empty on failure.
+static std::vector<int> recv_fds(int sock, std::size_t max) {
+    char byte;
+    iovec iov{&byte, 1};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * max), 0);
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    ssize_t r;
+    do r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC); while (r < 0 && errno == EINTR);
+    std::vector<int> fds;
+    if (r != 1) return fds;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        std::size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        fds.resize(n);
+        std::memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * n);
+    }
+    return fds;
+}
+
+// Block until the peer closes `fd`.
+static void wait_for_eof(int fd) {
+    char c;
+    while (true) {
+        ssize_t r = read(fd, &c, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return;
+    }
+}
+
+static int unix_socket(const std::string& path, sockaddr_un& addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    if (path.size() >= sizeof(addr.sun_path)) return -1;
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path.c_str());
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+static int thread_count() {
+    int n = 0;
+    if (DIR* dir = opendir("/proc/self/task")) {
+        while (dirent* e = readdir(dir)) {
+            if (e->d_name[0] != '.') ++n;
+        }
+        closedir(dir);
+    }
+    return n;
+}
+
+lean_object* xeus_zygote_serve(lean_object* socket_obj, lean_object* /* world */) {
+    std::string path = lean_string_cstr(socket_obj);
+    sockaddr_un addr;
+    int listener = unix_socket(path, addr);
+    if (listener < 0) return io_error("zygote: cannot create socket " + path);
+    unlink(path.c_str());
+    // Whoever can connect gets a kernel running as this user: create the
+    // socket owner-only, with no window in which it is wider.
+    mode_t old_mask = umask(0177);
+    int bound = bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || chmod(path.c_str(), 0600) < 0 || listen(listener, 16) < 0) {
+        std::string err = std::strerror(errno);
+        close(listener);
+        return io_error("zygote: cannot listen on " + path + ": " + err);
+    }
+    signal(SIGCHLD, SIG_IGN);  // no zombies; the zygote never waits
+    // The imports leave Lean's task workers parked, and fork() copies
+    // the calling thread only: a child would inherit a task manager that
+    // counts workers it does not have, and its first task would never
+    // run. Stop them here (the zygote runs no Lean code while serving;
+    // without a task manager a task would just run inline) and give
+    // each child a fresh one.
+    lean_finalize_task_manager();
+    XLEAN_LOG("zygote", info, "listening on " << path
+                                  << " (" << thread_count() << " thread(s))");
+
+    while (true) {
+        int conn = accept(listener, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            std::string err = std::strerror(errno);
+            close(listener);
+            return io_error("zygote: accept failed: " + err);
+        }
+        std::vector<int> stdio = recv_fds(conn, 2);
+        auto close_stdio = [&stdio] {
+            for (int fd : stdio) close(fd);
+        };
+        std::string connection_file, cwd;
+        if (stdio.size() != 2 || !read_line(conn, connection_file) || !read_line(conn, cwd)) {
+            close_stdio();
+            close(conn);
+            continue;
+        }
+        // Anything the task manager does not own (a thread a preloaded
+        // library started, say) would be missing in the child, along
+        // with any lock it held.
+        int threads = thread_count();
+        if (threads > 1) {
+            write_all(conn, "error: zygote has " + std::to_string(threads) +
+                                " threads, refusing to fork\n");
+            close_stdio();
+            close(conn);
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            write_all(conn, std::string("error: fork failed: ") + std::strerror(errno) + "\n");
+            close_stdio();
+            close(conn);
+            continue;
+        }
+        if (pid > 0) {
+            XLEAN_LOG("zygote", info, "forked kernel " << pid << " for " << connection_file);
+            close_stdio();
+            close(conn);
+            continue;
+        }
+
+        // Child: become the kernel for `connection_file`, writing where
+        // the attacher writes.
+        close(listener);
+        signal(SIGCHLD, SIG_DFL);
+        std::cout.flush();
+        std::cerr.flush();
+        std::fflush(nullptr);
+        dup2(stdio[0], STDOUT_FILENO);
+        dup2(stdio[1], STDERR_FILENO);
+        for (int fd : stdio) {
+            if (fd > STDERR_FILENO) close(fd);
+        }
+        if (!cwd.empty() && chdir(cwd.c_str()) != 0) {
+            XLEAN_LOG("zygote", warn, "chdir " << cwd << " failed: " << std::strerror(errno));
+        }
+        lean_init_task_manager();
+        write_all(conn, std::to_string(getpid()) + "\n");
+        // The attacher is what Jupyter started and will kill; when it
+        // goes away, so does this kernel. Stop the way SIGTERM does, and
+        // only exit outright if the loop has not returned by then.
+        std::thread([conn] {
+            wait_for_eof(conn);
+            g_stop_requested.store(true);
+            std::this_thread::sleep_for(std::chrono::seconds(30));
+            _exit(0);
+        }).detach();
+        return lean_io_result_mk_ok(lean_mk_string(connection_file.c_str()));
+    }
+}
+
+static volatile sig_atomic_t g_zygote_child = 0;
+
+static void forward_to_zygote_child(int sig) {
+    if (g_zygote_child > 0) kill(g_zygote_child, sig);
+}
+
+lean_object* xeus_zygote_attach(lean_object* socket_obj, lean_object* connection_file_obj,
+                                lean_object* /* world */) {
+    std::string path = lean_string_cstr(socket_obj);
+    sockaddr_un addr;
+    int fd = unix_socket(path, addr);
+    if (fd < 0) return io_error("attach: cannot create socket " + path);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        std::string err = std::strerror(errno);
+        close(fd);
+        return io_error("attach: no zygote at " + path + ": " + err);
+    }
+    if (!send_fds(fd, {STDOUT_FILENO, STDERR_FILENO})) {
+        std::string err = std::strerror(errno);
+        close(fd);
+        return io_error("attach: cannot pass stdout/stderr to " + path + ": " + err);
+    }
+    // The child runs in the zygote's directory unless told otherwise.
+    char buf[PATH_MAX];
+    std::string connection_file = lean_string_cstr(connection_file_obj);
+    if (realpath(connection_file.c_str(), buf)) connection_file = buf;
+    std::string cwd = getcwd(buf, sizeof(buf)) ? buf : "";
+    write_all(fd, connection_file + "\n" + cwd + "\n");
+
+    std::string reply;
+    if (!read_line(fd, reply) || reply.rfind("error:", 0) == 0) {
+        close(fd);
+        return io_error("attach: " + (reply.empty() ? std::string("zygote hung up") : reply));
+    }
+    g_zygote_child = static_cast<sig_atomic_t>(std::atoi(reply.c_str()));
+    struct sigaction sa {};
+    sa.sa_handler = forward_to_zygote_child;
+    sigemptyset(&sa.sa_mask);
+    for (int sig : {SIGINT, SIGTERM, SIGHUP}) sigaction(sig, &sa, nullptr);
+    XLEAN_LOG("zygote", debug, "attached to kernel " << g_zygote_child);
+
+    wait_for_eof(fd);
+    close(fd);
+    return lean_io_result_mk_ok(lean_box(0));
+}
+
 }  // extern "C"
@@ -13,6 +13,7 @@
 #include <unordered_set>
 #include <unordered_map>
 #include <stdexcept>
+#include <algorithm>
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten/stack.h>
@@ -20,6 +21,8 @@
 #endif
 
 #include "xeus-lean/xinterpreter_wasm.hpp"
+#include "xeus-lean/xtrace.hpp"
+#include "xeus-lean/xutf8.hpp"
 #include "xeus/xhelper.hpp"
 
 #include <lean/lean.h>
@@ -98,22 +101,22 @@ static void rstrip_one_newline(std::string& s)
 
 // Diagnostic: test that hash tables work in wasm64
 static void test_hash_tables() {
-    std::cerr << "[WASM] test_hash_tables: sizeof(size_t)=" << sizeof(size_t)
-              << " sizeof(void*)=" << sizeof(void*) << std::endl;
+    XLEAN_LOG("wasm", debug, "test_hash_tables: sizeof(size_t)=" << sizeof(size_t)
+              << " sizeof(void*)=" << sizeof(void*));
     try {
         // Test 1: basic unordered_set<int>
         std::unordered_set<int> s;
         for (int i = 0; i < 10000; i++) s.insert(i);
-        std::cerr << "[WASM] test_hash_tables: unordered_set<int> size=" << s.size()
-                  << " buckets=" << s.bucket_count() << std::endl;
+        XLEAN_LOG("wasm", debug, "test_hash_tables: unordered_set<int> size=" << s.size()
+                  << " buckets=" << s.bucket_count());
 
         // Test 2: unordered_map<void*, void*> (like lean's m_cache)
         std::unordered_map<void*, void*> m;
         for (int i = 0; i < 10000; i++) {
             m[(void*)(uintptr_t)(i * 8)] = (void*)(uintptr_t)i;
         }
-        std::cerr << "[WASM] test_hash_tables: unordered_map<void*,void*> size=" << m.size()
-                  << " buckets=" << m.bucket_count() << std::endl;
+        XLEAN_LOG("wasm", debug, "test_hash_tables: unordered_map<void*,void*> size=" << m.size()
+                  << " buckets=" << m.bucket_count());
 
         // Test 3: unordered_set with custom hash (like lean's sharecommon)
         struct ptr_hash {
@@ -126,12 +129,12 @@ static void test_hash_tables() {
         for (int i = 0; i < 10000; i++) {
             cs.insert((void*)(uintptr_t)(i * 16));
         }
-        std::cerr << "[WASM] test_hash_tables: custom set size=" << cs.size()
-                  << " buckets=" << cs.bucket_count() << std::endl;
+        XLEAN_LOG("wasm", debug, "test_hash_tables: custom set size=" << cs.size()
+                  << " buckets=" << cs.bucket_count());
 
-        std::cerr << "[WASM] test_hash_tables: ALL PASSED" << std::endl;
+        XLEAN_LOG("wasm", debug, "test_hash_tables: ALL PASSED");
     } catch (const std::exception& e) {
-        std::cerr << "[WASM] test_hash_tables: FAILED: " << e.what() << std::endl;
+        XLEAN_LOG("wasm", error, "test_hash_tables: FAILED: " << e.what());
     }
 }
 
@@ -167,6 +170,12 @@ extern "C" {
                                          lean_object* prefix_str,
                                          uint32_t env_id,
                                          uint8_t has_env);
+    lean_object* lean_wasm_repl_inspect(lean_object* state_ref,
+                                        lean_object* code,
+                                        uint32_t pos,
+                                        lean_object* ident);
+    lean_object* lean_wasm_repl_invalidate_runtime();
+    lean_object* lean_wasm_repl_reset(lean_object* state_ref);
 }
 
 interpreter::interpreter()
@@ -205,7 +214,7 @@ bool interpreter::initialize_lean_runtime()
 
         res = initialize_xeus_x2dlean_REPL(1);
         if (lean_io_result_is_error(res)) {
-            std::cerr << "[WASM] Failed to initialize REPL module" << std::endl;
+            XLEAN_LOG("wasm", error, "Failed to initialize REPL module");
             lean_dec(res);
             return false;
         }
@@ -213,7 +222,7 @@ bool interpreter::initialize_lean_runtime()
 
         res = initialize_xeus_x2dlean_REPL_Main(1);
         if (lean_io_result_is_error(res)) {
-            std::cerr << "[WASM] Failed to initialize REPL.Main module" << std::endl;
+            XLEAN_LOG("wasm", error, "Failed to initialize REPL.Main module");
             lean_dec(res);
             return false;
         }
@@ -221,7 +230,7 @@ bool interpreter::initialize_lean_runtime()
 
         res = initialize_xeus_x2dlean_WasmRepl(1);
         if (lean_io_result_is_error(res)) {
-            std::cerr << "[WASM] Failed to initialize WasmRepl module" << std::endl;
+            XLEAN_LOG("wasm", error, "Failed to initialize WasmRepl module");
             lean_dec(res);
             return false;
         }
@@ -232,7 +241,7 @@ bool interpreter::initialize_lean_runtime()
         // Initialize search path
         res = lean_wasm_repl_init();
         if (lean_io_result_is_error(res)) {
-            std::cerr << "[WASM] Failed to initialize REPL" << std::endl;
+            XLEAN_LOG("wasm", error, "Failed to initialize REPL");
             lean_dec(res);
             return false;
         }
@@ -241,7 +250,7 @@ bool interpreter::initialize_lean_runtime()
         // Create REPL state (IO.Ref State)
         res = lean_wasm_repl_create_state();
         if (lean_io_result_is_error(res)) {
-            std::cerr << "[WASM] Failed to create REPL state" << std::endl;
+            XLEAN_LOG("wasm", error, "Failed to create REPL state");
             lean_dec(res);
             return false;
         }
@@ -251,47 +260,47 @@ bool interpreter::initialize_lean_runtime()
         lean_dec(res);
 
         m_initialized = true;
-        std::cerr << "[WASM] Lean runtime initialized successfully" << std::endl;
+        XLEAN_LOG("wasm", debug, "Lean runtime initialized successfully");
         return true;
 
     } catch (const std::exception& e) {
-        std::cerr << "[WASM] Exception during initialization: " << e.what() << std::endl;
+        XLEAN_LOG("wasm", error, "Exception during initialization: " << e.what());
         return false;
     }
 }
 
 std::string interpreter::call_lean_repl(const std::string& code, int env)
 {
-    std::cerr << "[WASM] call_lean_repl: ENTER code='" << code.substr(0, 50) << "' env=" << env << std::endl;
+    XLEAN_LOG("wasm", trace, "call_lean_repl: ENTER code='" << code.substr(0, 50) << "' env=" << env);
 
     if (!m_repl_state) {
-        std::cerr << "[WASM] call_lean_repl: REPL not initialized!" << std::endl;
+        XLEAN_LOG("wasm", error, "call_lean_repl: REPL not initialized!");
         return "{\"message\": \"REPL not initialized\"}";
     }
 
-    std::cerr << "[WASM] call_lean_repl: creating string object" << std::endl;
+    XLEAN_LOG("wasm", trace, "call_lean_repl: creating string object");
     lean_object* code_obj = lean_mk_string(code.c_str());
 
-    std::cerr << "[WASM] call_lean_repl: preparing state_ref" << std::endl;
+    XLEAN_LOG("wasm", trace, "call_lean_repl: preparing state_ref");
     lean_object* state_ref = static_cast<lean_object*>(m_repl_state);
     lean_inc(state_ref);
 
     uint8_t has_env = (env >= 0) ? 1 : 0;
     uint32_t env_id = (env >= 0) ? static_cast<uint32_t>(env) : 0;
-    std::cerr << "[WASM] call_lean_repl: calling lean_wasm_repl_execute (has_env=" << (int)has_env << " env_id=" << env_id << ")" << std::endl;
+    XLEAN_LOG("wasm", trace, "call_lean_repl: calling lean_wasm_repl_execute (has_env=" << (int)has_env << " env_id=" << env_id << ")");
 
     lean_object* res;
     try {
         res = lean_wasm_repl_execute(state_ref, code_obj, env_id, has_env);
     } catch (const std::exception& e) {
-        std::cerr << "[WASM] call_lean_repl: C++ EXCEPTION: " << e.what() << std::endl;
+        XLEAN_LOG("wasm", error, "call_lean_repl: C++ EXCEPTION: " << e.what());
         return "{\"error\": \"C++ exception: " + std::string(e.what()) + "\"}";
     }
 
-    std::cerr << "[WASM] call_lean_repl: lean_wasm_repl_execute returned" << std::endl;
+    XLEAN_LOG("wasm", trace, "call_lean_repl: lean_wasm_repl_execute returned");
 
     if (lean_io_result_is_error(res)) {
-        std::cerr << "[WASM] call_lean_repl: execution returned error" << std::endl;
+        XLEAN_LOG("wasm", error, "call_lean_repl: execution returned error");
         lean_io_result_show_error(res);
         lean_dec(res);
         return "{\"error\": \"Lean REPL execution failed\"}";
@@ -300,15 +309,37 @@ std::string interpreter::call_lean_repl(const std::string& code, int env)
     lean_object* result = lean_io_result_get_value(res);
     const char* result_str = lean_string_cstr(result);
     std::string output = result_str ? result_str : "";
-    std::cerr << "[WASM] call_lean_repl: result='" << output.substr(0, 200) << "'" << std::endl;
+    XLEAN_LOG("wasm", debug, "call_lean_repl: result='" << output.substr(0, 200) << "'");
     lean_dec(res);
 
     return output;
 }
 
+// `%reset`: rewind the REPL to the post-import environment. Returns a
+// result JSON shaped like call_lean_repl's, whose `env` is where the
+// next cell continues.
+std::string interpreter::call_lean_reset()
+{
+    if (!m_repl_state) {
+        return "{\"error\": \"REPL not initialized\"}";
+    }
+    lean_object* state_ref = static_cast<lean_object*>(m_repl_state);
+    lean_inc(state_ref);
+    lean_object* res = lean_wasm_repl_reset(state_ref);
+    if (lean_io_result_is_error(res)) {
+        XLEAN_LOG("wasm", error, "call_lean_reset: reset returned error");
+        lean_io_result_show_error(res);
+        lean_dec(res);
+        return "{\"error\": \"Lean REPL reset failed\"}";
+    }
+    std::string output = lean_string_cstr(lean_io_result_get_value(res));
+    lean_dec(res);
+    return output;
+}
+
 void interpreter::configure_impl()
 {
-    std::cerr << "[WASM] configure_impl: ENTER" << std::endl;
+    XLEAN_LOG("wasm", trace, "configure_impl: ENTER");
     // Olean loading used to live here as an embedded EM_ASM block
     // that fetched `manifest.json` (v1, one entry per file) over
     // synchronous XMLHttpRequest.  Synchronous XHR fails silently
@@ -324,7 +355,7 @@ void interpreter::configure_impl()
     // already has every Init/Std/Lean/Sparkle/Hesper olean.
     test_hash_tables();
     initialize_lean_runtime();
-    std::cerr << "[WASM] configure_impl: EXIT" << std::endl;
+    XLEAN_LOG("wasm", trace, "configure_impl: EXIT");
 }
 
 #ifdef __EMSCRIPTEN__
@@ -515,6 +546,9 @@ extern "C" EMSCRIPTEN_KEEPALIVE void xlean_poll_load_progress()
         return;
     }
     if (st == 1) {
+        // New oleans (and possibly a .xeus-auto-imports registry) are
+        // now under /lib/lean; drop the cached runtime context.
+        lean_dec(lean_wasm_repl_invalidate_runtime());
         c->cb(xeus::create_successful_reply());
     } else {
         int n = xlean_load_fail_msg_to(buf, sizeof(buf));
@@ -604,14 +638,14 @@ extern "C" EMSCRIPTEN_KEEPALIVE void xlean_poll_memory()
 }
 #endif
 
-// Detect a single-line `%memory` magic.  Returns true iff the entire
-// trimmed cell body is `%memory`.
-static bool is_memory_magic(const std::string& code)
+// Detect an argument-less magic such as `%memory` or `%reset`.
+// Returns true iff the entire trimmed cell body is `magic`.
+static bool is_bare_magic(const std::string& code, const std::string& magic)
 {
     size_t start = code.find_first_not_of(" \t\r\n");
     if (start == std::string::npos) return false;
-    if (code.compare(start, 7, "%memory") != 0) return false;
-    size_t after = start + 7;
+    if (code.compare(start, magic.size(), magic) != 0) return false;
+    size_t after = start + magic.size();
     // Allow trailing whitespace / newlines but nothing else.
     while (after < code.size()) {
         char ch = code[after];
@@ -658,7 +692,7 @@ void interpreter::execute_request_impl(send_reply_callback cb,
                                         xeus::execute_request_config /*config*/,
                                         nl::json /*user_expressions*/)
 {
-    std::cerr << "[WASM] execute_request_impl: ENTER (code=" << code.substr(0, 50) << ")" << std::endl;
+    XLEAN_LOG("wasm", trace, "execute_request_impl: ENTER (code=" << code.substr(0, 50) << ")");
     if (!m_initialized) {
         if (!initialize_lean_runtime()) {
             publish_execution_error("LeanError", "Failed to initialize Lean runtime", {});
@@ -684,7 +718,7 @@ void interpreter::execute_request_impl(send_reply_callback cb,
     // `%memory` first: it's a passive snapshot and cheaper than
     // anything below.  Same fire-and-forget+poll pattern as %load
     // because navigator.storage.estimate() is async.
-    if (is_memory_magic(code)) {
+    if (is_bare_magic(code, "%memory")) {
 #ifdef __EMSCRIPTEN__
         xlean_memory_kick();
         g_memory_ctx.reset(new MemoryCtx{this, std::move(cb)});
@@ -717,8 +751,11 @@ void interpreter::execute_request_impl(send_reply_callback cb,
 #endif
     }
 
-    // Call the Lean REPL
-    std::string result_json = call_lean_repl(code, m_current_env);
+    // Call the Lean REPL. `%reset` goes back to the post-import
+    // environment instead; its reply is rendered like any cell's.
+    std::string result_json = is_bare_magic(code, "%reset")
+        ? call_lean_reset()
+        : call_lean_repl(code, m_current_env);
 
     // Parse the result
     try {
@@ -771,7 +808,7 @@ void interpreter::execute_request_impl(send_reply_callback cb,
                     // Lean's stock "'foo' has already been declared" error
                     // is bewildering to notebook users who try to redefine
                     // a value across cells.  Append a hint that points at
-                    // the actual fix (rename or restart kernel).
+                    // the actual fix (rename or %reset).
                     static const std::string declared_suffix =
                         "has already been declared";
                     if (!data.empty() && data.front() == '\'' &&
@@ -782,9 +819,8 @@ void interpreter::execute_request_impl(send_reply_callback cb,
                         data +=
                             "\n  hint: this notebook kernel keeps every "
                             "previously-defined name in scope. Either rename "
-                            "this definition, or restart the kernel "
-                            "(Kernel \xe2\x86\x92 Restart) to clear the old "
-                            "binding.";
+                            "this definition, or run %reset to go back to the "
+                            "post-import environment (no re-import needed).";
                     }
                     append_line(std::to_string(line) + ":"
                                 + std::to_string(col) + ": "
@@ -886,7 +922,7 @@ void interpreter::execute_request_impl(send_reply_callback cb,
 nl::json interpreter::complete_request_impl(const std::string& code,
                                              int cursor_pos)
 {
-    std::cerr << "[WASM] complete_request_impl: ENTER (cursor=" << cursor_pos << ")" << std::endl;
+    XLEAN_LOG("wasm", trace, "complete_request_impl: ENTER (cursor=" << cursor_pos << ")");
     if (!m_initialized || !m_repl_state) {
         return xeus::create_complete_reply({}, cursor_pos, cursor_pos);
     }
@@ -904,7 +940,7 @@ nl::json interpreter::complete_request_impl(const std::string& code,
         }
     }
     std::string prefix = code.substr(start, cursor_pos - start);
-    std::cerr << "[WASM] complete_request_impl: prefix='" << prefix << "'" << std::endl;
+    XLEAN_LOG("wasm", debug, "complete_request_impl: prefix='" << prefix << "'");
 
     if (prefix.empty()) {
         return xeus::create_complete_reply({}, cursor_pos, cursor_pos);
@@ -921,7 +957,7 @@ nl::json interpreter::complete_request_impl(const std::string& code,
     lean_object* res = lean_wasm_repl_complete(state_ref, prefix_obj, env_id, has_env);
 
     if (lean_io_result_is_error(res)) {
-        std::cerr << "[WASM] complete_request_impl: Lean error" << std::endl;
+        XLEAN_LOG("wasm", error, "complete_request_impl: Lean error");
         lean_dec(res);
         return xeus::create_complete_reply({}, cursor_pos, cursor_pos);
     }
@@ -931,7 +967,7 @@ nl::json interpreter::complete_request_impl(const std::string& code,
     std::string json_str = result_str ? result_str : "";
     lean_dec(res);
 
-    std::cerr << "[WASM] complete_request_impl: result='" << json_str.substr(0, 200) << "'" << std::endl;
+    XLEAN_LOG("wasm", debug, "complete_request_impl: result='" << json_str.substr(0, 200) << "'");
 
     // Parse the JSON response from Lean
     nl::json matches_list = nl::json::array();
@@ -941,29 +977,59 @@ nl::json interpreter::complete_request_impl(const std::string& code,
             matches_list = parsed["matches"];
         }
     } catch (...) {
-        std::cerr << "[WASM] complete_request_impl: JSON parse error" << std::endl;
+        XLEAN_LOG("wasm", error, "complete_request_impl: JSON parse error");
     }
 
     return xeus::create_complete_reply(matches_list, start, cursor_pos);
 }
 
-nl::json interpreter::inspect_request_impl(const std::string& /*code*/,
-                                            int /*cursor_pos*/,
+nl::json interpreter::inspect_request_impl(const std::string& code,
+                                            int cursor_pos,
                                             int /*detail_level*/)
 {
-    std::cerr << "[WASM] inspect_request_impl: ENTER" << std::endl;
-    return xeus::create_inspect_reply(false);
+    XLEAN_LOG("wasm", trace, "inspect_request_impl: ENTER (cursor=" << cursor_pos << ")");
+    if (!m_initialized || !m_repl_state) {
+        return xeus::create_inspect_reply(false);
+    }
+
+    // Identifier around the cursor, cut the way the native kernel cuts
+    // it. The cursor counts codepoints; Lean wants a byte offset.
+    std::size_t pos = utf8_byte_offset(code, static_cast<std::size_t>(std::max(cursor_pos, 0)));
+    std::size_t start = lean_ident_start(code, pos);
+    std::size_t end = lean_ident_end(code, start);
+
+    lean_object* state_ref = static_cast<lean_object*>(m_repl_state);
+    lean_inc(state_ref);
+    lean_object* res = lean_wasm_repl_inspect(state_ref,
+                                              lean_mk_string(code.c_str()),
+                                              static_cast<uint32_t>(pos),
+                                              lean_mk_string(code.substr(start, end - start).c_str()));
+    if (lean_io_result_is_error(res)) {
+        XLEAN_LOG("wasm", error, "inspect_request_impl: Lean error");
+        lean_dec(res);
+        return xeus::create_inspect_reply(false);
+    }
+    std::string text = lean_string_cstr(lean_io_result_get_value(res));
+    lean_dec(res);
+
+    if (text.empty()) {
+        return xeus::create_inspect_reply(false);
+    }
+    nl::json data;
+    data["text/markdown"] = text;
+    data["text/plain"] = text;
+    return xeus::create_inspect_reply(true, data);
 }
 
 nl::json interpreter::is_complete_request_impl(const std::string& /*code*/)
 {
-    std::cerr << "[WASM] is_complete_request_impl: ENTER" << std::endl;
+    XLEAN_LOG("wasm", trace, "is_complete_request_impl: ENTER");
     return xeus::create_is_complete_reply("complete");
 }
 
 nl::json interpreter::kernel_info_request_impl()
 {
-    std::cerr << "[WASM] kernel_info_request_impl: ENTER" << std::endl;
+    XLEAN_LOG("wasm", trace, "kernel_info_request_impl: ENTER");
     return xeus::create_info_reply(
         "",                              // protocol version (auto-filled)
         "xlean",                         // implementation
@@ -980,7 +1046,7 @@ nl::json interpreter::kernel_info_request_impl()
 
 void interpreter::shutdown_request_impl()
 {
-    std::cerr << "[WASM] shutdown_request_impl: ENTER" << std::endl;
+    XLEAN_LOG("wasm", trace, "shutdown_request_impl: ENTER");
     if (m_repl_state) {
         lean_dec(static_cast<lean_object*>(m_repl_state));
         m_repl_state = nullptr;